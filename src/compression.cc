@@ -0,0 +1,291 @@
+#include "compression.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#ifdef NCODE_WEB_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "ncode_common/src/logging.h"
+
+namespace nc {
+namespace web {
+
+// Input is compressed in pieces of up to this many bytes.
+static constexpr size_t kInputBufferSize = 1 << 14;
+
+// Compressed output is emitted in pieces of up to this many bytes.
+static constexpr size_t kOutputBufferSize = 1 << 14;
+
+// Pages are compressed as they are sent, the default zlib level is a good
+// trade-off between time and size.
+static constexpr int kGzipLevel = 6;
+
+// Same as above, brotli's levels above 5 get much slower for little gain.
+static constexpr int kBrotliQuality = 5;
+
+// zlib's largest window, 16 on top of it selects a gzip header and trailer
+// instead of a zlib one.
+static constexpr int kGzipWindowBits = 15 + 16;
+
+namespace {
+
+class GzipEmitter : public CompressingEmitter {
+ public:
+  explicit GzipEmitter(ctemplate::ExpandEmitter* out)
+      : CompressingEmitter(out) {
+    memset(&stream_, 0, sizeof(stream_));
+    CHECK(deflateInit2(&stream_, kGzipLevel, Z_DEFLATED, kGzipWindowBits, 8,
+                       Z_DEFAULT_STRATEGY) == Z_OK);
+  }
+
+  ~GzipEmitter() override { deflateEnd(&stream_); }
+
+ protected:
+  void Compress(const char* data, size_t len, bool finish) override {
+    // zlib does not modify the input, but its API is not const.
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream_.avail_in = static_cast<uInt>(len);
+
+    // Output that fills up the buffer means there may be more.
+    char buffer[kOutputBufferSize];
+    do {
+      stream_.next_out = reinterpret_cast<Bytef*>(buffer);
+      stream_.avail_out = sizeof(buffer);
+      int result = deflate(&stream_, finish ? Z_FINISH : Z_NO_FLUSH);
+      CHECK(result != Z_STREAM_ERROR);
+
+      size_t produced = sizeof(buffer) - stream_.avail_out;
+      if (produced != 0) {
+        out_->Emit(buffer, produced);
+      }
+    } while (stream_.avail_out == 0);
+  }
+
+ private:
+  z_stream stream_;
+};
+
+#ifdef NCODE_WEB_HAVE_BROTLI
+class BrotliEmitter : public CompressingEmitter {
+ public:
+  explicit BrotliEmitter(ctemplate::ExpandEmitter* out)
+      : CompressingEmitter(out),
+        state_(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr)) {
+    CHECK(state_ != nullptr);
+    BrotliEncoderSetParameter(state_, BROTLI_PARAM_QUALITY, kBrotliQuality);
+    BrotliEncoderSetParameter(state_, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+  }
+
+  ~BrotliEmitter() override { BrotliEncoderDestroyInstance(state_); }
+
+ protected:
+  void Compress(const char* data, size_t len, bool finish) override {
+    const uint8_t* next_in = reinterpret_cast<const uint8_t*>(data);
+    size_t avail_in = len;
+    BrotliEncoderOperation op =
+        finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+
+    uint8_t buffer[kOutputBufferSize];
+    while (true) {
+      uint8_t* next_out = buffer;
+      size_t avail_out = sizeof(buffer);
+      CHECK(BrotliEncoderCompressStream(state_, op, &avail_in, &next_in,
+                                        &avail_out, &next_out, nullptr));
+
+      size_t produced = sizeof(buffer) - avail_out;
+      if (produced != 0) {
+        out_->Emit(reinterpret_cast<const char*>(buffer), produced);
+      }
+
+      if (avail_in == 0 && !BrotliEncoderHasMoreOutput(state_) &&
+          (!finish || BrotliEncoderIsFinished(state_))) {
+        return;
+      }
+    }
+  }
+
+ private:
+  BrotliEncoderState* state_;
+};
+#endif
+
+// Returns the q value of an Accept-Encoding element's parameters, like
+// ";q=0.5".
+double QValue(const std::string& params) {
+  size_t q_pos = params.find("q=");
+  if (q_pos == std::string::npos) {
+    return 1.0;
+  }
+
+  return strtod(params.c_str() + q_pos + 2, nullptr);
+}
+
+// Removes whitespace from both ends.
+std::string Trim(const std::string& s) {
+  size_t start = s.find_first_not_of(" \t");
+  if (start == std::string::npos) {
+    return "";
+  }
+
+  size_t end = s.find_last_not_of(" \t");
+  return s.substr(start, end - start + 1);
+}
+
+}  // namespace
+
+const char* ContentEncodingName(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::kIdentity:
+      return "identity";
+    case ContentEncoding::kGzip:
+      return "gzip";
+    case ContentEncoding::kBrotli:
+      return "br";
+  }
+
+  LOG(FATAL) << "Bad encoding";
+  return nullptr;
+}
+
+bool CanCompress(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::kIdentity:
+      return false;
+    case ContentEncoding::kGzip:
+      return true;
+    case ContentEncoding::kBrotli:
+#ifdef NCODE_WEB_HAVE_BROTLI
+      return true;
+#else
+      return false;
+#endif
+  }
+
+  return false;
+}
+
+bool AcceptsEncoding(const char* accept_encoding, ContentEncoding encoding) {
+  if (encoding == ContentEncoding::kIdentity) {
+    return true;
+  }
+
+  if (accept_encoding == nullptr) {
+    return false;
+  }
+
+  // Elements look like "gzip", "br;q=0.8" or "*;q=0", separated by commas.
+  // An encoding that is listed by name is not matched by "*".
+  const char* name = ContentEncodingName(encoding);
+  bool accepted_by_wildcard = false;
+  std::string header(accept_encoding);
+  size_t start = 0;
+  while (start <= header.size()) {
+    size_t end = header.find(',', start);
+    if (end == std::string::npos) {
+      end = header.size();
+    }
+
+    std::string element = header.substr(start, end - start);
+    size_t params_pos = element.find(';');
+    std::string coding = Trim(element.substr(0, params_pos));
+    double q = params_pos == std::string::npos
+                   ? 1.0
+                   : QValue(element.substr(params_pos));
+    if (strcasecmp(coding.c_str(), name) == 0) {
+      return q > 0;
+    }
+
+    if (coding == "*") {
+      accepted_by_wildcard = q > 0;
+    }
+
+    start = end + 1;
+  }
+
+  return accepted_by_wildcard;
+}
+
+CompressingEmitter::CompressingEmitter(ctemplate::ExpandEmitter* out)
+    : out_(out) {
+  buffer_.reserve(kInputBufferSize);
+}
+
+std::unique_ptr<CompressingEmitter> CompressingEmitter::Create(
+    ContentEncoding encoding, ctemplate::ExpandEmitter* out) {
+  switch (encoding) {
+    case ContentEncoding::kIdentity:
+      return {};
+    case ContentEncoding::kGzip:
+      return make_unique<GzipEmitter>(out);
+    case ContentEncoding::kBrotli:
+#ifdef NCODE_WEB_HAVE_BROTLI
+      return make_unique<BrotliEmitter>(out);
+#else
+      return {};
+#endif
+  }
+
+  return {};
+}
+
+void CompressingEmitter::Emit(const char* s) { Emit(s, strlen(s)); }
+
+void CompressingEmitter::Emit(const char* s, size_t slen) {
+  if (buffer_.size() + slen > kInputBufferSize && !buffer_.empty()) {
+    Compress(buffer_.data(), buffer_.size(), false);
+    buffer_.clear();
+  }
+
+  if (slen >= kInputBufferSize) {
+    Compress(s, slen, false);
+    return;
+  }
+
+  buffer_.append(s, slen);
+}
+
+void CompressingEmitter::Finish() {
+  Compress(buffer_.data(), buffer_.size(), true);
+  buffer_.clear();
+}
+
+std::string Compress(ContentEncoding encoding, const std::string& data) {
+  std::string out;
+  ctemplate::StringEmitter string_emitter(&out);
+  std::unique_ptr<CompressingEmitter> emitter =
+      CompressingEmitter::Create(encoding, &string_emitter);
+  CHECK(emitter) << "Cannot compress with " << ContentEncodingName(encoding);
+  emitter->Emit(data);
+  emitter->Finish();
+  return out;
+}
+
+bool Gunzip(const std::string& data, std::string* out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, kGzipWindowBits) != Z_OK) {
+    return false;
+  }
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = static_cast<uInt>(data.size());
+
+  out->clear();
+  char buffer[4096];
+  int result;
+  do {
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    result = inflate(&stream, Z_NO_FLUSH);
+    out->append(buffer, sizeof(buffer) - stream.avail_out);
+  } while (result == Z_OK);
+
+  inflateEnd(&stream);
+  return result == Z_STREAM_END;
+}
+
+}  // namespace web
+}  // namespace nc
@@ -0,0 +1,76 @@
+#ifndef NCODE_WEB_COMPRESSION_H_
+#define NCODE_WEB_COMPRESSION_H_
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+#include "ctemplate/template_emitter.h"
+#include "ncode_common/src/common.h"
+
+namespace nc {
+namespace web {
+
+// Content codings a response can be sent with, in increasing order of
+// preference.
+enum class ContentEncoding { kIdentity, kGzip, kBrotli };
+
+// The name of an encoding, as used in Accept-Encoding and Content-Encoding
+// headers.
+const char* ContentEncodingName(ContentEncoding encoding);
+
+// True if CompressingEmitter can produce an encoding. Brotli needs the
+// library to have been built with libbrotlienc.
+bool CanCompress(ContentEncoding encoding);
+
+// Returns true if the value of a request's Accept-Encoding header, which may
+// be null, allows a response to be sent with an encoding. Identity is always
+// allowed.
+bool AcceptsEncoding(const char* accept_encoding, ContentEncoding encoding);
+
+// Compresses what is emitted to it and emits the compressed bytes to another
+// emitter, as they become available. Finish must be called after the last
+// piece of input.
+class CompressingEmitter : public ctemplate::ExpandEmitter {
+ public:
+  // Returns null if the encoding is identity or cannot be produced.
+  static std::unique_ptr<CompressingEmitter> Create(
+      ContentEncoding encoding, ctemplate::ExpandEmitter* out);
+
+  void Emit(char c) override { Emit(&c, 1); }
+  void Emit(const std::string& s) override { Emit(s.data(), s.size()); }
+  void Emit(const char* s) override;
+  void Emit(const char* s, size_t slen) override;
+
+  // Compresses what is left and ends the compressed stream.
+  void Finish();
+
+ protected:
+  explicit CompressingEmitter(ctemplate::ExpandEmitter* out);
+
+  // Compresses len bytes at data and emits whatever output is ready. If
+  // finish is true also ends the stream.
+  virtual void Compress(const char* data, size_t len, bool finish) = 0;
+
+  ctemplate::ExpandEmitter* out_;
+
+ private:
+  // Small pieces of input are collected here, compressing them one by one
+  // would be slow.
+  std::string buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(CompressingEmitter);
+};
+
+// Compresses a string in one go. The encoding should not be identity and
+// CanCompress should be true for it.
+std::string Compress(ContentEncoding encoding, const std::string& data);
+
+// Decompresses a gzip stream into out. Returns false if data is not a
+// complete gzip stream.
+bool Gunzip(const std::string& data, std::string* out);
+
+}  // namespace web
+}  // namespace nc
+
+#endif
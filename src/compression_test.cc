@@ -0,0 +1,133 @@
+#include "compression.h"
+
+#include <string>
+
+#ifdef NCODE_WEB_HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#include "ctemplate/template_emitter.h"
+#include "ncode_common/src/strutil.h"
+#include "gtest/gtest.h"
+
+namespace nc {
+namespace web {
+namespace {
+
+// Something that compresses well, and is larger than the buffers.
+std::string TestData() {
+  std::string data;
+  for (size_t i = 0; i < 20000; ++i) {
+    StrAppend(&data, "<p>", i, "</p>");
+  }
+
+  return data;
+}
+
+TEST(Compression, Gzip) {
+  std::string data = TestData();
+  std::string compressed = Compress(ContentEncoding::kGzip, data);
+  ASSERT_LT(compressed.size(), data.size());
+
+  std::string decompressed;
+  ASSERT_TRUE(Gunzip(compressed, &decompressed));
+  ASSERT_EQ(data, decompressed);
+}
+
+TEST(Compression, GzipEmpty) {
+  std::string decompressed = "x";
+  ASSERT_TRUE(Gunzip(Compress(ContentEncoding::kGzip, ""), &decompressed));
+  ASSERT_EQ("", decompressed);
+}
+
+TEST(Compression, GunzipTruncated) {
+  std::string compressed = Compress(ContentEncoding::kGzip, TestData());
+  std::string decompressed;
+  ASSERT_FALSE(Gunzip(compressed.substr(0, compressed.size() / 2),
+                      &decompressed));
+  ASSERT_FALSE(Gunzip("not gzip", &decompressed));
+}
+
+TEST(Compression, EmitterPieces) {
+  std::string data = TestData();
+  std::string compressed;
+  ctemplate::StringEmitter string_emitter(&compressed);
+  std::unique_ptr<CompressingEmitter> emitter =
+      CompressingEmitter::Create(ContentEncoding::kGzip, &string_emitter);
+  ASSERT_TRUE(emitter);
+
+  // Single characters, small pieces and one larger than the buffer.
+  emitter->Emit('x');
+  emitter->Emit("abc");
+  emitter->Emit(data);
+  emitter->Emit(data.data(), 10);
+  emitter->Finish();
+  std::string decompressed;
+  ASSERT_TRUE(Gunzip(compressed, &decompressed));
+  ASSERT_EQ(StrCat("xabc", data, data.substr(0, 10)), decompressed);
+}
+
+TEST(Compression, Identity) {
+  std::string out;
+  ctemplate::StringEmitter string_emitter(&out);
+  ASSERT_FALSE(CanCompress(ContentEncoding::kIdentity));
+  ASSERT_FALSE(
+      CompressingEmitter::Create(ContentEncoding::kIdentity, &string_emitter));
+}
+
+#ifdef NCODE_WEB_HAVE_BROTLI
+TEST(Compression, Brotli) {
+  std::string data = TestData();
+  std::string compressed = Compress(ContentEncoding::kBrotli, data);
+  ASSERT_LT(compressed.size(), data.size());
+
+  std::string decompressed(data.size(), '\0');
+  size_t decompressed_size = decompressed.size();
+  ASSERT_EQ(BROTLI_DECODER_RESULT_SUCCESS,
+            BrotliDecoderDecompress(
+                compressed.size(),
+                reinterpret_cast<const uint8_t*>(compressed.data()),
+                &decompressed_size,
+                reinterpret_cast<uint8_t*>(&decompressed[0])));
+  ASSERT_EQ(data.size(), decompressed_size);
+  ASSERT_EQ(data, decompressed);
+}
+#endif
+
+TEST(AcceptsEncoding, Identity) {
+  ASSERT_TRUE(AcceptsEncoding(nullptr, ContentEncoding::kIdentity));
+  ASSERT_TRUE(AcceptsEncoding("gzip", ContentEncoding::kIdentity));
+}
+
+TEST(AcceptsEncoding, NoHeader) {
+  ASSERT_FALSE(AcceptsEncoding(nullptr, ContentEncoding::kGzip));
+  ASSERT_FALSE(AcceptsEncoding("", ContentEncoding::kGzip));
+}
+
+TEST(AcceptsEncoding, List) {
+  const char* header = "gzip, deflate, br";
+  ASSERT_TRUE(AcceptsEncoding(header, ContentEncoding::kGzip));
+  ASSERT_TRUE(AcceptsEncoding(header, ContentEncoding::kBrotli));
+  ASSERT_FALSE(AcceptsEncoding("deflate", ContentEncoding::kGzip));
+  ASSERT_TRUE(AcceptsEncoding("GZIP", ContentEncoding::kGzip));
+}
+
+TEST(AcceptsEncoding, QValues) {
+  const char* header = "gzip;q=0.5, br;q=0";
+  ASSERT_TRUE(AcceptsEncoding(header, ContentEncoding::kGzip));
+  ASSERT_FALSE(AcceptsEncoding(header, ContentEncoding::kBrotli));
+  ASSERT_FALSE(AcceptsEncoding("gzip ; q=0.0", ContentEncoding::kGzip));
+}
+
+TEST(AcceptsEncoding, Wildcard) {
+  ASSERT_TRUE(AcceptsEncoding("*", ContentEncoding::kBrotli));
+  ASSERT_FALSE(AcceptsEncoding("*;q=0", ContentEncoding::kGzip));
+
+  // Listing an encoding by name takes precedence.
+  ASSERT_TRUE(AcceptsEncoding("gzip, *;q=0", ContentEncoding::kGzip));
+  ASSERT_FALSE(AcceptsEncoding("*, br;q=0", ContentEncoding::kBrotli));
+}
+
+}  // namespace
+}  // namespace web
+}  // namespace nc
@@ -0,0 +1,436 @@
+#include "http_server.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "ctemplate/template_emitter.h"
+#include "mongoose.h"
+#include "ncode_common/src/logging.h"
+#include "ncode_common/src/strutil.h"
+
+namespace nc {
+namespace web {
+
+// Pages are sent in chunks of up to this many bytes. Smaller pieces emitted
+// by a page are collected until there are this many.
+static constexpr size_t kChunkSize = 1 << 14;
+
+// Sent along with assets. Their contents never change for a given URL.
+static constexpr char kAssetHeaders[] =
+    "Cache-Control: public, max-age=31536000, immutable\r\n";
+
+namespace {
+
+const char* StatusText(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 204:
+      return "No Content";
+    case 301:
+      return "Moved Permanently";
+    case 302:
+      return "Found";
+    case 304:
+      return "Not Modified";
+    case 400:
+      return "Bad Request";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    case 500:
+      return "Internal Server Error";
+    default:
+      return "Unknown";
+  }
+}
+
+// Sends what a page emits to a connection with chunked transfer encoding.
+class ChunkedEmitter : public ctemplate::ExpandEmitter {
+ public:
+  explicit ChunkedEmitter(mg_connection* connection)
+      : connection_(connection), failed_(false) {
+    buffer_.reserve(kChunkSize);
+  }
+
+  void Emit(char c) override { Emit(&c, 1); }
+  void Emit(const std::string& s) override { Emit(s.data(), s.size()); }
+  void Emit(const char* s) override { Emit(s, strlen(s)); }
+  void Emit(const char* s, size_t slen) override {
+    if (buffer_.size() + slen > kChunkSize) {
+      Flush();
+    }
+
+    if (slen >= kChunkSize) {
+      WriteChunk(s, slen);
+      return;
+    }
+
+    buffer_.append(s, slen);
+  }
+
+  // Sends out what is left and the last, empty, chunk.
+  void Finish() {
+    Flush();
+    Write("0\r\n\r\n", 5);
+  }
+
+ private:
+  void Flush() {
+    if (!buffer_.empty()) {
+      WriteChunk(buffer_.data(), buffer_.size());
+      buffer_.clear();
+    }
+  }
+
+  void WriteChunk(const char* data, size_t len) {
+    char size_line[32];
+    int size_line_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+    Write(size_line, size_line_len);
+    Write(data, len);
+    Write("\r\n", 2);
+  }
+
+  void Write(const char* data, size_t len) {
+    if (failed_) {
+      // The client has gone away, the rest of the page is discarded.
+      return;
+    }
+
+    if (mg_write(connection_, data, len) <= 0) {
+      failed_ = true;
+    }
+  }
+
+  mg_connection* connection_;
+
+  // Data not sent yet.
+  std::string buffer_;
+
+  // Set when a write fails.
+  bool failed_;
+};
+
+// Responses to HEAD requests have the headers a GET would get, but no body.
+bool IsHeadRequest(mg_connection* connection) {
+  return strcmp(mg_get_request_info(connection)->request_method, "HEAD") == 0;
+}
+
+// Sends a response. Extra headers should each end with "\r\n".
+void SendResponse(mg_connection* connection, const HttpResponse& response,
+                  const std::string& extra_headers = "") {
+  mg_printf(connection,
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "%s\r\n",
+            response.status, StatusText(response.status),
+            response.content_type.c_str(), response.body.size(),
+            extra_headers.c_str());
+  if (!IsHeadRequest(connection)) {
+    mg_write(connection, response.body.data(), response.body.size());
+  }
+}
+
+// Returns the most preferred of the encodings that the client accepts and
+// that can be produced.
+ContentEncoding PageEncoding(mg_connection* connection) {
+  const char* accept_encoding = mg_get_header(connection, "Accept-Encoding");
+  for (ContentEncoding encoding :
+       {ContentEncoding::kBrotli, ContentEncoding::kGzip}) {
+    if (CanCompress(encoding) && AcceptsEncoding(accept_encoding, encoding)) {
+      return encoding;
+    }
+  }
+
+  return ContentEncoding::kIdentity;
+}
+
+void SendPage(mg_connection* connection, const HtmlPage& page,
+              bool compress) {
+  ContentEncoding encoding =
+      compress ? PageEncoding(connection) : ContentEncoding::kIdentity;
+
+  // Caches should keep a copy per encoding.
+  std::string encoding_headers;
+  if (compress) {
+    encoding_headers = "Vary: Accept-Encoding\r\n";
+  }
+  if (encoding != ContentEncoding::kIdentity) {
+    encoding_headers += StrCat("Content-Encoding: ",
+                               ContentEncodingName(encoding), "\r\n");
+  }
+
+  const char* http_version = mg_get_request_info(connection)->http_version;
+  if (http_version == nullptr || strcmp(http_version, "1.1") != 0) {
+    // HTTP/1.0 clients do not understand chunked encoding.
+    HttpResponse response;
+    response.content_type = "text/html; charset=utf-8";
+    response.body = page.Construct();
+    if (encoding != ContentEncoding::kIdentity) {
+      response.body = Compress(encoding, response.body);
+    }
+    SendResponse(connection, response, encoding_headers);
+    return;
+  }
+
+  mg_printf(connection,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/html; charset=utf-8\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "%s\r\n",
+            encoding_headers.c_str());
+  if (IsHeadRequest(connection)) {
+    return;
+  }
+
+  ChunkedEmitter chunked_emitter(connection);
+  std::unique_ptr<CompressingEmitter> compressing_emitter =
+      CompressingEmitter::Create(encoding, &chunked_emitter);
+  if (compressing_emitter) {
+    page.ConstructTo(compressing_emitter.get());
+    compressing_emitter->Finish();
+  } else {
+    page.ConstructTo(&chunked_emitter);
+  }
+  chunked_emitter.Finish();
+}
+
+}  // namespace
+
+HttpRequest::HttpRequest(mg_connection* connection)
+    : connection_(connection) {}
+
+const char* HttpRequest::method() const {
+  return mg_get_request_info(connection_)->request_method;
+}
+
+const char* HttpRequest::uri() const {
+  return mg_get_request_info(connection_)->uri;
+}
+
+const char* HttpRequest::GetHeader(const std::string& name) const {
+  return mg_get_header(connection_, name.c_str());
+}
+
+bool HttpRequest::GetQueryVar(const std::string& name,
+                              std::string* value) const {
+  const char* query_string = mg_get_request_info(connection_)->query_string;
+  if (query_string == nullptr) {
+    return false;
+  }
+
+  // Decoding never makes a variable longer.
+  size_t query_string_len = strlen(query_string);
+  std::vector<char> buffer(query_string_len + 1);
+  int len = mg_get_var(query_string, query_string_len, name.c_str(),
+                       buffer.data(), buffer.size());
+  if (len < 0) {
+    return false;
+  }
+
+  value->assign(buffer.data(), len);
+  return true;
+}
+
+HttpServer::HttpServer(const HttpServerConfig& config)
+    : config_(config), context_(nullptr) {}
+
+HttpServer::~HttpServer() { Stop(); }
+
+void HttpServer::AddPage(const std::string& path, HttpPageHandler handler) {
+  CHECK(context_ == nullptr) << "Routes should be added before Start";
+  CHECK(routes_.count(path) == 0) << "Route already added at " << path;
+  routes_[path].page_handler = handler;
+}
+
+void HttpServer::AddHandler(const std::string& path, HttpHandler handler) {
+  CHECK(context_ == nullptr) << "Routes should be added before Start";
+  CHECK(routes_.count(path) == 0) << "Route already added at " << path;
+  routes_[path].handler = handler;
+}
+
+void HttpServer::AddAsset(const std::string& path, const char* data,
+                          size_t size) {
+  CHECK(context_ == nullptr) << "Assets should be added before Start";
+  std::string etag = StrCat("\"", ContentVersion(data, size), "\"");
+  assets_[path] = {{ContentEncoding::kIdentity, data, size, etag,
+                    kAssetHeaders}};
+}
+
+void HttpServer::AddAssetEncoding(const std::string& path,
+                                  ContentEncoding encoding, const char* data,
+                                  size_t size) {
+  CHECK(context_ == nullptr) << "Assets should be added before Start";
+  CHECK(encoding != ContentEncoding::kIdentity);
+  auto it = assets_.find(path);
+  CHECK(it != assets_.end()) << "No asset at " << path;
+  Asset& asset = it->second;
+  for (const AssetVariant& variant : asset) {
+    CHECK(variant.encoding != encoding)
+        << "Asset at " << path << " already has encoding "
+        << ContentEncodingName(encoding);
+  }
+
+  // Clients tell variants apart by the ETag, it is derived from the
+  // original's.
+  const AssetVariant& identity = asset.back();
+  std::string etag =
+      StrCat(identity.etag.substr(0, identity.etag.size() - 1), "-",
+             ContentEncodingName(encoding), "\"");
+  asset.push_back({encoding, data, size, etag,
+                   StrCat(kAssetHeaders, "Content-Encoding: ",
+                          ContentEncodingName(encoding), "\r\n")});
+  std::sort(asset.begin(), asset.end(),
+            [](const AssetVariant& a, const AssetVariant& b) {
+              return a.encoding > b.encoding;
+            });
+
+  // All variants vary, including the original.
+  for (AssetVariant& variant : asset) {
+    if (variant.headers.find("Vary:") == std::string::npos) {
+      variant.headers += "Vary: Accept-Encoding\r\n";
+    }
+  }
+}
+
+void HttpServer::AddWwwAssets() {
+  for (const WwwAsset& asset : WwwAssets()) {
+    std::string path = StrCat(kWwwAssetsPath, asset.name);
+    AddAsset(path, asset.data, asset.size);
+    if (asset.gzip_data != nullptr) {
+      AddAssetEncoding(path, ContentEncoding::kGzip, asset.gzip_data,
+                       asset.gzip_size);
+    }
+    if (asset.brotli_data != nullptr) {
+      AddAssetEncoding(path, ContentEncoding::kBrotli, asset.brotli_data,
+                       asset.brotli_size);
+    }
+  }
+}
+
+void HttpServer::Start() {
+  CHECK(context_ == nullptr) << "Already started";
+  std::string port = std::to_string(config_.port);
+  std::string num_threads = std::to_string(config_.num_threads);
+  std::vector<const char*> options = {
+      "listening_ports",       port.c_str(),
+      "num_threads",           num_threads.c_str(),
+      "enable_keep_alive",     config_.keep_alive ? "yes" : "no",
+      "park_idle_connections", config_.park_idle_connections ? "yes" : "no",
+      "listener_per_worker",   config_.listener_per_worker ? "yes" : "no"};
+  if (!config_.document_root.empty()) {
+    options.emplace_back("document_root");
+    options.emplace_back(config_.document_root.c_str());
+  }
+  options.emplace_back(nullptr);
+
+  mg_callbacks callbacks;
+  memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.begin_request = BeginRequest;
+  callbacks.open_file = OpenFile;
+  callbacks.memory_file_headers = AssetHeaders;
+  context_ = mg_start(&callbacks, this, options.data());
+  if (context_ == nullptr) {
+    LOG(FATAL) << "Unable to start HTTP server on port " << config_.port;
+  }
+}
+
+void HttpServer::Stop() {
+  if (context_ != nullptr) {
+    mg_stop(context_);
+    context_ = nullptr;
+  }
+}
+
+int HttpServer::BeginRequest(mg_connection* connection) {
+  HttpServer* server =
+      static_cast<HttpServer*>(mg_get_request_info(connection)->user_data);
+  return server->HandleRequest(connection) ? 1 : 0;
+}
+
+const char* HttpServer::OpenFile(const mg_connection* connection,
+                                 const char* path, size_t* data_len) {
+  // mongoose does not take a const connection, but does not modify it.
+  HttpServer* server = static_cast<HttpServer*>(
+      mg_get_request_info(const_cast<mg_connection*>(connection))->user_data);
+  const AssetVariant* variant = server->FindAsset(connection, path);
+  if (variant == nullptr) {
+    return nullptr;
+  }
+
+  *data_len = variant->size;
+  return variant->data;
+}
+
+void HttpServer::AssetHeaders(const mg_connection* connection,
+                              const char* path, const char** etag,
+                              const char** headers) {
+  HttpServer* server = static_cast<HttpServer*>(
+      mg_get_request_info(const_cast<mg_connection*>(connection))->user_data);
+  const AssetVariant* variant = server->FindAsset(connection, path);
+  if (variant != nullptr) {
+    *etag = variant->etag.c_str();
+    *headers = variant->headers.c_str();
+  }
+}
+
+const HttpServer::AssetVariant* HttpServer::FindAsset(
+    const mg_connection* connection, const char* path) const {
+  auto it = assets_.find(path);
+  if (it == assets_.end()) {
+    return nullptr;
+  }
+
+  const char* accept_encoding = mg_get_header(connection, "Accept-Encoding");
+  for (const AssetVariant& variant : it->second) {
+    if (AcceptsEncoding(accept_encoding, variant.encoding)) {
+      return &variant;
+    }
+  }
+
+  // Not reached, identity is always accepted.
+  return &it->second.back();
+}
+
+bool HttpServer::HandleRequest(mg_connection* connection) {
+  const char* uri = mg_get_request_info(connection)->uri;
+  auto it = routes_.find(uri);
+  if (it == routes_.end()) {
+    if (FindAsset(connection, uri) == nullptr) {
+      return false;
+    }
+
+    // The asset is picked up by OpenFile, mongoose takes care of HEAD,
+    // ranges and If-None-Match.
+    mg_send_file(connection, uri);
+    return true;
+  }
+
+  const Route& route = it->second;
+  HttpRequest request(connection);
+  if (route.handler) {
+    HttpResponse response;
+    route.handler(request, &response);
+    SendResponse(connection, response);
+    return true;
+  }
+
+  std::unique_ptr<HtmlPage> page = route.page_handler(request);
+  if (!page) {
+    HttpResponse response;
+    response.status = 404;
+    response.body = "Not Found";
+    SendResponse(connection, response);
+    return true;
+  }
+
+  SendPage(connection, *page, config_.compress_pages);
+  return true;
+}
+
+}  // namespace web
+}  // namespace nc
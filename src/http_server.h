@@ -0,0 +1,211 @@
+#ifndef NCODE_WEB_HTTP_SERVER_H_
+#define NCODE_WEB_HTTP_SERVER_H_
+
+#include <stddef.h>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "compression.h"
+#include "ncode_common/src/common.h"
+#include "web_page.h"
+
+struct mg_connection;
+struct mg_context;
+
+namespace nc {
+namespace web {
+
+// Parameters for an HttpServer.
+struct HttpServerConfig {
+  HttpServerConfig()
+      : port(8080),
+        num_threads(16),
+        keep_alive(false),
+        park_idle_connections(false),
+        listener_per_worker(false),
+        compress_pages(true) {}
+
+  // Port to listen on.
+  uint32_t port;
+
+  // Number of threads serving requests. A connection occupies a thread while
+  // a request on it is being served, and while waiting for the next request
+  // unless park_idle_connections is set.
+  size_t num_threads;
+
+  // If true connections are kept open for more requests.
+  bool keep_alive;
+
+  // If true kept-alive connections that are waiting for their next request
+  // are watched with epoll by a single thread, and handed to a thread from
+  // the pool only once the request arrives. Many mostly idle connections can
+  // then share a few threads. Needs epoll, ignored on other platforms.
+  bool park_idle_connections;
+
+  // If true each thread accepts connections on a listening socket of its own,
+  // bound to the same port with SO_REUSEPORT, and the kernel spreads new
+  // connections over them. Otherwise a single thread accepts all connections
+  // and hands them to the others through a queue. Connections are neither
+  // kept alive nor parked in this mode: a thread busy with a connection does
+  // not accept the ones queued on its socket, which would wait for as long
+  // as the client keeps the connection open. Needs SO_REUSEPORT, ignored on
+  // platforms other than Linux.
+  bool listener_per_worker;
+
+  // If true pages are compressed as they are sent, with the best encoding
+  // the client accepts.
+  bool compress_pages;
+
+  // Directory to serve files from, for paths that have no handler. If empty
+  // such paths get a 404.
+  std::string document_root;
+};
+
+// A request, as seen by a handler. Only valid for the duration of the call.
+class HttpRequest {
+ public:
+  explicit HttpRequest(mg_connection* connection);
+
+  // "GET", "POST", etc.
+  const char* method() const;
+
+  // The URL-decoded path, without the query string.
+  const char* uri() const;
+
+  // Returns the value of a header, or null if the request does not have it.
+  const char* GetHeader(const std::string& name) const;
+
+  // Looks up a URL-decoded variable in the query string. Returns false if the
+  // query string does not have it.
+  bool GetQueryVar(const std::string& name, std::string* value) const;
+
+ private:
+  mg_connection* connection_;
+
+  DISALLOW_COPY_AND_ASSIGN(HttpRequest);
+};
+
+// What a handler sends back for a request.
+struct HttpResponse {
+  HttpResponse() : status(200), content_type("text/plain") {}
+
+  int status;
+  std::string content_type;
+  std::string body;
+};
+
+// Handlers are called concurrently from the server's threads. A page handler
+// returns the page to serve, or null if there is nothing at the requested
+// location, in which case the client gets a 404.
+using HttpPageHandler =
+    std::function<std::unique_ptr<HtmlPage>(const HttpRequest& request)>;
+using HttpHandler =
+    std::function<void(const HttpRequest& request, HttpResponse* response)>;
+
+// An HTTP server that generates pages on request. Pages are sent to the
+// client as they are constructed, with chunked transfer encoding, without
+// being put together in memory first. Built on mongoose.
+class HttpServer {
+ public:
+  explicit HttpServer(const HttpServerConfig& config = HttpServerConfig());
+
+  // Stops the server if it is running.
+  ~HttpServer();
+
+  // Serves the pages returned by a handler at a path. Paths are matched
+  // exactly, without the query string. Only one handler can be added per
+  // path. HEAD requests get the headers of the response the handler
+  // produces. Should be called before Start.
+  void AddPage(const std::string& path, HttpPageHandler handler);
+
+  // Same as above, but for a handler that produces raw bytes.
+  void AddHandler(const std::string& path, HttpHandler handler);
+
+  // Serves size bytes at data at a path, straight from memory, with an ETag
+  // derived from the contents. Clients are told to cache the contents for
+  // good: if they can change from one build to the next, link to the path
+  // with a version in the query string, as pages do for www assets (see
+  // SetLinkToWwwAssets). The data should outlive the server. Should be called
+  // before Start.
+  void AddAsset(const std::string& path, const char* data, size_t size);
+
+  // Adds a copy of an asset at a path, compressed with an encoding. It is sent
+  // instead of the original to clients that accept the encoding. The asset
+  // should have been added already, and have no copy with the encoding yet.
+  void AddAssetEncoding(const std::string& path, ContentEncoding encoding,
+                        const char* data, size_t size);
+
+  // Serves the files compiled in from data/www under kWwwAssetsPath, along
+  // with the copies compressed at build time.
+  void AddWwwAssets();
+
+  // Starts listening and serving requests. Does not block.
+  void Start();
+
+  // Stops the server. Blocks until requests being served are done.
+  void Stop();
+
+ private:
+  // Only one of the handlers is set.
+  struct Route {
+    HttpPageHandler page_handler;
+    HttpHandler handler;
+  };
+
+  // One of the encodings of an asset.
+  struct AssetVariant {
+    ContentEncoding encoding;
+    const char* data;
+    size_t size;
+
+    // Quoted, as sent to clients. Differs between the encodings.
+    std::string etag;
+
+    // Sent along with the contents.
+    std::string headers;
+  };
+
+  // Most preferred encoding first, identity last.
+  using Asset = std::vector<AssetVariant>;
+
+  // Called by mongoose for each request. Returns non-zero if the request was
+  // handled, otherwise mongoose looks for a file in the document root.
+  static int BeginRequest(mg_connection* connection);
+
+  // Called by mongoose to open a file, returns the asset at path, if any.
+  static const char* OpenFile(const mg_connection* connection,
+                              const char* path, size_t* data_len);
+
+  // Called by mongoose before sending an asset.
+  static void AssetHeaders(const mg_connection* connection, const char* path,
+                           const char** etag, const char** headers);
+
+  // Returns the variant of the asset at a path to send in response to a
+  // request, or null if there is no asset at the path.
+  const AssetVariant* FindAsset(const mg_connection* connection,
+                                const char* path) const;
+
+  bool HandleRequest(mg_connection* connection);
+
+  HttpServerConfig config_;
+
+  // Path to route.
+  std::map<std::string, Route> routes_;
+
+  // Path to asset.
+  std::map<std::string, Asset> assets_;
+
+  // Null if not running.
+  mg_context* context_;
+
+  DISALLOW_COPY_AND_ASSIGN(HttpServer);
+};
+
+}  // namespace web
+}  // namespace nc
+
+#endif
@@ -0,0 +1,519 @@
+#include "http_server.h"
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <thread>
+
+#include "ctemplate/template.h"
+#include "ctemplate/template_enums.h"
+#include "ncode_common/src/strutil.h"
+#include "gtest/gtest.h"
+
+namespace nc {
+namespace web {
+namespace {
+
+static constexpr uint32_t kPort = 8090;
+
+int Connect() {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(sock != -1);
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(kPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(connect(sock, reinterpret_cast<sockaddr*>(&address),
+                sizeof(address)) == 0);
+  return sock;
+}
+
+void Send(int sock, const std::string& request) {
+  CHECK(write(sock, request.data(), request.size()) ==
+        static_cast<ssize_t>(request.size()));
+}
+
+// Returns everything the server sends until it closes the connection, or
+// until a read times out.
+std::string ReadUntilClosed(int sock) {
+  std::string response;
+  char buf[4096];
+  ssize_t bytes_read;
+  while ((bytes_read = read(sock, buf, sizeof(buf))) > 0) {
+    response.append(buf, bytes_read);
+  }
+
+  return response;
+}
+
+// Sends a request to the server and returns everything it sends back until
+// it closes the connection.
+std::string Fetch(const std::string& request) {
+  int sock = Connect();
+  Send(sock, request);
+  std::string response = ReadUntilClosed(sock);
+  close(sock);
+  return response;
+}
+
+std::string Get(const std::string& path, const std::string& version) {
+  return Fetch(StrCat("GET ", path, " HTTP/", version,
+                      "\r\nConnection: close\r\n\r\n"));
+}
+
+// Splits a response into the headers and the body.
+std::pair<std::string, std::string> Split(const std::string& response) {
+  size_t end_of_headers = response.find("\r\n\r\n");
+  CHECK(end_of_headers != std::string::npos);
+  return {response.substr(0, end_of_headers + 2),
+          response.substr(end_of_headers + 4)};
+}
+
+std::string Dechunk(const std::string& body) {
+  std::string out;
+  size_t pos = 0;
+  while (true) {
+    size_t end_of_size = body.find("\r\n", pos);
+    CHECK(end_of_size != std::string::npos);
+    size_t chunk_size = strtoul(body.c_str() + pos, nullptr, 16);
+    if (chunk_size == 0) {
+      CHECK(body.substr(end_of_size) == "\r\n\r\n");
+      return out;
+    }
+
+    out.append(body, end_of_size + 2, chunk_size);
+    pos = end_of_size + 2 + chunk_size;
+    CHECK(body.substr(pos, 2) == "\r\n");
+    pos += 2;
+  }
+}
+
+// Reads a single response with a Content-Length from a kept-alive
+// connection and returns its body.
+std::string ReadResponse(int sock) {
+  std::string response;
+  size_t end_of_headers;
+  char c;
+  while ((end_of_headers = response.find("\r\n\r\n")) == std::string::npos) {
+    CHECK(read(sock, &c, 1) == 1);
+    response.push_back(c);
+  }
+
+  size_t content_length_pos = response.find("Content-Length: ");
+  CHECK(content_length_pos != std::string::npos);
+  size_t content_length =
+      strtoul(response.c_str() + content_length_pos + 16, nullptr, 10);
+  std::string body(content_length, '\0');
+  size_t total = 0;
+  while (total < content_length) {
+    ssize_t bytes_read = read(sock, &body[total], content_length - total);
+    CHECK(bytes_read > 0);
+    total += bytes_read;
+  }
+
+  return body;
+}
+
+class HttpServerFixture : public ::testing::Test {
+ protected:
+  HttpServerFixture() {
+    HttpServerConfig config;
+    config.port = kPort;
+    config.num_threads = 2;
+    server_ = make_unique<HttpServer>(config);
+  }
+
+  std::unique_ptr<HttpServer> server_;
+};
+
+TEST_F(HttpServerFixture, Handler) {
+  server_->AddHandler("/echo", [](const HttpRequest& request,
+                                  HttpResponse* response) {
+    ASSERT_STREQ("GET", request.method());
+    ASSERT_TRUE(request.GetQueryVar("value", &response->body));
+    ASSERT_FALSE(request.GetQueryVar("other", &response->body));
+    response->content_type = "application/json";
+  });
+  server_->Start();
+
+  auto headers_and_body = Split(Get("/echo?value=a%20b", "1.1"));
+  ASSERT_NE(std::string::npos, headers_and_body.first.find("HTTP/1.1 200"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Content-Type: application/json"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Content-Length: 3\r\n"));
+  ASSERT_EQ("a b", headers_and_body.second);
+}
+
+TEST_F(HttpServerFixture, Head) {
+  server_->AddHandler("/echo", [](const HttpRequest& request,
+                                  HttpResponse* response) {
+    ASSERT_STREQ("HEAD", request.method());
+    response->body = "abc";
+  });
+  server_->AddPage("/page", [](const HttpRequest&) {
+    std::unique_ptr<HtmlPage> page = make_unique<HtmlPage>();
+    page->set_title("Title");
+    return page;
+  });
+  server_->Start();
+
+  // The same headers as for GET, without a body.
+  auto headers_and_body =
+      Split(Fetch("HEAD /echo HTTP/1.1\r\nConnection: close\r\n\r\n"));
+  ASSERT_NE(std::string::npos, headers_and_body.first.find("HTTP/1.1 200"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Content-Length: 3\r\n"));
+  ASSERT_EQ("", headers_and_body.second);
+
+  headers_and_body =
+      Split(Fetch("HEAD /page HTTP/1.1\r\nConnection: close\r\n\r\n"));
+  ASSERT_NE(std::string::npos, headers_and_body.first.find("HTTP/1.1 200"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Transfer-Encoding: chunked"));
+  ASSERT_EQ("", headers_and_body.second);
+
+  headers_and_body =
+      Split(Fetch("HEAD /page HTTP/1.0\r\nConnection: close\r\n\r\n"));
+  ASSERT_NE(std::string::npos, headers_and_body.first.find("Content-Length"));
+  ASSERT_EQ("", headers_and_body.second);
+}
+
+TEST_F(HttpServerFixture, DuplicateRoute) {
+  // Servers started by earlier tests ignore SIGCHLD, death tests wait for
+  // their child.
+  signal(SIGCHLD, SIG_DFL);
+  server_->AddPage("/path", [](const HttpRequest&) {
+    return std::unique_ptr<HtmlPage>();
+  });
+  ASSERT_DEATH(server_->AddHandler("/path",
+                                   [](const HttpRequest&, HttpResponse*) {}),
+               ".*");
+}
+
+TEST_F(HttpServerFixture, NotFound) {
+  server_->AddPage("/nothing", [](const HttpRequest&) {
+    return std::unique_ptr<HtmlPage>();
+  });
+  server_->Start();
+
+  ASSERT_NE(std::string::npos,
+            Get("/nothing", "1.1").find("HTTP/1.1 404"));
+  ASSERT_NE(std::string::npos, Get("/unknown", "1.1").find("404"));
+}
+
+TEST_F(HttpServerFixture, Page) {
+  auto make_page = [] {
+    std::unique_ptr<HtmlPage> page = make_unique<HtmlPage>();
+    page->set_title("Title");
+    page->AddD3();
+    for (size_t i = 0; i < 10000; ++i) {
+      StrAppend(page->body(), "<p>", i, "</p>");
+    }
+
+    return page;
+  };
+  std::string expected = make_page()->Construct();
+
+  server_->AddPage("/page", [&make_page](const HttpRequest&) {
+    return make_page();
+  });
+  server_->Start();
+
+  auto headers_and_body = Split(Get("/page", "1.1"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Transfer-Encoding: chunked"));
+  ASSERT_EQ(expected, Dechunk(headers_and_body.second));
+
+  // No chunked encoding for HTTP/1.0.
+  headers_and_body = Split(Get("/page", "1.0"));
+  ASSERT_EQ(std::string::npos, headers_and_body.first.find("chunked"));
+  ASSERT_EQ(expected, headers_and_body.second);
+}
+
+TEST_F(HttpServerFixture, CompressedPage) {
+  auto make_page = [] {
+    std::unique_ptr<HtmlPage> page = make_unique<HtmlPage>();
+    for (size_t i = 0; i < 10000; ++i) {
+      StrAppend(page->body(), "<p>", i, "</p>");
+    }
+
+    return page;
+  };
+  std::string expected = make_page()->Construct();
+
+  server_->AddPage("/page", [&make_page](const HttpRequest&) {
+    return make_page();
+  });
+  server_->Start();
+
+  auto headers_and_body = Split(Fetch(
+      "GET /page HTTP/1.1\r\nAccept-Encoding: gzip\r\n"
+      "Connection: close\r\n\r\n"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Content-Encoding: gzip\r\n"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Vary: Accept-Encoding\r\n"));
+  std::string compressed = Dechunk(headers_and_body.second);
+  ASSERT_LT(compressed.size(), expected.size());
+  std::string decompressed;
+  ASSERT_TRUE(Gunzip(compressed, &decompressed));
+  ASSERT_EQ(expected, decompressed);
+
+  headers_and_body = Split(Fetch(
+      "GET /page HTTP/1.0\r\nAccept-Encoding: gzip\r\n\r\n"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Content-Encoding: gzip\r\n"));
+  ASSERT_TRUE(Gunzip(headers_and_body.second, &decompressed));
+  ASSERT_EQ(expected, decompressed);
+
+  // Not compressed for clients that do not ask for it.
+  headers_and_body = Split(Get("/page", "1.1"));
+  ASSERT_EQ(std::string::npos, headers_and_body.first.find("Content-Encoding"));
+  ASSERT_EQ(expected, Dechunk(headers_and_body.second));
+}
+
+TEST_F(HttpServerFixture, TemplatePage) {
+  std::string page_template =
+      StrCat("<html><head>{{", TemplatePage::kHeadMarker, "}}</head><body>{{",
+             TemplatePage::kBodyMarker, "}}</body></html>");
+  ctemplate::StringToTemplateCache("http_server_test", page_template,
+                                   ctemplate::STRIP_WHITESPACE);
+  auto make_page = [] {
+    std::unique_ptr<TemplatePage> page =
+        make_unique<TemplatePage>("http_server_test");
+    page->AddD3();
+    page->body()->append(100000, 'x');
+    return page;
+  };
+  std::string expected = make_page()->Construct();
+
+  server_->AddPage("/template", [&make_page](const HttpRequest&) {
+    return make_page();
+  });
+  server_->Start();
+
+  ASSERT_EQ(expected, Dechunk(Split(Get("/template", "1.1")).second));
+}
+
+TEST_F(HttpServerFixture, Asset) {
+  std::string data = "var x = 1;";
+  std::string etag =
+      StrCat("\"", ContentVersion(data.data(), data.size()), "\"");
+  server_->AddAsset("/asset.js", data.data(), data.size());
+  server_->Start();
+
+  auto headers_and_body = Split(Get("/asset.js", "1.1"));
+  ASSERT_NE(std::string::npos, headers_and_body.first.find("HTTP/1.1 200"));
+  ASSERT_NE(std::string::npos, headers_and_body.first.find(
+                                   StrCat("Etag: ", etag, "\r\n")));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Content-Length: 10\r\n"));
+  ASSERT_NE(std::string::npos, headers_and_body.first.find("immutable"));
+  ASSERT_EQ(data, headers_and_body.second);
+
+  std::string not_modified =
+      Fetch(StrCat("GET /asset.js HTTP/1.1\r\nIf-None-Match: ", etag,
+                   "\r\nConnection: close\r\n\r\n"));
+  ASSERT_NE(std::string::npos, not_modified.find("HTTP/1.1 304"));
+  ASSERT_NE(std::string::npos,
+            not_modified.find(StrCat("Etag: ", etag, "\r\n")));
+  ASSERT_NE(std::string::npos, not_modified.find("immutable"));
+  ASSERT_EQ("", Split(not_modified).second);
+
+  std::string head =
+      Fetch("HEAD /asset.js HTTP/1.1\r\nConnection: close\r\n\r\n");
+  ASSERT_NE(std::string::npos, head.find("Content-Length: 10\r\n"));
+  ASSERT_EQ("", Split(head).second);
+}
+
+TEST_F(HttpServerFixture, CompressedAsset) {
+  std::string data(1000, 'x');
+  std::string compressed = Compress(ContentEncoding::kGzip, data);
+  server_->AddAsset("/asset.js", data.data(), data.size());
+  server_->AddAssetEncoding("/asset.js", ContentEncoding::kGzip,
+                            compressed.data(), compressed.size());
+  server_->Start();
+
+  auto headers_and_body = Split(Fetch(
+      "GET /asset.js HTTP/1.1\r\nAccept-Encoding: gzip, br;q=0\r\n"
+      "Connection: close\r\n\r\n"));
+  const std::string& headers = headers_and_body.first;
+  ASSERT_NE(std::string::npos, headers.find("Content-Encoding: gzip\r\n"));
+  ASSERT_NE(std::string::npos, headers.find("Vary: Accept-Encoding\r\n"));
+  ASSERT_NE(std::string::npos, headers.find("-gzip\"\r\n"));
+  ASSERT_EQ(compressed, headers_and_body.second);
+
+  // Revalidating the compressed copy.
+  size_t etag_start = headers.find("Etag: ") + 6;
+  std::string etag =
+      headers.substr(etag_start, headers.find("\r\n", etag_start) - etag_start);
+  std::string not_modified = Fetch(
+      StrCat("GET /asset.js HTTP/1.1\r\nAccept-Encoding: gzip, br;q=0\r\n"
+             "If-None-Match: ", etag, "\r\nConnection: close\r\n\r\n"));
+  ASSERT_NE(std::string::npos, not_modified.find("HTTP/1.1 304"));
+  ASSERT_NE(std::string::npos,
+            not_modified.find(StrCat("Etag: ", etag, "\r\n")));
+  ASSERT_NE(std::string::npos,
+            not_modified.find("Vary: Accept-Encoding\r\n"));
+  ASSERT_EQ("", Split(not_modified).second);
+
+  headers_and_body = Split(Get("/asset.js", "1.1"));
+  ASSERT_EQ(std::string::npos, headers_and_body.first.find("Content-Encoding"));
+  ASSERT_NE(std::string::npos,
+            headers_and_body.first.find("Vary: Accept-Encoding\r\n"));
+  ASSERT_EQ(data, headers_and_body.second);
+}
+
+TEST_F(HttpServerFixture, DuplicateAssetEncoding) {
+  // See DuplicateRoute.
+  signal(SIGCHLD, SIG_DFL);
+  std::string data(1000, 'x');
+  std::string compressed = Compress(ContentEncoding::kGzip, data);
+  server_->AddAsset("/asset.js", data.data(), data.size());
+  server_->AddAssetEncoding("/asset.js", ContentEncoding::kGzip,
+                            compressed.data(), compressed.size());
+  ASSERT_DEATH(server_->AddAssetEncoding("/asset.js", ContentEncoding::kGzip,
+                                         compressed.data(), compressed.size()),
+               ".*");
+}
+
+TEST_F(HttpServerFixture, WwwAssets) {
+  server_->AddWwwAssets();
+  server_->Start();
+
+  const WwwAsset* asset = FindWwwAsset("index.html");
+  ASSERT_NE(nullptr, asset);
+  ASSERT_EQ(std::string(asset->data, asset->size),
+            Split(Get(StrCat(kWwwAssetsPath, "index.html"), "1.1")).second);
+
+  // The copy compressed at build time, if gzip was found.
+  if (asset->gzip_data != nullptr) {
+    std::string response = Fetch(
+        StrCat("GET ", kWwwAssetsPath, "index.html HTTP/1.1\r\n"
+               "Accept-Encoding: gzip\r\nConnection: close\r\n\r\n"));
+    ASSERT_NE(std::string::npos, response.find("Content-Encoding: gzip"));
+    std::string decompressed;
+    ASSERT_TRUE(Gunzip(Split(response).second, &decompressed));
+    ASSERT_EQ(std::string(asset->data, asset->size), decompressed);
+  }
+}
+
+TEST(HttpServer, ParkIdleConnections) {
+  size_t connection_count = 16;
+
+  // Far fewer threads than connections, idle connections must not hold on
+  // to them.
+  HttpServerConfig config;
+  config.port = kPort;
+  config.num_threads = 2;
+  config.keep_alive = true;
+  config.park_idle_connections = true;
+  HttpServer server(config);
+  server.AddHandler("/", [](const HttpRequest&, HttpResponse* response) {
+    response->body = "ok";
+  });
+  server.Start();
+
+  std::vector<int> sockets;
+  for (size_t i = 0; i < connection_count; ++i) {
+    sockets.emplace_back(Connect());
+  }
+
+  for (size_t round = 0; round < 3; ++round) {
+    for (int sock : sockets) {
+      Send(sock, "GET / HTTP/1.1\r\n\r\n");
+      ASSERT_EQ("ok", ReadResponse(sock));
+    }
+  }
+
+  // Pipelined requests are served from the buffer without parking.
+  Send(sockets[0], "GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n");
+  ASSERT_EQ("ok", ReadResponse(sockets[0]));
+  ASSERT_EQ("ok", ReadResponse(sockets[0]));
+
+  for (int sock : sockets) {
+    close(sock);
+  }
+  server.Stop();
+}
+
+// Many clients connecting at once, each making a series of short lived
+// connections.
+void ConnectionStorm(bool listener_per_worker) {
+  size_t client_count = 8;
+  size_t connections_per_client = 50;
+
+  HttpServerConfig config;
+  config.port = kPort;
+  config.num_threads = 4;
+  config.listener_per_worker = listener_per_worker;
+  HttpServer server(config);
+  server.AddHandler("/", [](const HttpRequest&, HttpResponse* response) {
+    response->body = "ok";
+  });
+  server.Start();
+
+  std::vector<std::thread> clients;
+  for (size_t i = 0; i < client_count; ++i) {
+    clients.emplace_back([connections_per_client] {
+      for (size_t j = 0; j < connections_per_client; ++j) {
+        ASSERT_EQ("ok", Split(Get("/", "1.1")).second);
+      }
+    });
+  }
+
+  for (std::thread& client : clients) {
+    client.join();
+  }
+  server.Stop();
+}
+
+TEST(HttpServer, ConnectionStorm) { ConnectionStorm(false); }
+
+TEST(HttpServer, ConnectionStormListenerPerWorker) { ConnectionStorm(true); }
+
+TEST(HttpServer, KeepAliveStormListenerPerWorker) {
+  size_t connection_count = 16;
+
+  HttpServerConfig config;
+  config.port = kPort;
+  config.num_threads = 2;
+  config.keep_alive = true;
+  config.listener_per_worker = true;
+  HttpServer server(config);
+  server.AddHandler("/", [](const HttpRequest&, HttpResponse* response) {
+    response->body = "ok";
+  });
+  server.Start();
+
+  // Clients that would keep their connections open if they could. Each gets
+  // its response, and is hung up on instead of holding on to a thread.
+  std::vector<int> sockets;
+  for (size_t i = 0; i < connection_count; ++i) {
+    int sock = Connect();
+    timeval timeout = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    Send(sock, "GET / HTTP/1.1\r\n\r\n");
+    sockets.emplace_back(sock);
+  }
+
+  for (int sock : sockets) {
+    std::string response = ReadUntilClosed(sock);
+    ASSERT_NE(std::string::npos, response.find("\r\n\r\n"));
+    ASSERT_EQ("ok", Split(response).second);
+  }
+
+  for (int sock : sockets) {
+    close(sock);
+  }
+  server.Stop();
+}
+
+}  // namespace
+}  // namespace web
+}  // namespace nc
@@ -25,6 +25,7 @@
 #else
 #ifdef __linux__
 #define _XOPEN_SOURCE 600     // For flockfile() on Linux
+#define _DEFAULT_SOURCE       // For syscall() on Linux
 #endif
 #define _LARGEFILE_SOURCE     // Enable 64-bit file offsets
 #define __STDC_FORMAT_MACROS  // <inttypes.h> wants this for C++
@@ -221,6 +222,16 @@ struct pollfd {
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define HAVE_EPOLL
+#define HAVE_FUTEX
+#if defined(SO_REUSEPORT)
+#define HAVE_REUSEPORT
+#endif
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -304,10 +315,11 @@ typedef int socklen_t;
 #define PATH_MAX 4096
 #endif
 
-// Size of the accepted socket queue
+// Size of the accepted socket queue, must be a power of two
 #if !defined(MGSQLEN)
-#define MGSQLEN 20
+#define MGSQLEN 32
 #endif
+typedef char mgsqlen_is_power_of_two[(MGSQLEN & (MGSQLEN - 1)) == 0 ? 1 : -1];
 
 static const char *http_500_error = "Internal Server Error";
 
@@ -432,8 +444,10 @@ struct file {
   // set to 1 if the content is gzipped
   // in which case we need a content-encoding: gzip header
   int gzipped;
+  const char *etag;           // Set by memory_file_headers, may be NULL
+  const char *extra_headers;  // Set by memory_file_headers, may be NULL
 };
-#define STRUCT_FILE_INITIALIZER {0, 0, 0, NULL, NULL, 0}
+#define STRUCT_FILE_INITIALIZER {0, 0, 0, NULL, NULL, 0, NULL, NULL}
 
 // Describes listening socket, or socket which was accept()-ed by the master
 // thread and queued for future handling by the worker thread.
@@ -453,6 +467,7 @@ enum {
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
   NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
+  PARK_IDLE_CONNECTIONS, LISTENER_PER_WORKER,
   NUM_OPTIONS
 };
 
@@ -482,9 +497,27 @@ static const char *config_options[] = {
   "url_rewrite_patterns", NULL,
   "hide_files_patterns", NULL,
   "request_timeout_ms", "30000",
+  "park_idle_connections", "no",
+  "listener_per_worker", "no",
   NULL
 };
 
+// Slot of the accepted socket queue. seq tells whose turn it is: a producer's
+// if it is equal to the position being produced to, a consumer's if it is one
+// past the position being consumed from.
+struct queued_socket {
+  unsigned seq;
+  struct socket so;
+};
+
+// Keep-alive connection waiting for its next request, watched by the master
+// thread instead of occupying a worker.
+struct parked_socket {
+  struct socket so;
+  time_t since;         // When the connection was parked
+  int in_use;           // 1 if a connection is parked in this slot
+};
+
 struct mg_context {
   volatile int stop_flag;         // Should we stop event loop
   SSL_CTX *ssl_ctx;               // SSL context
@@ -499,11 +532,25 @@ struct mg_context {
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
-  struct socket queue[MGSQLEN];   // Accepted sockets
-  volatile int sq_head;      // Head of the socket queue
-  volatile int sq_tail;      // Tail of the socket queue
+  // Accepted sockets. Lock-free, the mutex and condvars are only used to
+  // sleep on a full / empty queue where there are no futexes.
+  struct queued_socket queue[MGSQLEN];
+  unsigned sq_head;          // Position the next socket is produced to
+  unsigned sq_tail;          // Position the next socket is consumed from
+  int sq_produced;           // Incremented after each produce
+  int sq_consumed;           // Incremented after each consume
+  int sq_consumers_waiting;  // Threads sleeping until sq_produced changes
+  int sq_producers_waiting;  // Threads sleeping until sq_consumed changes
   pthread_cond_t sq_full;    // Signaled when socket is produced
   pthread_cond_t sq_empty;   // Signaled when socket is consumed
+
+  int listener_per_worker;   // Workers accept on listeners of their own
+  int num_workers_started;   // Number of workers that picked up an index
+
+  int epoll_fd;              // Watches parked sockets, -1 if not parking
+  pthread_mutex_t park_mutex;  // Protects parked and num_parked_slots
+  struct parked_socket *parked;  // Parked sockets, indexed by socket
+  int num_parked_slots;      // Size of the parked array
 };
 
 struct mg_connection {
@@ -547,6 +594,11 @@ static int is_file_in_memory(struct mg_connection *conn, const char *path,
     // NOTE: override filep->size only on success. Otherwise, it might break
     // constructs like if (!mg_stat() || !mg_fopen()) ...
     filep->size = size;
+    filep->etag = filep->extra_headers = NULL;
+    if (conn->ctx->callbacks.memory_file_headers != NULL) {
+      conn->ctx->callbacks.memory_file_headers(conn, path, &filep->etag,
+                                               &filep->extra_headers);
+    }
   }
   return filep->membuf != NULL;
 }
@@ -927,7 +979,11 @@ static int match_prefix(const char *pattern, int pattern_len, const char *str) {
 static int should_keep_alive(const struct mg_connection *conn) {
   const char *http_version = conn->request_info.http_version;
   const char *header = mg_get_header(conn, "Connection");
+  // With a listener per worker a worker waiting for the next request on a
+  // kept-alive connection would leave the connections the kernel queued on
+  // its listening socket unserved.
   if (conn->must_close ||
+      conn->ctx->listener_per_worker ||
       conn->status_code == 401 ||
       mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") != 0 ||
       (header != NULL && mg_strcasecmp(header, "keep-alive") != 0) ||
@@ -2922,8 +2978,12 @@ static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
 
 static void construct_etag(char *buf, size_t buf_len,
                            const struct file *filep) {
-  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
-           (unsigned long) filep->modification_time, filep->size);
+  if (filep->etag != NULL) {
+    snprintf(buf, buf_len, "%s", filep->etag);
+  } else {
+    snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
+             (unsigned long) filep->modification_time, filep->size);
+  }
 }
 
 static void fclose_on_exec(struct file *filep) {
@@ -3003,9 +3063,10 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
       "Content-Length: %" INT64_FMT "\r\n"
       "Connection: %s\r\n"
       "Accept-Ranges: bytes\r\n"
-      "%s%s\r\n",
+      "%s%s%s\r\n",
       conn->status_code, msg, date, lm, etag, (int) mime_vec.len,
-      mime_vec.ptr, cl, suggest_connection_header(conn), range, encoding);
+      mime_vec.ptr, cl, suggest_connection_header(conn), range, encoding,
+      filep->extra_headers == NULL ? "" : filep->extra_headers);
 
   if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
     send_file_data(conn, filep, r1, cl);
@@ -3013,10 +3074,38 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
   mg_fclose(filep);
 }
 
+// Unlike an error, a 304 carries the headers that a 200 would have and that
+// caches need to update the copy they keep: the Etag, and extra headers such
+// as Cache-Control and Vary. It has no body.
+static void send_not_modified(struct mg_connection *conn,
+                              const struct file *filep) {
+  char date[64], etag[64];
+  time_t curtime = time(NULL);
+
+  conn->status_code = 304;
+  gmt_time_string(date, sizeof(date), &curtime);
+  construct_etag(etag, sizeof(etag), filep);
+  (void) mg_printf(conn,
+      "HTTP/1.1 304 Not Modified\r\n"
+      "Date: %s\r\n"
+      "Etag: %s\r\n"
+      "Connection: %s\r\n"
+      "%s\r\n",
+      date, etag, suggest_connection_header(conn),
+      filep->extra_headers == NULL ? "" : filep->extra_headers);
+}
+
+static int is_not_modified(const struct mg_connection *conn,
+                           const struct file *filep);
+
 void mg_send_file(struct mg_connection *conn, const char *path) {
   struct file file = STRUCT_FILE_INITIALIZER;
   if (mg_stat(conn, path, &file)) {
-    handle_file_request(conn, path, &file);
+    if (is_not_modified(conn, &file)) {
+      send_not_modified(conn, &file);
+    } else {
+      handle_file_request(conn, path, &file);
+    }
   } else {
     send_http_error(conn, 404, "Not Found", "%s", "File not found");
   }
@@ -3157,8 +3246,10 @@ static int is_not_modified(const struct mg_connection *conn,
   const char *ims = mg_get_header(conn, "If-Modified-Since");
   const char *inm = mg_get_header(conn, "If-None-Match");
   construct_etag(etag, sizeof(etag), filep);
+  // Files with an ETag of their own have no meaningful modification time
   return (inm != NULL && !mg_strcasecmp(etag, inm)) ||
-    (ims != NULL && filep->modification_time <= parse_date_string(ims));
+    (ims != NULL && filep->etag == NULL &&
+     filep->modification_time <= parse_date_string(ims));
 }
 
 static int forward_body_data(struct mg_connection *conn, FILE *fp,
@@ -4523,7 +4614,7 @@ static void handle_request(struct mg_connection *conn) {
                           path) > 0) {
     handle_ssi_file_request(conn, path);
   } else if (is_not_modified(conn, &file)) {
-    send_http_error(conn, 304, "Not Modified", "%s", "");
+    send_not_modified(conn, &file);
   } else {
     handle_file_request(conn, path, &file);
   }
@@ -4584,12 +4675,40 @@ static int parse_port_string(const struct vec *vec, struct socket *so) {
     (ch == '\0' || ch == 's' || ch == 'r' || ch == ',');
 }
 
-static int set_ports_option(struct mg_context *ctx) {
-  const char *list = ctx->config[LISTENING_PORTS];
-  int on = 1, success = 1;
+// Creates a socket listening on so->lsa. Returns 0 on failure, in which case
+// so->sock may still have to be closed.
+static int open_listening_socket(struct mg_context *ctx, struct socket *so) {
+  int on = 1;
 #if defined(USE_IPV6)
   int off = 0;
 #endif
+
+  (void) ctx;
+  return (so->sock = socket(so->lsa.sa.sa_family, SOCK_STREAM, 6)) !=
+    INVALID_SOCKET &&
+    // On Windows, SO_REUSEADDR is recommended only for
+    // broadcast UDP sockets
+    setsockopt(so->sock, SOL_SOCKET, SO_REUSEADDR,
+               (void *) &on, sizeof(on)) == 0 &&
+#if defined(HAVE_REUSEPORT)
+    // Lets each worker bind a socket of its own to the same address
+    (!ctx->listener_per_worker ||
+     setsockopt(so->sock, SOL_SOCKET, SO_REUSEPORT,
+                (void *) &on, sizeof(on)) == 0) &&
+#endif
+#if defined(USE_IPV6)
+    (so->lsa.sa.sa_family != AF_INET6 ||
+     setsockopt(so->sock, IPPROTO_IPV6, IPV6_V6ONLY, (void *) &off,
+                sizeof(off)) == 0) &&
+#endif
+    bind(so->sock, &so->lsa.sa, so->lsa.sa.sa_family == AF_INET ?
+         sizeof(so->lsa.sin) : sizeof(so->lsa)) == 0 &&
+    listen(so->sock, SOMAXCONN) == 0;
+}
+
+static int set_ports_option(struct mg_context *ctx) {
+  const char *list = ctx->config[LISTENING_PORTS];
+  int success = 1;
   struct vec vec;
   struct socket so, *ptr;
 
@@ -4601,20 +4720,7 @@ static int set_ports_option(struct mg_context *ctx) {
     } else if (so.is_ssl && ctx->ssl_ctx == NULL) {
       cry(fc(ctx), "Cannot add SSL socket, is -ssl_certificate option set?");
       success = 0;
-    } else if ((so.sock = socket(so.lsa.sa.sa_family, SOCK_STREAM, 6)) ==
-               INVALID_SOCKET ||
-               // On Windows, SO_REUSEADDR is recommended only for
-               // broadcast UDP sockets
-               setsockopt(so.sock, SOL_SOCKET, SO_REUSEADDR,
-                          (void *) &on, sizeof(on)) != 0 ||
-#if defined(USE_IPV6)
-               (so.lsa.sa.sa_family == AF_INET6 &&
-                setsockopt(so.sock, IPPROTO_IPV6, IPV6_V6ONLY, (void *) &off,
-                           sizeof(off)) != 0) ||
-#endif
-               bind(so.sock, &so.lsa.sa, so.lsa.sa.sa_family == AF_INET ?
-                    sizeof(so.lsa.sin) : sizeof(so.lsa)) != 0 ||
-               listen(so.sock, SOMAXCONN) != 0) {
+    } else if (!open_listening_socket(ctx, &so)) {
       cry(fc(ctx), "%s: cannot bind to %.*s: %d (%s)", __func__,
           (int) vec.len, vec.ptr, ERRNO, strerror(errno));
       closesocket(so.sock);
@@ -5051,6 +5157,59 @@ struct mg_connection *mg_download(const char *host, int port, int use_ssl,
   return conn;
 }
 
+#if defined(HAVE_EPOLL)
+// Hands a keep-alive connection that has no buffered data to the master
+// thread, which queues it for a worker again once its next request arrives.
+// Returns 0 if the connection cannot be parked.
+static int park_socket(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct parked_socket *slots;
+  struct epoll_event event;
+  SOCKET sock = conn->client.sock;
+  int n;
+
+  // SSL state lives in the connection, which stays with the worker.
+  if (ctx->epoll_fd == -1 || conn->ssl != NULL) {
+    return 0;
+  }
+
+  (void) pthread_mutex_lock(&ctx->park_mutex);
+  if (sock >= ctx->num_parked_slots) {
+    n = ctx->num_parked_slots * 2 > sock ? ctx->num_parked_slots * 2 : sock + 1;
+    slots = (struct parked_socket *) realloc(ctx->parked, n * sizeof(*slots));
+    if (slots == NULL) {
+      (void) pthread_mutex_unlock(&ctx->park_mutex);
+      return 0;
+    }
+    memset(slots + ctx->num_parked_slots, 0,
+           (n - ctx->num_parked_slots) * sizeof(*slots));
+    ctx->parked = slots;
+    ctx->num_parked_slots = n;
+  }
+  ctx->parked[sock].so = conn->client;
+  ctx->parked[sock].since = time(NULL);
+  ctx->parked[sock].in_use = 1;
+  (void) pthread_mutex_unlock(&ctx->park_mutex);
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.fd = sock;
+  if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, sock, &event) != 0) {
+    (void) pthread_mutex_lock(&ctx->park_mutex);
+    ctx->parked[sock].in_use = 0;
+    (void) pthread_mutex_unlock(&ctx->park_mutex);
+    return 0;
+  }
+
+  return 1;
+}
+#else
+static int park_socket(struct mg_connection *conn) {
+  (void) conn;
+  return 0;
+}
+#endif // HAVE_EPOLL
+
 static void process_new_connection(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
   int keep_alive_enabled, keep_alive, discard_len;
@@ -5105,38 +5264,237 @@ static void process_new_connection(struct mg_connection *conn) {
     conn->data_len -= discard_len;
     assert(conn->data_len >= 0);
     assert(conn->data_len <= conn->buf_size);
+
+    // If the next request has not started arriving yet, let the master
+    // thread wait for it and free this worker up for other connections.
+    if (keep_alive && conn->data_len == 0 && park_socket(conn)) {
+      conn->client.sock = INVALID_SOCKET;
+      break;
+    }
   } while (keep_alive);
 }
 
-// Worker threads take accepted socket from the queue
-static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+// Tries to add a socket to the queue. Returns 0 if the queue is full.
+static int sq_try_push(struct mg_context *ctx, const struct socket *sp) {
+  struct queued_socket *slot;
+  unsigned pos = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED), seq;
+
+  for (;;) {
+    slot = &ctx->queue[pos % MGSQLEN];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      // On failure pos is updated to the current head
+      if (__atomic_compare_exchange_n(&ctx->sq_head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        slot->so = *sp;
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if ((int) (seq - pos) < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Tries to take a socket from the queue. Returns 0 if the queue is empty.
+static int sq_try_pop(struct mg_context *ctx, struct socket *sp) {
+  struct queued_socket *slot;
+  unsigned pos = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED), seq;
+
+  for (;;) {
+    slot = &ctx->queue[pos % MGSQLEN];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos + 1) {
+      if (__atomic_compare_exchange_n(&ctx->sq_tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *sp = slot->so;
+        __atomic_store_n(&slot->seq, pos + MGSQLEN, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if ((int) (seq - (pos + 1)) < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Sleeps while *word is equal to value, until woken up by sq_wake(). May
+// return early, callers check again what they are waiting for.
+static void sq_wait(struct mg_context *ctx, int *word, int value,
+                    pthread_cond_t *cv) {
+#if defined(HAVE_FUTEX)
+  // Bounded, so that a stop request is noticed even if the wake up is missed
+  struct timespec timeout = {0, 200 * 1000 * 1000};
+  (void) ctx;
+  (void) cv;
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, &timeout, NULL, 0);
+#else
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == value &&
+      ctx->stop_flag == 0) {
+    (void) pthread_cond_wait(cv, &ctx->mutex);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+#endif
+}
+
+// Wakes up one or all threads sleeping in sq_wait() on word.
+static void sq_wake(struct mg_context *ctx, int *word, pthread_cond_t *cv,
+                    int all) {
+#if defined(HAVE_FUTEX)
+  (void) ctx;
+  (void) cv;
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1,
+          NULL, NULL, 0);
+#else
+  (void) word;
   (void) pthread_mutex_lock(&ctx->mutex);
+  if (all) {
+    (void) pthread_cond_broadcast(cv);
+  } else {
+    (void) pthread_cond_signal(cv);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+#endif
+}
+
+// Announces a change of *word, waking up one thread waiting for it if there
+// are any. The system call is skipped when nobody waits.
+static void sq_notify(struct mg_context *ctx, int *word, int *waiting,
+                      pthread_cond_t *cv) {
+  __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) > 0) {
+    sq_wake(ctx, word, cv, 0);
+  }
+}
+
+// Worker threads take accepted socket from the queue. Returns 0 if the
+// server is stopping.
+static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+  int produced;
+
   DEBUG_TRACE(("going idle"));
+  while (!sq_try_pop(ctx, sp)) {
+    if (ctx->stop_flag != 0) {
+      return 0;
+    }
 
-  // If the queue is empty, wait. We're idle at this point.
-  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
-    pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
+    // Register as a waiter before checking again, so that a producer either
+    // sees us waiting or we see what it produced.
+    __atomic_add_fetch(&ctx->sq_consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    produced = __atomic_load_n(&ctx->sq_produced, __ATOMIC_SEQ_CST);
+    if (sq_try_pop(ctx, sp)) {
+      __atomic_sub_fetch(&ctx->sq_consumers_waiting, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+    sq_wait(ctx, &ctx->sq_produced, produced, &ctx->sq_full);
+    __atomic_sub_fetch(&ctx->sq_consumers_waiting, 1, __ATOMIC_SEQ_CST);
   }
+  DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
 
-  // If we're stopping, sq_head may be equal to sq_tail.
-  if (ctx->sq_head > ctx->sq_tail) {
-    // Copy socket from the queue and increment tail
-    *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
-    ctx->sq_tail++;
-    DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+  sq_notify(ctx, &ctx->sq_consumed, &ctx->sq_producers_waiting,
+            &ctx->sq_empty);
+  return 1;
+}
+
+static void serve_socket(struct mg_connection *conn) {
+  conn->birth_time = time(NULL);
+
+  // Fill in IP, port info early so even if SSL setup below fails,
+  // error handler would have the corresponding info.
+  // Thanks to Johannes Winkelmann for the patch.
+  // TODO(lsm): Fix IPv6 case
+  conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
+  memcpy(&conn->request_info.remote_ip,
+         &conn->client.rsa.sin.sin_addr.s_addr, 4);
+  conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
+  conn->request_info.is_ssl = conn->client.is_ssl;
+
+  if (!conn->client.is_ssl
+#ifndef NO_SSL
+      || sslize(conn, conn->ctx->ssl_ctx, SSL_accept)
+#endif
+     ) {
+    process_new_connection(conn);
+  }
 
-    // Wrap pointers if needed
-    while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-      ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-      ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+  close_connection(conn);
+}
+
+static int accept_socket(const struct socket *listener,
+                         struct mg_context *ctx, struct socket *so);
+
+#if defined(HAVE_REUSEPORT)
+// Opens listening sockets bound to the same addresses as the master's.
+// Returns NULL on failure.
+static struct socket *open_worker_listeners(struct mg_context *ctx) {
+  struct socket *listeners;
+  int i, j;
+
+  listeners = (struct socket *) calloc(ctx->num_listening_sockets,
+                                       sizeof(listeners[0]));
+  for (i = 0; listeners != NULL && i < ctx->num_listening_sockets; i++) {
+    listeners[i] = ctx->listening_sockets[i];
+    if (!open_listening_socket(ctx, &listeners[i])) {
+      cry(fc(ctx), "%s: cannot bind: %d (%s)", __func__, ERRNO,
+          strerror(errno));
+      for (j = 0; j <= i; j++) {
+        closesocket(listeners[j].sock);
+      }
+      free(listeners);
+      listeners = NULL;
+    } else {
+      set_close_on_exec(listeners[i].sock);
     }
   }
 
-  (void) pthread_cond_signal(&ctx->sq_empty);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  return listeners;
+}
+
+// Accepts connections on listening sockets of the worker's own and serves
+// them, until the server stops. The kernel spreads new connections over the
+// workers' sockets, so accepting does not go through the master and the
+// queue. The first worker uses the master's sockets, others open new ones.
+static void accept_and_serve(struct mg_connection *conn, int index) {
+  struct mg_context *ctx = conn->ctx;
+  struct socket *listeners = ctx->listening_sockets;
+  struct pollfd *pfd;
+  int i, n = ctx->num_listening_sockets;
+
+  if (index > 0 && (listeners = open_worker_listeners(ctx)) == NULL) {
+    return;
+  }
 
-  return !ctx->stop_flag;
+  pfd = (struct pollfd *) calloc(n, sizeof(pfd[0]));
+  while (pfd != NULL && ctx->stop_flag == 0) {
+    for (i = 0; i < n; i++) {
+      pfd[i].fd = listeners[i].sock;
+      pfd[i].events = POLLIN;
+    }
+
+    if (poll(pfd, n, 200) > 0) {
+      for (i = 0; i < n; i++) {
+        if (ctx->stop_flag == 0 && (pfd[i].revents & POLLIN) &&
+            accept_socket(&listeners[i], ctx, &conn->client)) {
+          serve_socket(conn);
+        }
+      }
+    }
+  }
+  free(pfd);
+
+  // The master's sockets are closed by the master
+  if (index > 0) {
+    for (i = 0; i < n; i++) {
+      closesocket(listeners[i].sock);
+    }
+    free(listeners);
+  }
 }
+#endif // HAVE_REUSEPORT
 
 static void *worker_thread(void *thread_func_param) {
   struct mg_context *ctx = (struct mg_context *) thread_func_param;
@@ -5151,30 +5509,14 @@ static void *worker_thread(void *thread_func_param) {
     conn->ctx = ctx;
     conn->request_info.user_data = ctx->user_data;
 
-    // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
-    // sq_empty condvar to wake up the master waiting in produce_socket()
-    while (consume_socket(ctx, &conn->client)) {
-      conn->birth_time = time(NULL);
-
-      // Fill in IP, port info early so even if SSL setup below fails,
-      // error handler would have the corresponding info.
-      // Thanks to Johannes Winkelmann for the patch.
-      // TODO(lsm): Fix IPv6 case
-      conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
-      memcpy(&conn->request_info.remote_ip,
-             &conn->client.rsa.sin.sin_addr.s_addr, 4);
-      conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
-      conn->request_info.is_ssl = conn->client.is_ssl;
-
-      if (!conn->client.is_ssl
-#ifndef NO_SSL
-          || sslize(conn, conn->ctx->ssl_ctx, SSL_accept)
+#if defined(HAVE_REUSEPORT)
+    if (ctx->listener_per_worker) {
+      accept_and_serve(conn, __atomic_fetch_add(&ctx->num_workers_started, 1,
+                                                __ATOMIC_RELAXED));
+    }
 #endif
-         ) {
-        process_new_connection(conn);
-      }
-
-      close_connection(conn);
+    while (!ctx->listener_per_worker && consume_socket(ctx, &conn->client)) {
+      serve_socket(conn);
     }
     free(conn);
   }
@@ -5190,26 +5532,71 @@ static void *worker_thread(void *thread_func_param) {
   return NULL;
 }
 
-// Master thread adds accepted socket to a queue
+// Master thread adds accepted socket to a queue. If the server stops while
+// the queue is full the socket is closed.
 static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
+  int consumed;
+
+  while (!sq_try_push(ctx, sp)) {
+    if (ctx->stop_flag != 0) {
+      closesocket(sp->sock);
+      return;
+    }
 
-  // If the queue is full, wait
-  while (ctx->stop_flag == 0 &&
-         ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-    (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
+    __atomic_add_fetch(&ctx->sq_producers_waiting, 1, __ATOMIC_SEQ_CST);
+    consumed = __atomic_load_n(&ctx->sq_consumed, __ATOMIC_SEQ_CST);
+    if (sq_try_push(ctx, sp)) {
+      __atomic_sub_fetch(&ctx->sq_producers_waiting, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+    sq_wait(ctx, &ctx->sq_consumed, consumed, &ctx->sq_empty);
+    __atomic_sub_fetch(&ctx->sq_producers_waiting, 1, __ATOMIC_SEQ_CST);
   }
+  DEBUG_TRACE(("queued socket %d", sp->sock));
 
-  if (ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue)) {
-    // Copy socket to the queue and increment head
-    ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-    ctx->sq_head++;
-    DEBUG_TRACE(("queued socket %d", sp->sock));
+  sq_notify(ctx, &ctx->sq_produced, &ctx->sq_consumers_waiting,
+            &ctx->sq_full);
+}
+
+#if defined(HAVE_EPOLL)
+// Queues parked sockets that have become readable for the workers.
+static void dispatch_parked_sockets(struct mg_context *ctx) {
+  struct epoll_event events[64];
+  struct socket so;
+  int i, n, sock;
+
+  n = epoll_wait(ctx->epoll_fd, events, ARRAY_SIZE(events), 0);
+  for (i = 0; i < n; i++) {
+    sock = events[i].data.fd;
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+    (void) pthread_mutex_lock(&ctx->park_mutex);
+    so = ctx->parked[sock].so;
+    ctx->parked[sock].in_use = 0;
+    (void) pthread_mutex_unlock(&ctx->park_mutex);
+    produce_socket(ctx, &so);
   }
+}
 
-  (void) pthread_cond_signal(&ctx->sq_full);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+// Closes parked sockets that have been idle for longer than the request
+// timeout, the same limit that applies to a worker waiting for a request.
+// With stopping set closes all of them.
+static void expire_parked_sockets(struct mg_context *ctx, int stopping) {
+  double timeout = atoi(ctx->config[REQUEST_TIMEOUT]) / 1000.0;
+  time_t now = time(NULL);
+  int sock;
+
+  (void) pthread_mutex_lock(&ctx->park_mutex);
+  for (sock = 0; sock < ctx->num_parked_slots; sock++) {
+    if (ctx->parked[sock].in_use &&
+        (stopping || difftime(now, ctx->parked[sock].since) > timeout)) {
+      epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+      closesocket(sock);
+      ctx->parked[sock].in_use = 0;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->park_mutex);
 }
+#endif // HAVE_EPOLL
 
 static int set_sock_timeout(SOCKET sock, int milliseconds) {
 #ifdef _WIN32
@@ -5223,33 +5610,46 @@ static int set_sock_timeout(SOCKET sock, int milliseconds) {
     setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &t, sizeof(t));
 }
 
-static void accept_new_connection(const struct socket *listener,
-                                  struct mg_context *ctx) {
-  struct socket so;
+// Accepts a connection on a listening socket. Returns 0 if there was none,
+// or it is not allowed to connect.
+static int accept_socket(const struct socket *listener,
+                         struct mg_context *ctx, struct socket *so) {
   char src_addr[IP_ADDR_STR_LEN];
-  socklen_t len = sizeof(so.rsa);
+  socklen_t len = sizeof(so->rsa);
   int on = 1;
 
-  if ((so.sock = accept(listener->sock, &so.rsa.sa, &len)) == INVALID_SOCKET) {
-  } else if (!check_acl(ctx, ntohl(* (uint32_t *) &so.rsa.sin.sin_addr))) {
-    sockaddr_to_string(src_addr, sizeof(src_addr), &so.rsa);
+  if ((so->sock = accept(listener->sock, &so->rsa.sa, &len)) ==
+      INVALID_SOCKET) {
+    return 0;
+  } else if (!check_acl(ctx, ntohl(* (uint32_t *) &so->rsa.sin.sin_addr))) {
+    sockaddr_to_string(src_addr, sizeof(src_addr), &so->rsa);
     cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
-    closesocket(so.sock);
+    closesocket(so->sock);
+    return 0;
   } else {
-    // Put so socket structure into the queue
-    DEBUG_TRACE(("Accepted socket %d", (int) so.sock));
-    set_close_on_exec(so.sock);
-    so.is_ssl = listener->is_ssl;
-    so.ssl_redir = listener->ssl_redir;
-    getsockname(so.sock, &so.lsa.sa, &len);
+    DEBUG_TRACE(("Accepted socket %d", (int) so->sock));
+    set_close_on_exec(so->sock);
+    so->is_ssl = listener->is_ssl;
+    so->ssl_redir = listener->ssl_redir;
+    getsockname(so->sock, &so->lsa.sa, &len);
     // Set TCP keep-alive. This is needed because if HTTP-level keep-alive
     // is enabled, and client resets the connection, server won't get
     // TCP FIN or RST and will keep the connection open forever. With TCP
     // keep-alive, next keep-alive handshake will figure out that the client
     // is down and will close the server end.
     // Thanks to Igor Klopov who suggested the patch.
-    setsockopt(so.sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on, sizeof(on));
-    set_sock_timeout(so.sock, atoi(ctx->config[REQUEST_TIMEOUT]));
+    setsockopt(so->sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on, sizeof(on));
+    set_sock_timeout(so->sock, atoi(ctx->config[REQUEST_TIMEOUT]));
+    return 1;
+  }
+}
+
+static void accept_new_connection(const struct socket *listener,
+                                  struct mg_context *ctx) {
+  struct socket so;
+
+  // Put so socket structure into the queue
+  if (accept_socket(listener, ctx, &so)) {
     produce_socket(ctx, &so);
   }
 }
@@ -5257,7 +5657,8 @@ static void accept_new_connection(const struct socket *listener,
 static void *master_thread(void *thread_func_param) {
   struct mg_context *ctx = (struct mg_context *) thread_func_param;
   struct pollfd *pfd;
-  int i;
+  int i, num_pfd;
+  time_t last_expiry = time(NULL);
 
   // Increase priority of the master thread
 #if defined(_WIN32)
@@ -5270,14 +5671,26 @@ static void *master_thread(void *thread_func_param) {
   pthread_setschedparam(pthread_self(), SCHED_RR, &sched_param);
 #endif
 
-  pfd = (struct pollfd *) calloc(ctx->num_listening_sockets, sizeof(pfd[0]));
+  // Workers accept connections on listeners of their own, see
+  // accept_and_serve(). Nothing to do until stopped.
+  while (ctx->listener_per_worker && ctx->stop_flag == 0) {
+    mg_sleep(200);
+  }
+
+  // Parked sockets are watched through one more entry, the epoll descriptor.
+  num_pfd = ctx->num_listening_sockets + (ctx->epoll_fd != -1);
+  pfd = (struct pollfd *) calloc(num_pfd, sizeof(pfd[0]));
   while (pfd != NULL && ctx->stop_flag == 0) {
     for (i = 0; i < ctx->num_listening_sockets; i++) {
       pfd[i].fd = ctx->listening_sockets[i].sock;
       pfd[i].events = POLLIN;
     }
+    if (ctx->epoll_fd != -1) {
+      pfd[ctx->num_listening_sockets].fd = ctx->epoll_fd;
+      pfd[ctx->num_listening_sockets].events = POLLIN;
+    }
 
-    if (poll(pfd, ctx->num_listening_sockets, 200) > 0) {
+    if (poll(pfd, num_pfd, 200) > 0) {
       for (i = 0; i < ctx->num_listening_sockets; i++) {
         // NOTE(lsm): on QNX, poll() returns POLLRDNORM after the
         // successfull poll, and POLLIN is defined as (POLLRDNORM | POLLRDBAND)
@@ -5287,16 +5700,33 @@ static void *master_thread(void *thread_func_param) {
           accept_new_connection(&ctx->listening_sockets[i], ctx);
         }
       }
+#if defined(HAVE_EPOLL)
+      if (ctx->epoll_fd != -1 &&
+          (pfd[ctx->num_listening_sockets].revents & POLLIN)) {
+        dispatch_parked_sockets(ctx);
+      }
+#endif
+    }
+
+#if defined(HAVE_EPOLL)
+    if (ctx->epoll_fd != -1 && time(NULL) != last_expiry) {
+      last_expiry = time(NULL);
+      expire_parked_sockets(ctx, 0);
     }
+#endif
   }
   free(pfd);
   DEBUG_TRACE(("stopping workers"));
 
-  // Stop signal received: somebody called mg_stop. Quit.
-  close_all_listening_sockets(ctx);
+  // Stop signal received: somebody called mg_stop. Quit. With a listener
+  // per worker the first worker may still be polling the master's sockets.
+  if (!ctx->listener_per_worker) {
+    close_all_listening_sockets(ctx);
+  }
 
   // Wakeup workers that are waiting for connections to handle.
-  pthread_cond_broadcast(&ctx->sq_full);
+  __atomic_add_fetch(&ctx->sq_produced, 1, __ATOMIC_SEQ_CST);
+  sq_wake(ctx, &ctx->sq_produced, &ctx->sq_full, 1);
 
   // Wait until all threads finish
   (void) pthread_mutex_lock(&ctx->mutex);
@@ -5305,7 +5735,21 @@ static void *master_thread(void *thread_func_param) {
   }
   (void) pthread_mutex_unlock(&ctx->mutex);
 
+  if (ctx->listener_per_worker) {
+    close_all_listening_sockets(ctx);
+  }
+
+#if defined(HAVE_EPOLL)
+  // No worker can park a socket anymore.
+  if (ctx->epoll_fd != -1) {
+    expire_parked_sockets(ctx, 1);
+    close(ctx->epoll_fd);
+  }
+#endif
+  free(ctx->parked);
+
   // All threads exited, no sync is needed. Destroy mutex and condvars
+  (void) pthread_mutex_destroy(&ctx->park_mutex);
   (void) pthread_mutex_destroy(&ctx->mutex);
   (void) pthread_cond_destroy(&ctx->cond);
   (void) pthread_cond_destroy(&ctx->sq_empty);
@@ -5408,6 +5852,12 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
     }
   }
 
+#if defined(HAVE_REUSEPORT)
+  // Must be known before the listening sockets are bound
+  ctx->listener_per_worker =
+    !mg_strcasecmp(ctx->config[LISTENER_PER_WORKER], "yes");
+#endif
+
   // NOTE(lsm): order is important here. SSL certificates must
   // be initialized before listening ports. UID must be set last.
   if (!set_gpass_option(ctx) ||
@@ -5435,6 +5885,21 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
   (void) pthread_cond_init(&ctx->cond, NULL);
   (void) pthread_cond_init(&ctx->sq_empty, NULL);
   (void) pthread_cond_init(&ctx->sq_full, NULL);
+  (void) pthread_mutex_init(&ctx->park_mutex, NULL);
+  for (i = 0; i < MGSQLEN; i++) {
+    ctx->queue[i].seq = i;
+  }
+
+  // Parked sockets are handed back through the queue, which is not used with
+  // a listener per worker.
+  ctx->epoll_fd = -1;
+#if defined(HAVE_EPOLL)
+  if (!ctx->listener_per_worker &&
+      !mg_strcasecmp(ctx->config[PARK_IDLE_CONNECTIONS], "yes") &&
+      (ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    cry(fc(ctx), "epoll_create1: %s", strerror(ERRNO));
+  }
+#endif
 
   // Start master (listening) thread
   mg_start_thread(master_thread, ctx);
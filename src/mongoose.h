@@ -107,6 +107,17 @@ struct mg_callbacks {
   const char * (*open_file)(const struct mg_connection *,
                              const char *path, size_t *data_len);
 
+  // Called when mongoose is about to send a file that open_file returned
+  // from memory, to get the headers that go with it.
+  // Parameters:
+  //    path:    Same as for open_file.
+  //    etag:    Placeholder for the ETag of the file, with the quotes. If
+  //             left NULL, mongoose makes one up from the file size.
+  //    headers: Placeholder for more headers to send along, each followed
+  //             by "\r\n", e.g. Cache-Control.
+  void (*memory_file_headers)(const struct mg_connection *, const char *path,
+                              const char **etag, const char **headers);
+
   // Called when mongoose is about to serve Lua server page (.lp file), if
   // Lua support is enabled.
   // Parameters:
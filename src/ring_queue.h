@@ -0,0 +1,591 @@
+#ifndef NCODE_WEB_RING_QUEUE_H_
+#define NCODE_WEB_RING_QUEUE_H_
+
+#include <stddef.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ncode_common/src/common.h"
+
+namespace nc {
+namespace web {
+
+// Size of a cache line. Indices touched by different threads are kept this far
+// apart to avoid false sharing.
+static constexpr size_t kCacheLineSize = 64;
+
+// Hints the CPU that the caller is busy-waiting.
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Waits for a condition to become true. Spins for a while, then yields and
+// finally blocks on a condition variable. Waking up is cheap when no thread is
+// blocked: Notify only takes the mutex if somebody is parked.
+class SpinThenParkWaiter {
+ public:
+  static constexpr size_t kSpinIterations = 1 << 10;
+  static constexpr size_t kYieldIterations = 1 << 4;
+
+  SpinThenParkWaiter() : parked_(0) {}
+
+  // Waits until ready() returns true.
+  template <typename Predicate>
+  void Wait(Predicate ready) {
+    if (Spin(ready)) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(mu_);
+    Park();
+    cv_.wait(lock, ready);
+    parked_.fetch_sub(1);
+  }
+
+  // Waits until ready() returns true or the deadline passes. Returns the last
+  // value of ready().
+  template <typename Predicate>
+  bool WaitUntil(Predicate ready,
+                 std::chrono::steady_clock::time_point deadline) {
+    if (Spin(ready)) {
+      return true;
+    }
+
+    std::unique_lock<std::mutex> lock(mu_);
+    Park();
+    bool result = cv_.wait_until(lock, deadline, ready);
+    parked_.fetch_sub(1);
+    return result;
+  }
+
+  // Wakes up all parked threads. Should be called after each change that can
+  // make a waiter's predicate true.
+  void Notify() {
+    // Pairs with the fence in Park: either the waiter sees the change, or we
+    // see the waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked_.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mu_);
+    cv_.notify_all();
+  }
+
+ private:
+  template <typename Predicate>
+  bool Spin(Predicate ready) {
+    for (size_t i = 0; i < kSpinIterations; ++i) {
+      if (ready()) {
+        return true;
+      }
+
+      CpuRelax();
+    }
+
+    for (size_t i = 0; i < kYieldIterations; ++i) {
+      if (ready()) {
+        return true;
+      }
+
+      std::this_thread::yield();
+    }
+
+    return false;
+  }
+
+  void Park() {
+    parked_.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  // Number of threads blocked on cv_.
+  std::atomic<size_t> parked_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+};
+
+// A bounded single-producer single-consumer ring of pointers. Each index is
+// only written by one side; the other side's index is cached, so that in the
+// common case neither side touches the other's cache line.
+template <typename T, size_t N>
+class SPSCRing {
+ public:
+  static_assert(N > 0 && (N & (N - 1)) == 0, "Capacity must be a power of 2");
+  static constexpr size_t kCapacity = N;
+
+  SPSCRing() : head_(0), tail_(0) {}
+
+  // Called only by the producer.
+  bool TryPush(T* item) {
+    size_t tail = tail_.value.load(std::memory_order_relaxed);
+    if (tail - producer_.cached_head == N) {
+      producer_.cached_head = head_.value.load(std::memory_order_acquire);
+      if (tail - producer_.cached_head == N) {
+        return false;
+      }
+    }
+
+    slots_[tail & (N - 1)] = item;
+    tail_.value.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called only by the consumer.
+  T* TryPop() {
+    size_t head = head_.value.load(std::memory_order_relaxed);
+    if (head == consumer_.cached_tail) {
+      consumer_.cached_tail = tail_.value.load(std::memory_order_acquire);
+      if (head == consumer_.cached_tail) {
+        return nullptr;
+      }
+    }
+
+    T* item = slots_[head & (N - 1)];
+    head_.value.store(head + 1, std::memory_order_release);
+    return item;
+  }
+
+  // Approximate number of elements, can be called by any thread.
+  size_t size() const {
+    size_t head = head_.value.load(std::memory_order_acquire);
+    size_t tail = tail_.value.load(std::memory_order_acquire);
+    return tail - head;
+  }
+
+ private:
+  struct alignas(kCacheLineSize) Index {
+    Index(size_t initial) : value(initial) {}
+    std::atomic<size_t> value;
+  };
+
+  struct alignas(kCacheLineSize) ProducerState {
+    ProducerState() : cached_head(0) {}
+    size_t cached_head;
+  };
+
+  struct alignas(kCacheLineSize) ConsumerState {
+    ConsumerState() : cached_tail(0) {}
+    size_t cached_tail;
+  };
+
+  // Next slot to pop from, written by the consumer.
+  Index head_;
+
+  // Next slot to push to, written by the producer.
+  Index tail_;
+
+  ProducerState producer_;
+  ConsumerState consumer_;
+  std::array<T*, N> slots_;
+
+  DISALLOW_COPY_AND_ASSIGN(SPSCRing);
+};
+
+// A bounded multi-producer multi-consumer ring of pointers. Each slot has a
+// sequence number that tells producers and consumers whether it is their turn
+// to use it (D. Vyukov's bounded MPMC queue).
+template <typename T, size_t N>
+class MPMCRing {
+ public:
+  static_assert(N > 0 && (N & (N - 1)) == 0, "Capacity must be a power of 2");
+  static constexpr size_t kCapacity = N;
+
+  MPMCRing() : enqueue_pos_(0), dequeue_pos_(0) {
+    for (size_t i = 0; i < N; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+      cells_[i].data = nullptr;
+    }
+  }
+
+  bool TryPush(T* item) {
+    size_t pos = enqueue_pos_.value.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & (N - 1)];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.value.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          cell.data = item;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        // Full.
+        return false;
+      } else {
+        pos = enqueue_pos_.value.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  T* TryPop() {
+    size_t pos = dequeue_pos_.value.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & (N - 1)];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.value.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          T* item = cell.data;
+          cell.sequence.store(pos + N, std::memory_order_release);
+          return item;
+        }
+      } else if (diff < 0) {
+        // Empty.
+        return nullptr;
+      } else {
+        pos = dequeue_pos_.value.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  size_t size() const {
+    size_t dequeue_pos = dequeue_pos_.value.load(std::memory_order_acquire);
+    size_t enqueue_pos = enqueue_pos_.value.load(std::memory_order_acquire);
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T* data;
+  };
+
+  struct alignas(kCacheLineSize) Index {
+    Index(size_t initial) : value(initial) {}
+    std::atomic<size_t> value;
+  };
+
+  Index enqueue_pos_;
+  Index dequeue_pos_;
+  std::array<Cell, N> cells_;
+
+  DISALLOW_COPY_AND_ASSIGN(MPMCRing);
+};
+
+// A queue of unique_ptrs on top of a lock-free ring. Has the same interface as
+// PtrQueue, but producers and consumers never take a lock unless they have to
+// block because the queue is full / empty, in which case they spin for a bit
+// before parking.
+template <typename T, typename Ring>
+class RingPtrQueue {
+ public:
+  RingPtrQueue() : closed_(false) {}
+
+  ~RingPtrQueue() {
+    while (T* item = ring_.TryPop()) {
+      delete item;
+    }
+  }
+
+  // Adds an item to the queue, blocking while the queue is full. Returns false
+  // if the queue is closed, in which case the item is dropped.
+  bool ProduceOrBlock(std::unique_ptr<T> item) {
+    if (IsClosed()) {
+      return false;
+    }
+
+    T* raw_item = item.release();
+    while (!ring_.TryPush(raw_item)) {
+      not_full_.Wait([this] { return !Full() || IsClosed(); });
+      if (IsClosed()) {
+        delete raw_item;
+        return false;
+      }
+    }
+
+    not_empty_.Notify();
+    return true;
+  }
+
+  // Removes an item from the queue, blocking while the queue is empty. Returns
+  // null if the queue is closed and empty.
+  std::unique_ptr<T> ConsumeOrBlock() {
+    while (true) {
+      std::unique_ptr<T> item = Consume();
+      if (item || IsClosed()) {
+        return item;
+      }
+
+      not_empty_.Wait([this] { return ring_.size() != 0 || IsClosed(); });
+    }
+  }
+
+  // Same as ConsumeOrBlock, but gives up after a timeout, in which case
+  // timed_out is set to true.
+  template <typename Duration>
+  std::unique_ptr<T> ConsumeOrBlockWithTimeout(Duration timeout,
+                                               bool* timed_out) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    *timed_out = false;
+    while (true) {
+      std::unique_ptr<T> item = Consume();
+      if (item || IsClosed()) {
+        return item;
+      }
+
+      if (!not_empty_.WaitUntil(
+              [this] { return ring_.size() != 0 || IsClosed(); }, deadline)) {
+        *timed_out = true;
+        return {};
+      }
+    }
+  }
+
+  // Adds all items to the queue, blocking while the queue is full, and clears
+  // items. Consumers are woken up once per batch rather than once per item.
+  // Returns false if the queue is closed, in which case the remaining items are
+  // dropped.
+  bool ProduceBatch(std::vector<std::unique_ptr<T>>* items) {
+    bool all_produced = true;
+    for (std::unique_ptr<T>& item : *items) {
+      if (IsClosed()) {
+        all_produced = false;
+        break;
+      }
+
+      T* raw_item = item.release();
+      while (!ring_.TryPush(raw_item)) {
+        // Consumers need to know about what has been produced so far, or they
+        // will never make room.
+        not_empty_.Notify();
+        not_full_.Wait([this] { return !Full() || IsClosed(); });
+        if (IsClosed()) {
+          delete raw_item;
+          all_produced = false;
+          break;
+        }
+      }
+    }
+
+    items->clear();
+    not_empty_.Notify();
+    return all_produced;
+  }
+
+  // Adds items from the front of items to the queue until the queue is full,
+  // without blocking, and removes them from items. Returns the number of items
+  // added, which is 0 if the queue is closed.
+  size_t TryProduceBatch(std::vector<std::unique_ptr<T>>* items) {
+    if (IsClosed()) {
+      return 0;
+    }
+
+    size_t count = 0;
+    for (; count < items->size(); ++count) {
+      if (!ring_.TryPush((*items)[count].get())) {
+        break;
+      }
+
+      (*items)[count].release();
+    }
+
+    items->erase(items->begin(), items->begin() + count);
+    if (count != 0) {
+      not_empty_.Notify();
+    }
+
+    return count;
+  }
+
+  // Waits for up to timeout for the queue to become non-empty and then removes
+  // up to max_count items without blocking, appending them to out. Returns the
+  // number of items removed. If nothing was removed because the timeout
+  // expired timed_out is set to true, otherwise the queue is closed.
+  template <typename Duration>
+  size_t ConsumeUpTo(size_t max_count, Duration timeout,
+                     std::vector<std::unique_ptr<T>>* out, bool* timed_out) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    *timed_out = false;
+    size_t count = 0;
+    while (count < max_count) {
+      T* item = ring_.TryPop();
+      if (item == nullptr) {
+        if (count != 0 || IsClosed()) {
+          break;
+        }
+
+        if (!not_empty_.WaitUntil(
+                [this] { return ring_.size() != 0 || IsClosed(); },
+                deadline)) {
+          *timed_out = true;
+          break;
+        }
+
+        continue;
+      }
+
+      out->emplace_back(item);
+      ++count;
+    }
+
+    if (count != 0) {
+      not_full_.Notify();
+    }
+
+    return count;
+  }
+
+  // Removes all items currently in the queue.
+  std::vector<std::unique_ptr<T>> Drain() {
+    std::vector<std::unique_ptr<T>> out;
+    while (std::unique_ptr<T> item = Consume()) {
+      out.emplace_back(std::move(item));
+    }
+
+    return out;
+  }
+
+  // Wakes up all blocked producers and consumers. Producers will not be able
+  // to add new items, consumers can still remove items until the queue is
+  // empty.
+  void Close() {
+    closed_.store(true);
+    not_empty_.Notify();
+    not_full_.Notify();
+  }
+
+  // Approximate number of items in the queue.
+  size_t size() const { return ring_.size(); }
+
+ private:
+  std::unique_ptr<T> Consume() {
+    T* item = ring_.TryPop();
+    if (item == nullptr) {
+      return {};
+    }
+
+    not_full_.Notify();
+    return std::unique_ptr<T>(item);
+  }
+
+  bool Full() const { return ring_.size() >= Ring::kCapacity; }
+
+  bool IsClosed() const { return closed_.load(std::memory_order_acquire); }
+
+  Ring ring_;
+  std::atomic<bool> closed_;
+  SpinThenParkWaiter not_empty_;
+  SpinThenParkWaiter not_full_;
+
+  DISALLOW_COPY_AND_ASSIGN(RingPtrQueue);
+};
+
+// A queue with one producer and one consumer thread.
+template <typename T, size_t N>
+using SPSCPtrQueue = RingPtrQueue<T, SPSCRing<T, N>>;
+
+// A queue with any number of producer and consumer threads.
+template <typename T, size_t N>
+using MPMCPtrQueue = RingPtrQueue<T, MPMCRing<T, N>>;
+
+// The functions below perform batch operations on any queue with PtrQueue's
+// interface. If the queue has native batch operations (like RingPtrQueue)
+// they are used, otherwise items are produced / consumed one at a time.
+template <typename Queue, typename T>
+auto ProduceBatchImpl(Queue* queue, std::vector<std::unique_ptr<T>>* items,
+                      int) -> decltype(queue->ProduceBatch(items)) {
+  return queue->ProduceBatch(items);
+}
+
+template <typename Queue, typename T>
+bool ProduceBatchImpl(Queue* queue, std::vector<std::unique_ptr<T>>* items,
+                      long) {
+  bool all_produced = true;
+  for (std::unique_ptr<T>& item : *items) {
+    all_produced &= queue->ProduceOrBlock(std::move(item));
+  }
+
+  items->clear();
+  return all_produced;
+}
+
+template <typename Queue, typename T>
+auto TryProduceBatchImpl(Queue* queue, std::vector<std::unique_ptr<T>>* items,
+                         int) -> decltype(queue->TryProduceBatch(items)) {
+  return queue->TryProduceBatch(items);
+}
+
+template <typename Queue, typename T>
+size_t TryProduceBatchImpl(Queue* queue,
+                           std::vector<std::unique_ptr<T>>* items, long) {
+  size_t count = items->size();
+  return ProduceBatchImpl(queue, items, 0) ? count : 0;
+}
+
+template <typename Queue, typename T, typename Duration>
+auto ConsumeUpToImpl(Queue* queue, size_t max_count, Duration timeout,
+                     std::vector<std::unique_ptr<T>>* out, bool* timed_out,
+                     int)
+    -> decltype(queue->ConsumeUpTo(max_count, timeout, out, timed_out)) {
+  return queue->ConsumeUpTo(max_count, timeout, out, timed_out);
+}
+
+template <typename Queue, typename T, typename Duration>
+size_t ConsumeUpToImpl(Queue* queue, size_t max_count, Duration timeout,
+                       std::vector<std::unique_ptr<T>>* out, bool* timed_out,
+                       long) {
+  size_t count = 0;
+  *timed_out = false;
+  while (count < max_count) {
+    // Only the first item is waited for.
+    bool item_timed_out;
+    std::unique_ptr<T> item = queue->ConsumeOrBlockWithTimeout(
+        count == 0 ? timeout : Duration::zero(), &item_timed_out);
+    if (!item) {
+      *timed_out = count == 0 && item_timed_out;
+      break;
+    }
+
+    out->emplace_back(std::move(item));
+    ++count;
+  }
+
+  return count;
+}
+
+// Adds all items to a queue and clears items. Returns false if not all items
+// could be added because the queue is closed.
+template <typename Queue, typename T>
+bool ProduceBatch(Queue* queue, std::vector<std::unique_ptr<T>>* items) {
+  return ProduceBatchImpl(queue, items, 0);
+}
+
+// Adds items from the front of items to a queue until it is full and removes
+// them from items. Returns the number of items added. Only queues that have a
+// TryProduceBatch of their own can do this without blocking, with others this
+// is the same as ProduceBatch.
+template <typename Queue, typename T>
+size_t TryProduceBatch(Queue* queue, std::vector<std::unique_ptr<T>>* items) {
+  return TryProduceBatchImpl(queue, items, 0);
+}
+
+// Waits for up to timeout for an item and then removes up to max_count items
+// that are immediately available, appending them to out. Returns the number of
+// items removed. If nothing was removed because the timeout expired timed_out
+// is set to true, otherwise the queue is closed.
+template <typename Queue, typename T, typename Duration>
+size_t ConsumeUpTo(Queue* queue, size_t max_count, Duration timeout,
+                   std::vector<std::unique_ptr<T>>* out, bool* timed_out) {
+  return ConsumeUpToImpl(queue, max_count, timeout, out, timed_out, 0);
+}
+
+}  // namespace web
+}  // namespace nc
+
+#endif
@@ -0,0 +1,173 @@
+#include "ring_queue.h"
+
+#include "gtest/gtest.h"
+#include "ncode_common/src/ptr_queue.h"
+
+namespace nc {
+namespace web {
+namespace {
+
+static constexpr size_t kItemCount = 1 << 18;
+
+template <typename Queue>
+class RingQueueTest : public ::testing::Test {
+ protected:
+  Queue queue_;
+};
+
+using QueueTypes =
+    ::testing::Types<SPSCPtrQueue<size_t, 64>, MPMCPtrQueue<size_t, 64>>;
+TYPED_TEST_CASE(RingQueueTest, QueueTypes);
+
+TYPED_TEST(RingQueueTest, Empty) {
+  ASSERT_EQ(0, this->queue_.size());
+  ASSERT_TRUE(this->queue_.Drain().empty());
+
+  bool timed_out;
+  auto item = this->queue_.ConsumeOrBlockWithTimeout(
+      std::chrono::milliseconds(10), &timed_out);
+  ASSERT_FALSE(item);
+  ASSERT_TRUE(timed_out);
+}
+
+TYPED_TEST(RingQueueTest, Drain) {
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(this->queue_.ProduceOrBlock(make_unique<size_t>(i)));
+  }
+
+  ASSERT_EQ(10, this->queue_.size());
+  std::vector<std::unique_ptr<size_t>> items = this->queue_.Drain();
+  ASSERT_EQ(10, items.size());
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_EQ(i, *items[i]);
+  }
+}
+
+TYPED_TEST(RingQueueTest, InOrder) {
+  std::thread producer([this] {
+    for (size_t i = 0; i < kItemCount; ++i) {
+      ASSERT_TRUE(this->queue_.ProduceOrBlock(make_unique<size_t>(i)));
+    }
+  });
+
+  for (size_t i = 0; i < kItemCount; ++i) {
+    std::unique_ptr<size_t> item = this->queue_.ConsumeOrBlock();
+    ASSERT_EQ(i, *item);
+  }
+
+  producer.join();
+}
+
+TYPED_TEST(RingQueueTest, CloseWakesUpConsumer) {
+  std::thread consumer([this] { ASSERT_FALSE(this->queue_.ConsumeOrBlock()); });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  this->queue_.Close();
+  consumer.join();
+  ASSERT_FALSE(this->queue_.ProduceOrBlock(make_unique<size_t>(1)));
+}
+
+// Produces kItemCount items in batches of batch_size and consumes them in
+// batches of up to 32, checking that order is preserved.
+template <typename Queue>
+void CheckBatchesInOrder(Queue* queue, size_t batch_size) {
+  std::thread producer([queue, batch_size] {
+    std::vector<std::unique_ptr<size_t>> batch;
+    for (size_t i = 0; i < kItemCount; ++i) {
+      batch.emplace_back(make_unique<size_t>(i));
+      if (batch.size() == batch_size || i == kItemCount - 1) {
+        ASSERT_TRUE(ProduceBatch(queue, &batch));
+        ASSERT_TRUE(batch.empty());
+      }
+    }
+  });
+
+  std::vector<std::unique_ptr<size_t>> items;
+  size_t next = 0;
+  while (next < kItemCount) {
+    bool timed_out;
+    size_t count =
+        ConsumeUpTo(queue, 32, std::chrono::seconds(10), &items, &timed_out);
+    ASSERT_FALSE(timed_out);
+    ASSERT_LE(count, 32);
+    ASSERT_EQ(count, items.size());
+    for (const auto& item : items) {
+      ASSERT_EQ(next++, *item);
+    }
+
+    items.clear();
+  }
+
+  producer.join();
+}
+
+TYPED_TEST(RingQueueTest, Batches) {
+  // Batches both smaller and larger than the queue.
+  CheckBatchesInOrder(&this->queue_, 10);
+  CheckBatchesInOrder(&this->queue_, 1000);
+}
+
+TYPED_TEST(RingQueueTest, ConsumeUpToTimeoutAndClose) {
+  std::vector<std::unique_ptr<size_t>> items;
+  bool timed_out;
+  ASSERT_EQ(0, ConsumeUpTo(&this->queue_, 10, std::chrono::milliseconds(10),
+                           &items, &timed_out));
+  ASSERT_TRUE(timed_out);
+
+  this->queue_.Close();
+  ASSERT_EQ(0, ConsumeUpTo(&this->queue_, 10, std::chrono::milliseconds(10),
+                           &items, &timed_out));
+  ASSERT_FALSE(timed_out);
+
+  items.emplace_back(make_unique<size_t>(1));
+  ASSERT_FALSE(ProduceBatch(&this->queue_, &items));
+  ASSERT_TRUE(items.empty());
+}
+
+TEST(PtrQueue, Batches) {
+  // Queues without native batch operations fall back to single items.
+  PtrQueue<size_t, 64> queue;
+  CheckBatchesInOrder(&queue, 10);
+  CheckBatchesInOrder(&queue, 1000);
+}
+
+TEST(MPMCPtrQueue, ManyProducersManyConsumers) {
+  size_t thread_count = 4;
+  MPMCPtrQueue<size_t, 64> queue;
+
+  std::vector<std::thread> producers;
+  for (size_t t = 0; t < thread_count; ++t) {
+    producers.emplace_back([&queue] {
+      for (size_t i = 0; i < kItemCount; ++i) {
+        ASSERT_TRUE(queue.ProduceOrBlock(make_unique<size_t>(i)));
+      }
+    });
+  }
+
+  std::vector<size_t> sums(thread_count, 0);
+  std::vector<std::thread> consumers;
+  for (size_t t = 0; t < thread_count; ++t) {
+    consumers.emplace_back([&queue, &sums, t] {
+      for (size_t i = 0; i < kItemCount; ++i) {
+        sums[t] += *queue.ConsumeOrBlock();
+      }
+    });
+  }
+
+  for (size_t t = 0; t < thread_count; ++t) {
+    producers[t].join();
+    consumers[t].join();
+  }
+
+  size_t total = 0;
+  for (size_t sum : sums) {
+    total += sum;
+  }
+
+  ASSERT_EQ(thread_count * kItemCount * (kItemCount - 1) / 2, total);
+  ASSERT_EQ(0, queue.size());
+}
+
+}  // namespace
+}  // namespace web
+}  // namespace nc
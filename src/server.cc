@@ -1,8 +1,1256 @@
 #include "server.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <algorithm>
+#include <cmath>
+#include <signal.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
+#if defined(NCODE_WEB_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 namespace nc {
 namespace web {
 
+// Maximum number of events returned by a single call to epoll_wait.
+static constexpr size_t kMaxEpollEvents = 256;
+
+#if defined(NCODE_WEB_HAVE_IO_URING)
+// Size of io_uring's submission queue. The completion queue is larger, as each
+// multishot poll can complete many times.
+static constexpr uint32_t kIoUringEntries = 256;
+static constexpr uint32_t kIoUringCompletionEntries = 4096;
+
+// Number and size of the buffers io_uring receives into. A power of two, as
+// the ring they are handed to the kernel through has one entry per buffer.
+static constexpr uint32_t kIoUringBuffers = 256;
+static constexpr uint32_t kIoUringBufferSize = 16384;
+#endif
+
+namespace {
+
+// Sets a file descriptor to non-blocking mode.
+void SetNonBlocking(int fd) { fcntl(fd, F_SETFL, O_NONBLOCK); }
+
+// Waits for a non-blocking connect on socket to complete. Returns false with
+// errno set if it fails or does not complete within timeout.
+bool WaitForConnect(int socket, std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  pollfd fd;
+  memset(&fd, 0, sizeof(fd));
+  fd.fd = socket;
+  fd.events = POLLOUT;
+  while (true) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    int result = poll(&fd, 1, std::max<int>(0, remaining.count()));
+    if (result == 1) {
+      break;
+    }
+
+    if (result == 0) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1) {
+    return false;
+  }
+
+  errno = error;
+  return error == 0;
+}
+
+// Returns an event for a socket that is ready for reading and/or writing.
+PollerEvent ReadyEvent(int fd, bool readable, bool writable) {
+  PollerEvent event = PollerEvent();
+  event.fd = fd;
+  event.readable = readable;
+  event.writable = writable;
+  return event;
+}
+
+class SelectPoller : public Poller {
+ public:
+  SelectPoller() : last_fd_(-1) {
+    FD_ZERO(&read_master_);
+    FD_ZERO(&write_master_);
+
+    if (pipe(wakeup_pipe_) == -1) {
+      LOG(FATAL) << "Unable to create pipe: " << strerror(errno);
+    }
+
+    SetNonBlocking(wakeup_pipe_[0]);
+    SetNonBlocking(wakeup_pipe_[1]);
+    CHECK(Add(wakeup_pipe_[0]));
+  }
+
+  ~SelectPoller() override {
+    close(wakeup_pipe_[0]);
+    close(wakeup_pipe_[1]);
+  }
+
+  bool Add(int fd) override {
+    if (fd >= FD_SETSIZE) {
+      LOG(ERROR) << "Socket " << fd << " exceeds FD_SETSIZE, use epoll";
+      return false;
+    }
+
+    FD_SET(fd, &read_master_);
+    last_fd_ = std::max(last_fd_, fd);
+    return true;
+  }
+
+  void Remove(int fd) override {
+    if (fd < FD_SETSIZE) {
+      FD_CLR(fd, &read_master_);
+      FD_CLR(fd, &write_master_);
+    }
+  }
+
+  void SetWriteInterest(int fd, bool enabled) override {
+    if (enabled) {
+      FD_SET(fd, &write_master_);
+    } else {
+      FD_CLR(fd, &write_master_);
+    }
+  }
+
+  bool Wait(std::chrono::milliseconds timeout,
+            std::vector<PollerEvent>* events) override {
+    events->clear();
+
+    fd_set read_fds = read_master_;
+    fd_set write_fds = write_master_;
+    timeval tv = {0, 0};
+    tv.tv_sec = timeout.count() / 1000;
+    tv.tv_usec = (timeout.count() % 1000) * 1000;
+
+    int select_return =
+        select(last_fd_ + 1, &read_fds, &write_fds, nullptr, &tv);
+    if (select_return < 0) {
+      return errno == EINTR;
+    }
+
+    for (int i = 0; i <= last_fd_ && select_return > 0; i++) {
+      bool readable = FD_ISSET(i, &read_fds);
+      bool writable = FD_ISSET(i, &write_fds);
+      if (!readable && !writable) {
+        continue;
+      }
+
+      select_return -= readable + writable;
+      if (i == wakeup_pipe_[0]) {
+        char buf[64];
+        while (read(i, buf, sizeof(buf)) > 0) {
+        }
+        continue;
+      }
+
+      events->push_back(ReadyEvent(i, readable, writable));
+    }
+
+    return true;
+  }
+
+  void Wakeup() override {
+    char c = 0;
+    if (write(wakeup_pipe_[1], &c, 1) == -1 && errno != EAGAIN) {
+      LOG(ERROR) << "Unable to wake up poller: " << strerror(errno);
+    }
+  }
+
+  TCPServerBackend backend() const override {
+    return TCPServerBackend::kSelect;
+  }
+
+ private:
+  // All sockets monitored for reading.
+  fd_set read_master_;
+
+  // Sockets monitored for writing.
+  fd_set write_master_;
+
+  // The largest socket ever added.
+  int last_fd_;
+
+  // A byte is written to the second end to wake up select.
+  int wakeup_pipe_[2];
+};
+
+#if defined(__linux__)
+class EpollPoller : public Poller {
+ public:
+  EpollPoller()
+      : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+        wakeup_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (epoll_fd_ == -1) {
+      LOG(FATAL) << "Unable to create epoll instance: " << strerror(errno);
+    }
+
+    if (wakeup_fd_ == -1) {
+      LOG(FATAL) << "Unable to create eventfd: " << strerror(errno);
+    }
+
+    CHECK(Add(wakeup_fd_));
+    epoll_events_.resize(kMaxEpollEvents);
+  }
+
+  ~EpollPoller() override {
+    close(wakeup_fd_);
+    close(epoll_fd_);
+  }
+
+  bool Add(int fd) override {
+    if (!Control(EPOLL_CTL_ADD, fd, false)) {
+      LOG(ERROR) << "Unable to add socket to epoll: " << strerror(errno);
+      return false;
+    }
+
+    return true;
+  }
+
+  void Remove(int fd) override {
+    // Will fail harmlessly if the socket is not monitored.
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+
+  void SetWriteInterest(int fd, bool enabled) override {
+    if (!Control(EPOLL_CTL_MOD, fd, enabled)) {
+      LOG(ERROR) << "Unable to modify epoll events: " << strerror(errno);
+    }
+  }
+
+  bool Wait(std::chrono::milliseconds timeout,
+            std::vector<PollerEvent>* events) override {
+    events->clear();
+
+    int count = epoll_wait(epoll_fd_, epoll_events_.data(),
+                           epoll_events_.size(), timeout.count());
+    if (count < 0) {
+      return errno == EINTR;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      const epoll_event& event = epoll_events_[i];
+      int fd = event.data.fd;
+      if (fd == wakeup_fd_) {
+        uint64_t value;
+        if (read(wakeup_fd_, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+          LOG(ERROR) << "Unable to read eventfd: " << strerror(errno);
+        }
+        continue;
+      }
+
+      bool readable =
+          event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+      bool writable = event.events & EPOLLOUT;
+      events->push_back(ReadyEvent(fd, readable, writable));
+    }
+
+    return true;
+  }
+
+  void Wakeup() override {
+    uint64_t value = 1;
+    if (write(wakeup_fd_, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+      LOG(ERROR) << "Unable to wake up poller: " << strerror(errno);
+    }
+  }
+
+  TCPServerBackend backend() const override {
+    return TCPServerBackend::kEpoll;
+  }
+
+ private:
+  bool Control(int op, int fd, bool write_interest) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (write_interest) {
+      event.events |= EPOLLOUT;
+    }
+
+    event.data.fd = fd;
+    return epoll_ctl(epoll_fd_, op, fd, &event) != -1;
+  }
+
+  // The epoll instance.
+  int epoll_fd_;
+
+  // Written to in order to wake up epoll_wait.
+  int wakeup_fd_;
+
+  // Populated by epoll_wait.
+  std::vector<epoll_event> epoll_events_;
+};
+#endif
+
+#if defined(NCODE_WEB_HAVE_IO_URING)
+// There is no libc wrapper for these.
+int IoUringSetup(uint32_t entries, io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int IoUringEnter(int ring_fd, uint32_t to_submit, uint32_t min_complete,
+                 uint32_t flags, const void* arg, size_t arg_size) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 arg, arg_size);
+}
+
+int IoUringRegister(int ring_fd, uint32_t opcode, const void* arg,
+                    uint32_t nr_args) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Each monitored socket has a multishot poll request in the ring. Requests to
+// add or modify polls are only queued, and are submitted in the same
+// io_uring_enter call that waits for completions. Where the kernel supports
+// them listening sockets get a multishot accept instead, and connections a
+// multishot receive into buffers the kernel picks from a ring shared with it,
+// so that accepting and reading do not cost a syscall each either. The poll
+// on a connection then only reports writability and errors.
+class IoUringPoller : public Poller {
+ public:
+  // Returns null if io_uring is not available or the kernel is too old.
+  static std::unique_ptr<IoUringPoller> Create() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = kIoUringCompletionEntries;
+
+    int ring_fd = IoUringSetup(kIoUringEntries, &params);
+    if (ring_fd == -1) {
+      LOG(INFO) << "Unable to set up io_uring: " << strerror(errno);
+      return {};
+    }
+
+    // Multishot polls and poll updates came with 5.13, as did resource tags.
+    uint32_t required_features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                                 IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+    if ((params.features & required_features) != required_features) {
+      LOG(INFO) << "Kernel io_uring lacks required features";
+      close(ring_fd);
+      return {};
+    }
+
+    std::unique_ptr<IoUringPoller> poller(new IoUringPoller(ring_fd));
+    if (!poller->MapRings(params)) {
+      return {};
+    }
+
+    CHECK(poller->Add(poller->wakeup_fd_));
+
+    // Provided buffer rings came with 5.19, as did multishot accepts.
+    // Multishot receives only came with 6.0, and have to be tried out.
+    if (poller->SetUpBuffers()) {
+      poller->accepts_connections_ = true;
+      poller->receives_data_ = poller->ProbeMultishotReceive();
+    }
+
+    if (!poller->receives_data_) {
+      LOG(INFO) << "Kernel io_uring lacks multishot receives, only polling";
+    }
+
+    return poller;
+  }
+
+  ~IoUringPoller() override {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+
+    if (rings_ != MAP_FAILED) {
+      munmap(rings_, rings_size_);
+    }
+
+    close(wakeup_fd_);
+    close(ring_fd_);
+
+    // The kernel is done with the buffers once the ring is closed.
+    if (buffer_ring_ != MAP_FAILED) {
+      munmap(buffer_ring_, kIoUringBuffers * sizeof(io_uring_buf));
+    }
+
+    if (buffers_ != MAP_FAILED) {
+      munmap(buffers_, kIoUringBuffers * kIoUringBufferSize);
+    }
+  }
+
+  bool Add(int fd) override {
+    FdState& state = NewFdState(fd);
+    state.receiving = receives_data_;
+    ArmPoll(fd);
+    if (state.receiving) {
+      ArmReceive(fd);
+    }
+
+    return true;
+  }
+
+  bool Listen(int fd) override {
+    if (!accepts_connections_) {
+      return Add(fd);
+    }
+
+    FdState* state = Registered(fd);
+    if (state == nullptr) {
+      state = &NewFdState(fd);
+      state->listening = true;
+    }
+
+    if (!state->accept_armed) {
+      ArmAccept(fd);
+    }
+
+    return true;
+  }
+
+  bool AcceptsConnections() const override { return accepts_connections_; }
+
+  bool ReceivesData() const override { return receives_data_; }
+
+  void Remove(int fd) override {
+    FdState* state = Registered(fd);
+    if (state == nullptr) {
+      return;
+    }
+
+    if (state->listening) {
+      Cancel(UserData(fd, Request::kAccept));
+    } else {
+      io_uring_sqe* sqe = NextSqe();
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = UserData(fd, Request::kPoll);
+      sqe->user_data = kIgnoredUserData;
+    }
+
+    if (state->receive_armed) {
+      Cancel(UserData(fd, Request::kReceive));
+    }
+
+    state->registered = false;
+
+    // Pending requests hold a reference to the socket, which would stay open
+    // even after it is closed by the caller. Unlike the other requests these
+    // cannot wait for the next call to Wait.
+    if (!Submit(0, nullptr)) {
+      LOG(ERROR) << "Unable to submit to io_uring: " << strerror(errno);
+    }
+  }
+
+  void SetWriteInterest(int fd, bool enabled) override {
+    FdState* state = Registered(fd);
+    if (state == nullptr || state->write_interest == enabled) {
+      return;
+    }
+
+    state->write_interest = enabled;
+    io_uring_sqe* sqe = NextSqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = UserData(fd, Request::kPoll);
+    sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = PollMask(*state);
+    sqe->user_data = kIgnoredUserData;
+  }
+
+  void SetReadInterest(int fd, bool enabled) override {
+    FdState* state = Registered(fd);
+    if (state == nullptr || !state->receiving ||
+        state->read_interest == enabled) {
+      return;
+    }
+
+    // A receive that is being cancelled is re-armed when the cancellation
+    // completes, if it is wanted again by then.
+    state->read_interest = enabled;
+    if (enabled && !state->receive_armed) {
+      ArmReceive(fd);
+    } else if (!enabled && state->receive_armed) {
+      Cancel(UserData(fd, Request::kReceive));
+    }
+  }
+
+  bool Wait(std::chrono::milliseconds timeout,
+            std::vector<PollerEvent>* events) override {
+    events->clear();
+
+    // The data of the last call's events has been consumed.
+    RecycleBuffers();
+    RearmReceives();
+
+    if (CompletionsReady()) {
+      if (!Submit(0, nullptr)) {
+        return false;
+      }
+    } else {
+      __kernel_timespec ts;
+      ts.tv_sec = timeout.count() / 1000;
+      ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+
+      io_uring_getevents_arg arg;
+      memset(&arg, 0, sizeof(arg));
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+      if (!Submit(1, &arg)) {
+        return false;
+      }
+    }
+
+    uint32_t head = *cq_head_;
+    uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      HandleCompletion(cqes_[head & cq_mask_], events);
+    }
+
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  void Wakeup() override {
+    uint64_t value = 1;
+    if (write(wakeup_fd_, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+      LOG(ERROR) << "Unable to wake up poller: " << strerror(errno);
+    }
+  }
+
+  TCPServerBackend backend() const override {
+    return TCPServerBackend::kIoUring;
+  }
+
+ private:
+  // user_data of requests whose completions are of no interest.
+  static constexpr uint64_t kIgnoredUserData = ~0ULL;
+
+  // user_data of the receive ProbeMultishotReceive tries.
+  static constexpr uint64_t kProbeUserData = ~1ULL;
+
+  // The provided buffer group receives pick buffers from.
+  static constexpr uint16_t kBufferGroup = 0;
+
+  // The kinds of requests kept for an fd, stored in the top bits of
+  // user_data.
+  enum class Request : uint64_t {
+    kPoll = 0,
+    kReceive = 1,
+    kAccept = 2,
+  };
+
+  struct FdState {
+    FdState()
+        : tag(0),
+          registered(false),
+          write_interest(false),
+          listening(false),
+          accept_armed(false),
+          receiving(false),
+          read_interest(false),
+          receive_armed(false) {}
+
+    // Incremented every time the fd is added.
+    uint32_t tag;
+    bool registered;
+    bool write_interest;
+
+    // Set for listening sockets added with Listen, which have a multishot
+    // accept instead of a poll, and whether the accept is active.
+    bool listening;
+    bool accept_armed;
+
+    // Set for connections that have a multishot receive, whether data is
+    // wanted, and whether the receive is active.
+    bool receiving;
+    bool read_interest;
+    bool receive_armed;
+  };
+
+  explicit IoUringPoller(int ring_fd)
+      : ring_fd_(ring_fd),
+        wakeup_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        rings_(MAP_FAILED),
+        rings_size_(0),
+        sqes_(MAP_FAILED),
+        sqes_size_(0),
+        sq_local_tail_(0),
+        to_submit_(0),
+        buffer_ring_(MAP_FAILED),
+        buffers_(MAP_FAILED),
+        buffer_ring_tail_(0),
+        accepts_connections_(false),
+        receives_data_(false),
+        probe_done_(false),
+        probe_result_(0),
+        probe_flags_(0) {
+    if (wakeup_fd_ == -1) {
+      LOG(FATAL) << "Unable to create eventfd: " << strerror(errno);
+    }
+  }
+
+  // Maps the submission and completion rings into memory.
+  bool MapRings(const io_uring_params& params) {
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    rings_size_ = std::max(sq_size, cq_size);
+    rings_ = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (rings_ == MAP_FAILED) {
+      LOG(ERROR) << "Unable to map io_uring: " << strerror(errno);
+      return false;
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      LOG(ERROR) << "Unable to map io_uring entries: " << strerror(errno);
+      return false;
+    }
+
+    char* base = static_cast<char*>(rings_);
+    sq_head_ = reinterpret_cast<uint32_t*>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<uint32_t*>(base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<uint32_t*>(base + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    cq_head_ = reinterpret_cast<uint32_t*>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<uint32_t*>(base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<uint32_t*>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+    // Submission queue slot i always refers to entry i.
+    uint32_t* sq_array =
+        reinterpret_cast<uint32_t*>(base + params.sq_off.array);
+    for (uint32_t i = 0; i < sq_entries_; ++i) {
+      sq_array[i] = i;
+    }
+
+    sq_local_tail_ = *sq_tail_;
+    return true;
+  }
+
+  // Allocates the buffers receives go into and registers the ring they are
+  // handed to the kernel through. Returns false if the kernel does not
+  // support provided buffer rings.
+  bool SetUpBuffers() {
+    size_t ring_size = kIoUringBuffers * sizeof(io_uring_buf);
+    buffer_ring_ = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffers_ = mmap(nullptr, kIoUringBuffers * kIoUringBufferSize,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer_ring_ == MAP_FAILED || buffers_ == MAP_FAILED) {
+      LOG(ERROR) << "Unable to allocate io_uring buffers: " << strerror(errno);
+      return false;
+    }
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+    reg.ring_entries = kIoUringBuffers;
+    reg.bgid = kBufferGroup;
+    if (IoUringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+      LOG(INFO) << "Unable to register io_uring buffers: " << strerror(errno);
+      return false;
+    }
+
+    for (uint32_t i = 0; i < kIoUringBuffers; ++i) {
+      to_recycle_.emplace_back(i);
+    }
+
+    RecycleBuffers();
+    return true;
+  }
+
+  // Returns true if the kernel supports multishot receives, by receiving a
+  // byte over a socket pair.
+  bool ProbeMultishotReceive() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   fds) == -1) {
+      LOG(ERROR) << "Unable to create socket pair: " << strerror(errno);
+      return false;
+    }
+
+    io_uring_sqe* sqe = NextSqe();
+    PrepareReceive(fds[0], sqe);
+    sqe->user_data = kProbeUserData;
+
+    char byte = 0;
+    std::vector<PollerEvent> events;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    if (write(fds[1], &byte, 1) == 1) {
+      while (!probe_done_ && std::chrono::steady_clock::now() < deadline) {
+        if (!Wait(std::chrono::milliseconds(100), &events)) {
+          break;
+        }
+      }
+    }
+
+    // Ends the receive, if it is still going.
+    shutdown(fds[0], SHUT_RDWR);
+    close(fds[0]);
+    close(fds[1]);
+    return probe_result_ == 1 && (probe_flags_ & IORING_CQE_F_MORE);
+  }
+
+  // Hands buffers whose data has been consumed back to the kernel.
+  void RecycleBuffers() {
+    if (to_recycle_.empty()) {
+      return;
+    }
+
+    io_uring_buf* bufs = static_cast<io_uring_buf*>(buffer_ring_);
+    for (uint16_t id : to_recycle_) {
+      io_uring_buf& buf = bufs[buffer_ring_tail_ & (kIoUringBuffers - 1)];
+      buf.addr = reinterpret_cast<uint64_t>(Buffer(id));
+      buf.len = kIoUringBufferSize;
+      buf.bid = id;
+      ++buffer_ring_tail_;
+    }
+
+    // The ring's tail overlays the reserved field of its first entry.
+    __atomic_store_n(&bufs[0].resv, buffer_ring_tail_, __ATOMIC_RELEASE);
+    to_recycle_.clear();
+  }
+
+  // Re-arms receives that stopped because the kernel ran out of buffers.
+  void RearmReceives() {
+    for (int fd : to_rearm_) {
+      FdState* state = Registered(fd);
+      if (state != nullptr && state->receiving && state->read_interest &&
+          !state->receive_armed) {
+        ArmReceive(fd);
+      }
+    }
+
+    to_rearm_.clear();
+  }
+
+  char* Buffer(uint16_t id) const {
+    return static_cast<char*>(buffers_) +
+           static_cast<size_t>(id) * kIoUringBufferSize;
+  }
+
+  // Returns a zeroed submission queue entry. It will be submitted on the next
+  // call to Submit.
+  io_uring_sqe* NextSqe() {
+    uint32_t head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_local_tail_ - head == sq_entries_) {
+      // Full, have the kernel consume what is there.
+      if (!Submit(0, nullptr) ||
+          sq_local_tail_ == __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) +
+                                sq_entries_) {
+        LOG(FATAL) << "Unable to submit to io_uring: " << strerror(errno);
+      }
+    }
+
+    io_uring_sqe* sqe =
+        static_cast<io_uring_sqe*>(sqes_) + (sq_local_tail_ & sq_mask_);
+    memset(sqe, 0, sizeof(*sqe));
+    ++sq_local_tail_;
+    ++to_submit_;
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    return sqe;
+  }
+
+  // Submits queued entries. If min_complete is non-zero waits for that many
+  // completions, with a timeout in arg. Returns false on error.
+  bool Submit(uint32_t min_complete, const io_uring_getevents_arg* arg) {
+    uint32_t flags = 0;
+    if (min_complete != 0) {
+      flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    } else if (to_submit_ == 0) {
+      return true;
+    }
+
+    int submitted = IoUringEnter(ring_fd_, to_submit_, min_complete, flags, arg,
+                                 arg == nullptr ? 0 : sizeof(*arg));
+    if (submitted < 0) {
+      // Timed out, interrupted, or the completion queue needs to be drained
+      // before more can be submitted.
+      return errno == ETIME || errno == EINTR || errno == EBUSY ||
+             errno == EAGAIN;
+    }
+
+    to_submit_ -= submitted;
+    return true;
+  }
+
+  bool CompletionsReady() const {
+    return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  }
+
+  // Starts tracking fd, with a new tag so that completions for requests of a
+  // previous user of the same fd are not mistaken for its own.
+  FdState& NewFdState(int fd) {
+    if (static_cast<size_t>(fd) >= fds_.size()) {
+      fds_.resize(std::max(fds_.size() * 2, static_cast<size_t>(fd) + 1));
+    }
+
+    FdState& state = fds_[fd];
+    uint32_t tag = state.tag + 1;
+    state = FdState();
+    state.tag = tag;
+    state.registered = true;
+    state.read_interest = true;
+    return state;
+  }
+
+  // Queues a multishot poll for fd.
+  void ArmPoll(int fd) {
+    io_uring_sqe* sqe = NextSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = PollMask(fds_[fd]);
+    sqe->user_data = UserData(fd, Request::kPoll);
+  }
+
+  // Queues a multishot accept on listening socket fd.
+  void ArmAccept(int fd) {
+    io_uring_sqe* sqe = NextSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = UserData(fd, Request::kAccept);
+    fds_[fd].accept_armed = true;
+  }
+
+  // Queues a multishot receive on fd.
+  void ArmReceive(int fd) {
+    io_uring_sqe* sqe = NextSqe();
+    PrepareReceive(fd, sqe);
+    sqe->user_data = UserData(fd, Request::kReceive);
+    fds_[fd].receive_armed = true;
+  }
+
+  static void PrepareReceive(int fd, io_uring_sqe* sqe) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+  }
+
+  // Queues the cancellation of the request with the given user_data.
+  void Cancel(uint64_t user_data) {
+    io_uring_sqe* sqe = NextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = kIgnoredUserData;
+  }
+
+  void HandleCompletion(const io_uring_cqe& cqe,
+                        std::vector<PollerEvent>* events) {
+    uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      // Handed back at the start of the next Wait, once the caller is done
+      // with the data.
+      to_recycle_.emplace_back(buffer_id);
+    }
+
+    if (cqe.user_data == kIgnoredUserData) {
+      return;
+    }
+
+    if (cqe.user_data == kProbeUserData) {
+      if (!probe_done_) {
+        probe_done_ = true;
+        probe_result_ = cqe.res;
+        probe_flags_ = cqe.flags;
+      }
+      return;
+    }
+
+    int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+    Request request = static_cast<Request>(cqe.user_data >> 62);
+    FdState* state = Registered(fd);
+    if (state == nullptr || UserData(fd, request) != cqe.user_data) {
+      // For a request that has since been removed.
+      if (request == Request::kAccept && cqe.res >= 0) {
+        close(cqe.res);
+      }
+      return;
+    }
+
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    switch (request) {
+      case Request::kPoll:
+        HandlePollCompletion(fd, cqe.res, more, events);
+        break;
+      case Request::kReceive:
+        HandleReceiveCompletion(fd, state, cqe.res, more, Buffer(buffer_id),
+                                events);
+        break;
+      case Request::kAccept:
+        HandleAcceptCompletion(fd, state, cqe.res, more, events);
+        break;
+    }
+  }
+
+  void HandlePollCompletion(int fd, int res, bool more,
+                            std::vector<PollerEvent>* events) {
+    if (!more) {
+      // The kernel has stopped the multishot poll, for example because the
+      // completion queue overflowed. A new poll will report the fd right away
+      // if it is ready, so nothing is missed.
+      ArmPoll(fd);
+    }
+
+    if (fd == wakeup_fd_) {
+      uint64_t value;
+      if (read(wakeup_fd_, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        LOG(ERROR) << "Unable to read eventfd: " << strerror(errno);
+      }
+      return;
+    }
+
+    if (res < 0) {
+      if (res != -ECANCELED) {
+        // Let the reader find out what is wrong with the socket.
+        events->push_back(ReadyEvent(fd, true, false));
+      }
+      return;
+    }
+
+    uint32_t mask = res;
+    bool readable = mask & (POLLIN | POLLRDHUP | POLLHUP | POLLERR);
+    bool writable = mask & POLLOUT;
+    events->push_back(ReadyEvent(fd, readable, writable));
+  }
+
+  void HandleReceiveCompletion(int fd, FdState* state, int res, bool more,
+                               const char* data,
+                               std::vector<PollerEvent>* events) {
+    if (res > 0) {
+      PollerEvent event = PollerEvent();
+      event.fd = fd;
+      event.data = data;
+      event.data_len = res;
+      events->push_back(event);
+      if (!more) {
+        // Stopped by the kernel, as with polls.
+        state->receive_armed = false;
+        if (state->read_interest) {
+          ArmReceive(fd);
+        }
+      }
+      return;
+    }
+
+    state->receive_armed = false;
+    if (res == -ENOBUFS) {
+      // Data stays in the socket until buffers are handed back.
+      to_rearm_.emplace_back(fd);
+      return;
+    }
+
+    if (res == -ECANCELED) {
+      // By SetReadInterest.
+      if (state->read_interest) {
+        ArmReceive(fd);
+      }
+      return;
+    }
+
+    PollerEvent event = PollerEvent();
+    event.fd = fd;
+    event.receive_ended = true;
+    events->push_back(event);
+  }
+
+  void HandleAcceptCompletion(int fd, FdState* state, int res, bool more,
+                              std::vector<PollerEvent>* events) {
+    if (res >= 0) {
+      PollerEvent event = PollerEvent();
+      event.fd = res;
+      event.accepted = true;
+      events->push_back(event);
+      if (!more) {
+        state->accept_armed = false;
+        ArmAccept(fd);
+      }
+      return;
+    }
+
+    // Errors, like running out of descriptors, stop the accept. The caller
+    // takes over until the backlog is empty and calls Listen again.
+    state->accept_armed = false;
+    events->push_back(ReadyEvent(fd, true, false));
+  }
+
+  FdState* Registered(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= fds_.size() ||
+        !fds_[fd].registered) {
+      return nullptr;
+    }
+
+    return &fds_[fd];
+  }
+
+  // The request kind goes in the top 2 bits, and 30 bits of the fd's tag
+  // above the fd.
+  uint64_t UserData(int fd, Request request) const {
+    return (static_cast<uint64_t>(request) << 62) |
+           (static_cast<uint64_t>(fds_[fd].tag & 0x3fffffff) << 32) |
+           static_cast<uint32_t>(fd);
+  }
+
+  static uint32_t PollMask(const FdState& state) {
+    // Errors and hangups are always reported. Connections with a receive
+    // only need to be polled for them, they include MSG_ZEROCOPY
+    // completions.
+    uint32_t mask = state.receiving ? 0 : POLLIN | POLLRDHUP;
+    if (state.write_interest) {
+      mask |= POLLOUT;
+    }
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+    // The kernel expects the 16-bit halves swapped.
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    return mask;
+  }
+
+  // The ring.
+  int ring_fd_;
+
+  // Written to in order to wake up Wait.
+  int wakeup_fd_;
+
+  // Shared memory with the kernel.
+  void* rings_;
+  size_t rings_size_;
+  void* sqes_;
+  size_t sqes_size_;
+
+  // Submission queue.
+  uint32_t* sq_head_;
+  uint32_t* sq_tail_;
+  uint32_t sq_mask_;
+  uint32_t sq_entries_;
+  uint32_t sq_local_tail_;
+
+  // Number of entries queued but not yet consumed by the kernel.
+  uint32_t to_submit_;
+
+  // Completion queue.
+  uint32_t* cq_head_;
+  uint32_t* cq_tail_;
+  uint32_t cq_mask_;
+  io_uring_cqe* cqes_;
+
+  // The ring through which buffers are handed to the kernel, and the buffers
+  // themselves, kIoUringBuffers of kIoUringBufferSize bytes each.
+  void* buffer_ring_;
+  void* buffers_;
+  uint16_t buffer_ring_tail_;
+
+  // Buffers to hand back to the kernel on the next Wait.
+  std::vector<uint16_t> to_recycle_;
+
+  // Fds whose receive ran out of buffers, to re-arm on the next Wait.
+  std::vector<int> to_rearm_;
+
+  // What the kernel supports, see AcceptsConnections and ReceivesData.
+  bool accepts_connections_;
+  bool receives_data_;
+
+  // Outcome of ProbeMultishotReceive.
+  bool probe_done_;
+  int probe_result_;
+  uint32_t probe_flags_;
+
+  // Indexed by fd.
+  std::vector<FdState> fds_;
+};
+#endif
+
+}  // namespace
+
+std::unique_ptr<Poller> NewPoller(TCPServerBackend backend) {
+  switch (backend) {
+    case TCPServerBackend::kIoUring: {
+#if defined(NCODE_WEB_HAVE_IO_URING)
+      std::unique_ptr<Poller> poller = IoUringPoller::Create();
+      if (poller) {
+        return poller;
+      }
+#endif
+      LOG(INFO) << "io_uring not available, falling back to epoll";
+      return NewPoller(TCPServerBackend::kEpoll);
+    }
+    case TCPServerBackend::kEpoll:
+#if defined(__linux__)
+      return make_unique<EpollPoller>();
+#else
+      LOG(ERROR) << "epoll not available, falling back to select";
+      return make_unique<SelectPoller>();
+#endif
+    case TCPServerBackend::kSelect:
+      return make_unique<SelectPoller>();
+  }
+
+  LOG(FATAL) << "Unknown backend";
+  return {};
+}
+
+uint64_t HistogramSnapshot::count() const {
+  uint64_t total = 0;
+  for (uint64_t bucket_count : buckets) {
+    total += bucket_count;
+  }
+
+  return total;
+}
+
+uint64_t HistogramSnapshot::Quantile(double q) const {
+  uint64_t total = count();
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = std::max<uint64_t>(1, std::ceil(q * total));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      // The largest value that falls in bucket i.
+      return i == 0 ? 0 : std::numeric_limits<uint64_t>::max() >> (64 - i);
+    }
+  }
+
+  return std::numeric_limits<uint64_t>::max();
+}
+
+void HistogramSnapshot::Add(const HistogramSnapshot& other) {
+  for (size_t i = 0; i < kBuckets; ++i) {
+    buckets[i] += other.buckets[i];
+  }
+}
+
+void ConnectionStats::Add(const ConnectionStats& other) {
+  bytes_in += other.bytes_in;
+  bytes_out += other.bytes_out;
+  frames_in += other.frames_in;
+  frames_out += other.frames_out;
+  reads += other.reads;
+  read_would_block += other.read_would_block;
+  partial_reads += other.partial_reads;
+  writes += other.writes;
+  write_would_block += other.write_would_block;
+  ingest_stalls += other.ingest_stalls;
+  frames_dropped += other.frames_dropped;
+}
+
+ConnectionStats ConnectionCounters::Snapshot() const {
+  ConnectionStats stats;
+  stats.bytes_in = bytes_in.value();
+  stats.bytes_out = bytes_out.value();
+  stats.frames_in = frames_in.value();
+  stats.frames_out = frames_out.value();
+  stats.reads = reads.value();
+  stats.read_would_block = read_would_block.value();
+  stats.partial_reads = partial_reads.value();
+  stats.writes = writes.value();
+  stats.write_would_block = write_would_block.value();
+  stats.ingest_stalls = ingest_stalls.value();
+  stats.frames_dropped = frames_dropped.value();
+  return stats;
+}
+
+size_t SizeClassForMessageSize(size_t size) {
+  size_t size_class = 0;
+  while (size > (kMinPooledMessageSize << size_class)) {
+    if (++size_class == kMessagePoolSizeClasses) {
+      break;
+    }
+  }
+
+  return size_class;
+}
+
+size_t SizeClassForMessageCapacity(size_t capacity) {
+  if (capacity < kMinPooledMessageSize) {
+    return kMessagePoolSizeClasses;
+  }
+
+  size_t size_class = 0;
+  while (capacity >= (kMinPooledMessageSize << (size_class + 1))) {
+    if (++size_class == kMessagePoolSizeClasses) {
+      break;
+    }
+  }
+
+  return size_class;
+}
+
+int ConnectToServer(const std::string& destination_address, uint32_t port,
+                    std::chrono::milliseconds timeout) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrinfo* res;
+  int result = getaddrinfo(destination_address.c_str(), nullptr, &hints, &res);
+  if (result != 0) {
+    LOG(ERROR) << "Unable to resolve " << destination_address << ": "
+               << gai_strerror(result);
+    return -1;
+  }
+
+  sockaddr_in address;
+  memcpy(&address, res->ai_addr, sizeof(address));
+  address.sin_port = htons(port);
+  freeaddrinfo(res);
+
+  int s = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (s == -1) {
+    LOG(ERROR) << "Unable to get socket: " << strerror(errno);
+    return -1;
+  }
+
+  // Connects in non-blocking mode, so that the attempt can be given up on
+  // after timeout.
+  if (timeout.count() != 0) {
+    SetNonBlocking(s);
+  }
+
+  if (::connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+          0 &&
+      !(errno == EINPROGRESS && WaitForConnect(s, timeout))) {
+    LOG(ERROR) << "Unable to connect to " << destination_address << ":" << port
+               << ": " << strerror(errno);
+    close(s);
+    return -1;
+  }
+
+  // Callers expect a blocking socket.
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
+  return s;
+}
+
 bool BlockingRawReadFromSocket(int sock, char* buf, uint32_t len) {
   uint32_t total = 0;
 
@@ -19,6 +1267,56 @@ bool BlockingRawReadFromSocket(int sock, char* buf, uint32_t len) {
   return true;
 }
 
+void SetLowLatencyOptions(int sock, int busy_poll_usec) {
+  int yes = 1;
+  if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1) {
+    LOG(ERROR) << "Unable to set TCP_NODELAY: " << strerror(errno);
+  }
+
+  SetQuickAck(sock);
+#if defined(SO_BUSY_POLL)
+  if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec,
+                 sizeof(busy_poll_usec)) == -1) {
+    LOG(ERROR) << "Unable to set SO_BUSY_POLL: " << strerror(errno);
+  }
+#else
+  Unused(busy_poll_usec);
+#endif
+}
+
+void SetQuickAck(int sock) {
+#if defined(TCP_QUICKACK)
+  int yes = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes));
+#else
+  Unused(sock);
+#endif
+}
+
+bool PinCurrentThreadToCpu(int cpu) {
+#if defined(__linux__)
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    errno = EINVAL;
+    return false;
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (result != 0) {
+    errno = result;
+    return false;
+  }
+
+  return true;
+#else
+  Unused(cpu);
+  errno = ENOSYS;
+  return false;
+#endif
+}
+
 bool BlockingRawWriteToSocket(int sock, const char* buf, uint32_t len) {
   uint32_t total = 0;
 
@@ -35,5 +1333,194 @@ bool BlockingRawWriteToSocket(int sock, const char* buf, uint32_t len) {
   return true;
 }
 
+bool BlockingRawWritevToSocket(int sock, iovec* iov, size_t iov_count) {
+  size_t iov_max = IOV_MAX;
+  while (iov_count > 0) {
+    // Same as writev, but a peer that has gone away should not kill the
+    // process with SIGPIPE.
+    msghdr msg_header;
+    memset(&msg_header, 0, sizeof(msg_header));
+    msg_header.msg_iov = iov;
+    msg_header.msg_iovlen = std::min(iov_count, iov_max);
+    ssize_t bytes_written = sendmsg(sock, &msg_header, MSG_NOSIGNAL);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      LOG(ERROR) << "Unable to write: " << strerror(errno);
+      return false;
+    }
+
+    // Skip over buffers that were written out completely and adjust the first
+    // one that was not.
+    size_t remaining = bytes_written;
+    while (iov_count > 0 && remaining >= iov->iov_len) {
+      remaining -= iov->iov_len;
+      ++iov;
+      --iov_count;
+    }
+
+    if (iov_count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+      iov->iov_len -= remaining;
+    }
+  }
+
+  return true;
+}
+
+namespace {
+
+ssize_t SendFileNoSignal(int sock, int fd, off_t offset, size_t count) {
+#if defined(__linux__)
+  return sendfile(sock, fd, &offset, count);
+#else
+  // No sendfile(), the file is copied through a buffer.
+  char buf[1 << 16];
+  ssize_t bytes_read = pread(fd, buf, std::min(count, sizeof(buf)), offset);
+  if (bytes_read <= 0) {
+    return bytes_read;
+  }
+
+  return send(sock, buf, bytes_read, MSG_NOSIGNAL);
+#endif
+}
+
+}  // namespace
+
+ssize_t SendFile(int sock, int fd, off_t offset, size_t count) {
+#if defined(__linux__)
+  // Unlike send(), sendfile() has no MSG_NOSIGNAL. SIGPIPE is blocked around
+  // the call and consumed if the call raised it.
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  sigset_t pending;
+  sigpending(&pending);
+  bool was_pending = sigismember(&pending, SIGPIPE);
+
+  sigset_t old_mask;
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+  ssize_t bytes_written = SendFileNoSignal(sock, fd, offset, count);
+  if (bytes_written < 0 && errno == EPIPE && !was_pending) {
+    timespec no_wait = {0, 0};
+    sigtimedwait(&sigpipe, nullptr, &no_wait);
+    errno = EPIPE;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+  return bytes_written;
+#else
+  return SendFileNoSignal(sock, fd, offset, count);
+#endif
+}
+
+bool BlockingSendFileRegion(int sock, const FileRegion& region) {
+  size_t sent = 0;
+  while (sent < region.length) {
+    ssize_t bytes_written = SendFile(sock, region.file->fd(),
+                                     region.offset + sent,
+                                     region.length - sent);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      LOG(ERROR) << "Unable to send file: " << strerror(errno);
+      return false;
+    }
+
+    if (bytes_written == 0) {
+      LOG(ERROR) << "File shorter than the region to send";
+      return false;
+    }
+
+    sent += bytes_written;
+  }
+
+  return true;
+}
+
+bool EnableZeroCopy(int sock) {
+#if defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+  int yes = 1;
+  return setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == 0;
+#else
+  Unused(sock);
+  return false;
+#endif
+}
+
+void ZeroCopyTracker::Completed(uint32_t first, uint32_t last) {
+  if (first == done_below_) {
+    done_below_ = last + 1;
+  } else {
+    for (uint32_t id = first;; ++id) {
+      done_out_of_order_.insert(id);
+      if (id == last) {
+        break;
+      }
+    }
+  }
+
+  while (true) {
+    auto it = done_out_of_order_.find(done_below_);
+    if (it == done_out_of_order_.end()) {
+      break;
+    }
+
+    done_out_of_order_.erase(it);
+    ++done_below_;
+  }
+}
+
+bool ReadZeroCopyCompletions(int sock, ZeroCopyTracker* tracker) {
+#if defined(SO_EE_ORIGIN_ZEROCOPY)
+  while (true) {
+    char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+    msghdr msg_header;
+    memset(&msg_header, 0, sizeof(msg_header));
+    msg_header.msg_control = control;
+    msg_header.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg_header, MSG_ERRQUEUE) == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+
+      if (errno == EINTR) {
+        continue;
+      }
+
+      LOG(ERROR) << "Unable to read error queue: " << strerror(errno);
+      return false;
+    }
+
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg_header); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg_header, cmsg)) {
+      bool recverr =
+          (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+          (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+      if (!recverr) {
+        continue;
+      }
+
+      sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if (err.ee_origin == SO_EE_ORIGIN_ZEROCOPY && err.ee_errno == 0) {
+        // Sends ee_info to ee_data are done. If the kernel had to copy the
+        // data after all ee_code is SO_EE_CODE_ZEROCOPY_COPIED, which makes
+        // no difference here.
+        tracker->Completed(err.ee_info, err.ee_data);
+      }
+    }
+  }
+#else
+  Unused(sock);
+  Unused(tracker);
+  return true;
+#endif
+}
+
 }  // namespace web
 }  // namespace nc
@@ -5,30 +5,507 @@
 #include <unistd.h>
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <limits.h>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <netdb.h>
+#include <set>
 #include <string>
 #include <string.h>
 #include <thread>
 #include <vector>
 #include <deque>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <unordered_map>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+#if !defined(MSG_ZEROCOPY)
+#define MSG_ZEROCOPY 0
+#endif
+
 #include "ncode_common/src/common.h"
 #include "ncode_common/src/ptr_queue.h"
+#include "ring_queue.h"
 
 namespace nc {
 namespace web {
 
+// The mechanism a TCPServer uses to wait for socket events.
+enum class TCPServerBackend {
+  // Portable select()-based loop. Limited to FD_SETSIZE sockets and scans all
+  // of them on each wakeup.
+  kSelect,
+
+  // Edge-triggered epoll. Only available on Linux, per-wakeup cost scales with
+  // the number of ready sockets.
+  kEpoll,
+
+  // io_uring. Connections are accepted with a multishot accept and read with
+  // a multishot receive into buffers shared with the kernel, so that neither
+  // costs a syscall of its own; adding sockets and changing their events
+  // does not either, changes are submitted together with the next wait.
+  // Writes still use sendmsg. Needs a build with NCODE_WEB_HAVE_IO_URING and
+  // Linux 6.0 or later, with 5.13 only sockets are polled through io_uring,
+  // and it falls back to epoll on anything older.
+  kIoUring,
+};
+
+// What a TCPServer does with a connection whose incoming messages cannot be
+// accepted, either because they would exceed an ingest budget or because the
+// incoming queue is full.
+enum class IngestOverflowPolicy {
+  // Stop reading from the connection until the messages can be accepted. The
+  // client will eventually be held back by TCP flow control.
+  kPause,
+
+  // Discard the messages.
+  kDrop,
+
+  // Close the connection.
+  kClose,
+};
+
+// Parameters for a TCPServer.
+struct TCPServerConfig {
+  TCPServerConfig()
+      : backend(TCPServerBackend::kEpoll),
+        num_reactors(1),
+        max_outgoing_bytes_per_connection(1 << 26),
+        read_buffer_size(1 << 16),
+        max_message_size(1 << 26),
+        max_ingest_bytes_per_connection(1 << 26),
+        max_ingest_bytes(1 << 30),
+        ingest_overflow_policy(IngestOverflowPolicy::kPause),
+        busy_poll(false),
+        busy_poll_usec(50),
+        zerocopy_min_bytes(0) {}
+
+  // How the server waits for events. If the backend is not available on this
+  // platform the server will fall back to epoll, or to select() if epoll is
+  // not available either.
+  TCPServerBackend backend;
+
+  // Number of reactor threads. Each reactor has its own listening socket and
+  // serves a disjoint subset of connections. If more than one the listening
+  // sockets are bound with SO_REUSEPORT.
+  size_t num_reactors;
+
+  // Limit on the number of bytes queued for sending on a single connection. If
+  // a client does not read fast enough and more than this many bytes pile up
+  // the server will close the connection.
+  size_t max_outgoing_bytes_per_connection;
+
+  // Size of each connection's receive buffer. Incoming data is read in chunks
+  // of up to this size and all complete messages in a chunk are parsed at
+  // once.
+  size_t read_buffer_size;
+
+  // Largest message (header and payload) a client may send. A client that
+  // sends a header announcing a larger message is disconnected before
+  // anything is allocated for it.
+  size_t max_message_size;
+
+  // Limits on the bytes of incoming messages that the server holds on to,
+  // for a single connection and for all connections together. Messages are
+  // held while they are being read and while they cannot be added to the
+  // incoming queue because it is full. Once they are in the queue they no
+  // longer count. What happens when a limit is reached, and when the queue is
+  // full, is up to ingest_overflow_policy. A connection with nothing held
+  // may always take one message, even if it is larger than the per-connection
+  // limit.
+  size_t max_ingest_bytes_per_connection;
+  size_t max_ingest_bytes;
+  IngestOverflowPolicy ingest_overflow_policy;
+
+  // If true reactors never sleep, they poll for events with a zero timeout
+  // over and over. Costs a full CPU per reactor, but saves the wakeup latency
+  // of blocking. Accepted sockets get TCP_NODELAY, TCP_QUICKACK after every
+  // read, and SO_BUSY_POLL with busy_poll_usec, which makes the kernel spin on
+  // the device queue for that many microseconds when a read finds no data.
+  // Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN; if it
+  // cannot be set the server still busy-polls in userspace.
+  bool busy_poll;
+  int busy_poll_usec;
+
+  // CPUs to pin reactor threads to, reactor i runs on reactor_cpus[i modulo
+  // the number of CPUs]. If empty reactors are not pinned. Mostly useful with
+  // busy_poll, so that spinning reactors do not move around or share CPUs.
+  std::vector<int> reactor_cpus;
+
+  // Outgoing messages with a payload of at least this many bytes are sent
+  // with MSG_ZEROCOPY: the kernel transmits straight from the message instead
+  // of copying it into the socket's buffer, and the server holds on to the
+  // message until the kernel reports that it is done with it. Pinning pages
+  // and handling the notification costs more than copying a small payload,
+  // so this should be in the tens of kilobytes at least. Over loopback the
+  // kernel copies anyway. 0 disables zero-copy sends, as does a platform
+  // without SO_ZEROCOPY.
+  size_t zerocopy_min_bytes;
+};
+
+// A number of bytes shared among threads. Thread-safe.
+class ByteBudget {
+ public:
+  explicit ByteBudget(size_t limit) : limit_(limit), used_(0) {}
+
+  // Takes bytes out of the budget. Returns false, and takes nothing, if that
+  // would exceed the limit.
+  bool TryAcquire(size_t bytes) {
+    size_t used = used_.load(std::memory_order_relaxed);
+    do {
+      if (used + bytes > limit_) {
+        return false;
+      }
+    } while (!used_.compare_exchange_weak(used, used + bytes,
+                                          std::memory_order_relaxed));
+    return true;
+  }
+
+  // Returns bytes taken by TryAcquire.
+  void Release(size_t bytes) {
+    used_.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  size_t used() const { return used_.load(std::memory_order_relaxed); }
+
+  size_t limit() const { return limit_; }
+
+ private:
+  const size_t limit_;
+  std::atomic<size_t> used_;
+
+  DISALLOW_COPY_AND_ASSIGN(ByteBudget);
+};
+
+// A count updated by a single thread and read by any. Updates are a relaxed
+// load and store rather than an atomic increment, which costs the same as
+// incrementing a plain integer.
+class Counter {
+ public:
+  Counter() : value_(0) {}
+
+  void Add(uint64_t n) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_;
+
+  DISALLOW_COPY_AND_ASSIGN(Counter);
+};
+
+// A point in time copy of a Log2Histogram.
+struct HistogramSnapshot {
+  static constexpr size_t kBuckets = 65;
+
+  HistogramSnapshot() { buckets.fill(0); }
+
+  // Number of values added.
+  uint64_t count() const;
+
+  // Returns an upper bound for the value below which a fraction q of the
+  // values fall, or 0 if there are no values.
+  uint64_t Quantile(double q) const;
+
+  void Add(const HistogramSnapshot& other);
+
+  // Bucket 0 counts zeros, bucket i > 0 counts values in [2^(i-1), 2^i).
+  std::array<uint64_t, kBuckets> buckets;
+};
+
+// A histogram with power of two buckets, updated by a single thread and read
+// by any. Adding a value is a count-leading-zeros and a Counter update.
+class Log2Histogram {
+ public:
+  Log2Histogram() {}
+
+  void Add(uint64_t value) {
+    size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    buckets_[bucket].Add(1);
+  }
+
+  // Adds the counts in this histogram to out.
+  void AddTo(HistogramSnapshot* out) const {
+    for (size_t i = 0; i < HistogramSnapshot::kBuckets; ++i) {
+      out->buckets[i] += buckets_[i].value();
+    }
+  }
+
+ private:
+  std::array<Counter, HistogramSnapshot::kBuckets> buckets_;
+
+  DISALLOW_COPY_AND_ASSIGN(Log2Histogram);
+};
+
+// What happened on a connection, or on many connections added up.
+struct ConnectionStats {
+  ConnectionStats()
+      : bytes_in(0),
+        bytes_out(0),
+        frames_in(0),
+        frames_out(0),
+        reads(0),
+        read_would_block(0),
+        partial_reads(0),
+        writes(0),
+        write_would_block(0),
+        ingest_stalls(0),
+        frames_dropped(0) {}
+
+  void Add(const ConnectionStats& other);
+
+  // Bytes and complete frames (header and message) received and sent.
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t frames_in;
+  uint64_t frames_out;
+
+  // Calls to read() that returned data, and that found no data (EAGAIN).
+  uint64_t reads;
+  uint64_t read_would_block;
+
+  // Times the socket was drained with a frame only partially received.
+  uint64_t partial_reads;
+
+  // Calls to sendmsg() and sendfile(), and the ones that could not write
+  // everything because the socket's buffer was full.
+  uint64_t writes;
+  uint64_t write_would_block;
+
+  // Times incoming frames could not be accepted because the incoming queue
+  // was full or an ingest limit was reached, and frames dropped as a result.
+  // See IngestOverflowPolicy.
+  uint64_t ingest_stalls;
+  uint64_t frames_dropped;
+};
+
+// The live version of ConnectionStats, updated by the thread that serves the
+// connection.
+struct ConnectionCounters {
+  ConnectionCounters() {}
+
+  ConnectionStats Snapshot() const;
+
+  Counter bytes_in;
+  Counter bytes_out;
+  Counter frames_in;
+  Counter frames_out;
+  Counter reads;
+  Counter read_would_block;
+  Counter partial_reads;
+  Counter writes;
+  Counter write_would_block;
+  Counter ingest_stalls;
+  Counter frames_dropped;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ConnectionCounters);
+};
+
+// A snapshot of a TCPServer's metrics.
+struct TCPServerStats {
+  TCPServerStats()
+      : connections_accepted(0),
+        connections_closed(0),
+        messages_undeliverable(0),
+        outgoing_overflows(0) {}
+
+  // Totals for all connections, including closed ones.
+  ConnectionStats connections;
+
+  // Connection churn. The difference is the number of open connections.
+  uint64_t connections_accepted;
+  uint64_t connections_closed;
+
+  // Outgoing messages addressed to connections that no longer exist.
+  uint64_t messages_undeliverable;
+
+  // Connections closed because max_outgoing_bytes_per_connection was hit.
+  uint64_t outgoing_overflows;
+
+  // Sizes of incoming frames in bytes, including headers.
+  HistogramSnapshot frame_sizes;
+
+  // Time in microseconds from a reactor picking up an outgoing message to the
+  // message being completely written to its socket.
+  HistogramSnapshot outgoing_dwell_us;
+};
+
+// A socket that is ready for reading and/or writing. Errors and hangups are
+// reported as readable, so that they are picked up by the next read. Pollers
+// that accept connections or receive data themselves also report those.
+struct PollerEvent {
+  int fd;
+  bool readable;
+  bool writable;
+
+  // Set if fd is a connection the poller accepted on a listening socket, see
+  // Poller::Listen.
+  bool accepted;
+
+  // Bytes the poller received from fd, see Poller::ReceivesData. Valid until
+  // the next call to Wait.
+  const char* data;
+  size_t data_len;
+
+  // Set if no more data will be received from fd, because the peer closed
+  // the connection or there was an error.
+  bool receive_ended;
+};
+
+// Waits for sockets to become readable or writable. Implementations are
+// edge-triggered-safe: callers always consume all available data from a
+// socket (or fill it until it would block) before waiting again.
+class Poller {
+ public:
+  virtual ~Poller() {}
+
+  // Starts monitoring a socket. Returns false if the socket cannot be
+  // monitored.
+  virtual bool Add(int fd) = 0;
+
+  // Stops monitoring a socket. Should be called before the socket is closed.
+  virtual void Remove(int fd) = 0;
+
+  // Enables or disables reporting of a socket becoming writable. Only
+  // readability is reported after Add.
+  virtual void SetWriteInterest(int fd, bool enabled) = 0;
+
+  // Starts monitoring a listening socket. Pollers that AcceptsConnections
+  // report new connections as accepted events, and report the socket as
+  // readable only if they stopped accepting because of an error; the caller
+  // should then accept() itself and call Listen again once it would block.
+  // Others report the socket as readable.
+  virtual bool Listen(int fd) { return Add(fd); }
+  virtual bool AcceptsConnections() const { return false; }
+
+  // Pollers that ReceivesData read from sockets added with Add themselves and
+  // report the bytes in events; the sockets are reported as readable only for
+  // errors, which may leave error queues to be drained. Reception can be
+  // stopped and resumed with SetReadInterest to apply backpressure.
+  virtual bool ReceivesData() const { return false; }
+  virtual void SetReadInterest(int fd, bool enabled) {
+    Unused(fd);
+    Unused(enabled);
+  }
+
+  // Waits for up to timeout for at least one socket to become ready and
+  // populates events with all ready sockets. Returns false on error.
+  virtual bool Wait(std::chrono::milliseconds timeout,
+                    std::vector<PollerEvent>* events) = 0;
+
+  // Makes a concurrent call to Wait return, or the next one return
+  // immediately if there is no concurrent call. Can be called from any thread.
+  virtual void Wakeup() = 0;
+
+  // The backend this poller implements, which may not be the one asked for,
+  // see NewPoller.
+  virtual TCPServerBackend backend() const = 0;
+};
+
+// Returns a new poller for the given backend, or for a fallback if the backend
+// is not available.
+std::unique_ptr<Poller> NewPoller(TCPServerBackend backend);
+
 bool BlockingRawReadFromSocket(int sock, char* buf, uint32_t len);
 
+// Sets the options TCPServerConfig::busy_poll asks for on an accepted socket:
+// TCP_NODELAY, TCP_QUICKACK and SO_BUSY_POLL. Options not supported by the
+// platform are skipped.
+void SetLowLatencyOptions(int sock, int busy_poll_usec);
+
+// Sets TCP_QUICKACK, which the kernel clears again whenever it decides that
+// delaying acks is worthwhile, so it has to be set after each read.
+void SetQuickAck(int sock);
+
+// Pins the calling thread to a CPU. Returns false if that is not possible.
+bool PinCurrentThreadToCpu(int cpu);
+
+// A read-only view of a range of bytes in a reference counted buffer. Can be
+// used instead of std::vector<char> as the payload of a HeaderAndMessage, in
+// which case the server hands out payloads that point straight into its
+// receive buffers instead of copying them. Note that holding on to a slice
+// keeps the entire buffer it points into alive; consumers that keep messages
+// around for long should copy them with ToVector.
+class MessageSlice {
+ public:
+  MessageSlice() : data_(nullptr), size_(0) {}
+
+  MessageSlice(std::shared_ptr<const std::vector<char>> buffer, size_t offset,
+               size_t size)
+      : buffer_(std::move(buffer)),
+        data_(buffer_->data() + offset),
+        size_(size) {}
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const char* begin() const { return data_; }
+  const char* end() const { return data_ + size_; }
+  const char& operator[](size_t i) const { return data_[i]; }
+
+  // Returns a copy of the bytes.
+  std::vector<char> ToVector() const {
+    return std::vector<char>(begin(), end());
+  }
+
+ private:
+  // The buffer the slice points into.
+  std::shared_ptr<const std::vector<char>> buffer_;
+
+  const char* data_;
+  size_t size_;
+};
+
+// A file descriptor that is closed when the last reference to it goes away.
+// Messages that send parts of the same file can share one.
+class SharedFile {
+ public:
+  // Takes ownership of fd.
+  explicit SharedFile(int fd) : fd_(fd) {}
+  ~SharedFile() { close(fd_); }
+
+  int fd() const { return fd_; }
+
+ private:
+  int fd_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedFile);
+};
+
+// A range of bytes in a file.
+struct FileRegion {
+  FileRegion() : offset(0), length(0) {}
+  FileRegion(std::shared_ptr<const SharedFile> file, off_t offset,
+             size_t length)
+      : file(std::move(file)), offset(offset), length(length) {}
+
+  // Null for an empty region.
+  std::shared_ptr<const SharedFile> file;
+  off_t offset;
+  size_t length;
+};
+
 // The main datum that the server produces/consumes.
-template <typename HeaderType>
+template <typename HeaderType, typename PayloadType = std::vector<char>>
 struct HeaderAndMessage {
   HeaderAndMessage(uint64_t connection_id)
       : connection_id(connection_id), last_in_connection(false) {}
@@ -41,22 +518,140 @@ struct HeaderAndMessage {
   bool last_in_connection;
 
   HeaderType header;
-  std::vector<char> message;
+  PayloadType message;
+
+  // Only used when sending. The bytes of this region are sent right after the
+  // payload with sendfile(), without being copied through userspace. The
+  // receiver gets them as part of the payload, so the header should announce
+  // message.size() + file.length bytes. The file must not shrink before the
+  // message is sent.
+  FileRegion file;
+};
+
+// Number of size classes in a MessagePool. Size class i holds messages whose
+// payload capacity is in [kMinPooledMessageSize << i,
+// kMinPooledMessageSize << (i + 1)).
+static constexpr size_t kMessagePoolSizeClasses = 15;
+static constexpr size_t kMinPooledMessageSize = 64;
+
+// Returns the smallest size class whose messages can hold a payload of the
+// given size without reallocating, or kMessagePoolSizeClasses if the payload
+// is too large to be pooled.
+size_t SizeClassForMessageSize(size_t size);
+
+// Returns the size class a message with a payload of the given capacity
+// belongs to, or kMessagePoolSizeClasses if it should not be pooled.
+size_t SizeClassForMessageCapacity(size_t capacity);
+
+// A thread-safe free list of messages. Messages returned to the pool keep the
+// capacity of their payload, so that recycling them does not need to touch
+// the allocator. Each size class is protected by its own mutex and holds a
+// bounded number of messages.
+template <typename HeaderType>
+class MessagePool {
+ public:
+  static constexpr size_t kDefaultMaxBytesPerSizeClass = 1 << 24;
+
+  explicit MessagePool(
+      size_t max_bytes_per_size_class = kDefaultMaxBytesPerSizeClass) {
+    for (size_t i = 0; i < kMessagePoolSizeClasses; ++i) {
+      size_t message_size = kMinPooledMessageSize << i;
+      size_classes_[i].max_count =
+          std::max<size_t>(16, max_bytes_per_size_class / message_size);
+    }
+  }
+
+  // The pool used by TCPServer and ClientConnection. Messages received from
+  // them can be handed back here once consumed.
+  static MessagePool* Default() {
+    // Never destroyed, messages may be released during static destruction.
+    static MessagePool* pool = new MessagePool();
+    return pool;
+  }
+
+  // Returns a message with a payload of the given size. The contents of the
+  // header and payload are unspecified.
+  std::unique_ptr<HeaderAndMessage<HeaderType>> Acquire(uint64_t connection_id,
+                                                        size_t message_size) {
+    std::unique_ptr<HeaderAndMessage<HeaderType>> msg;
+    size_t size_class = SizeClassForMessageSize(message_size);
+    if (size_class != kMessagePoolSizeClasses) {
+      SizeClass& free_list = size_classes_[size_class];
+      std::lock_guard<std::mutex> lock(free_list.mu);
+      if (!free_list.messages.empty()) {
+        msg = std::move(free_list.messages.back());
+        free_list.messages.pop_back();
+      }
+    }
+
+    if (!msg) {
+      msg = make_unique<HeaderAndMessage<HeaderType>>(connection_id);
+      if (size_class != kMessagePoolSizeClasses) {
+        // Round up, so that the message goes back to the same class.
+        msg->message.reserve(kMinPooledMessageSize << size_class);
+      }
+    }
+
+    msg->connection_id = connection_id;
+    msg->message.resize(message_size);
+    return msg;
+  }
+
+  // Returns a message to the pool. If the message's size class is full the
+  // message is freed.
+  void Release(std::unique_ptr<HeaderAndMessage<HeaderType>> msg) {
+    size_t size_class = SizeClassForMessageCapacity(msg->message.capacity());
+    if (size_class == kMessagePoolSizeClasses) {
+      return;
+    }
+
+    msg->last_in_connection = false;
+    msg->message.clear();
+    msg->file = FileRegion();
+
+    SizeClass& free_list = size_classes_[size_class];
+    std::lock_guard<std::mutex> lock(free_list.mu);
+    if (free_list.messages.size() < free_list.max_count) {
+      free_list.messages.emplace_back(std::move(msg));
+    }
+  }
+
+  // Number of messages currently in the pool.
+  size_t size() {
+    size_t total = 0;
+    for (SizeClass& free_list : size_classes_) {
+      std::lock_guard<std::mutex> lock(free_list.mu);
+      total += free_list.messages.size();
+    }
+
+    return total;
+  }
+
+ private:
+  struct SizeClass {
+    std::mutex mu;
+    std::vector<std::unique_ptr<HeaderAndMessage<HeaderType>>> messages;
+    size_t max_count;
+  };
+
+  std::array<SizeClass, kMessagePoolSizeClasses> size_classes_;
+
+  DISALLOW_COPY_AND_ASSIGN(MessagePool);
 };
 
 template <typename HeaderType>
 std::unique_ptr<HeaderAndMessage<HeaderType>> BlockingReadMessageFromSocket(
     int socket) {
-  auto message_ptr = make_unique<HeaderAndMessage<HeaderType>>(socket);
-  HeaderType& header = message_ptr->header;
-
+  HeaderType header;
   char* header_ptr = reinterpret_cast<char*>(&header);
   if (!BlockingRawReadFromSocket(socket, header_ptr, sizeof(HeaderType))) {
     return {};
   }
 
   size_t message_len = HeaderType::MessageSize(header);
-  message_ptr->message.resize(message_len);
+  auto message_ptr =
+      MessagePool<HeaderType>::Default()->Acquire(socket, message_len);
+  message_ptr->header = header;
   std::vector<char>& message_v = message_ptr->message;
   if (!BlockingRawReadFromSocket(socket, message_v.data(), message_len)) {
     return {};
@@ -65,364 +660,2374 @@ std::unique_ptr<HeaderAndMessage<HeaderType>> BlockingReadMessageFromSocket(
   return message_ptr;
 }
 
+// Lock-free message queues. The single-producer single-consumer version is
+// suitable as the incoming queue of a server with one reactor and one
+// consumer thread. The multi-producer multi-consumer one can be used
+// anywhere.
+template <typename HeaderType, typename PayloadType = std::vector<char>>
+using SPSCMessageQueue =
+    SPSCPtrQueue<HeaderAndMessage<HeaderType, PayloadType>, 1024>;
+template <typename HeaderType, typename PayloadType = std::vector<char>>
+using MPMCMessageQueue =
+    MPMCPtrQueue<HeaderAndMessage<HeaderType, PayloadType>, 1024>;
+
+// The default queue. A reactor never blocks producing to it, see
+// InputChannel.
+template <typename HeaderType, typename PayloadType = std::vector<char>>
+using MessageQueue = MPMCMessageQueue<HeaderType, PayloadType>;
+
+// A queue that takes a lock for every operation. A reactor that finds it full
+// blocks until there is room, holding up all of its connections.
+template <typename HeaderType, typename PayloadType = std::vector<char>>
+using LockingMessageQueue =
+    PtrQueue<HeaderAndMessage<HeaderType, PayloadType>, 1024>;
+
+// Creates messages with a given type of payload. Used by InputChannel and
+// OutputChannel so that they do not have to care about how payloads are
+// stored. Messages with std::vector<char> payloads come from a MessagePool.
+template <typename HeaderType, typename PayloadType>
+struct PayloadAllocator;
+
 template <typename HeaderType>
-using MessageQueue = PtrQueue<HeaderAndMessage<HeaderType>, 1024>;
+struct PayloadAllocator<HeaderType, std::vector<char>> {
+  using MessageType = HeaderAndMessage<HeaderType, std::vector<char>>;
+
+  // Returns a message whose payload is a copy of len bytes at offset in the
+  // given buffer. If the payload refers to the buffer instead it holds on to
+  // what lease() returns, which keeps the buffer alive.
+  template <typename Lease>
+  static std::unique_ptr<MessageType> FromBuffer(
+      MessagePool<HeaderType>* pool, uint64_t connection_id,
+      const std::vector<char>& buffer, Lease, size_t offset, size_t len) {
+    std::unique_ptr<MessageType> msg = pool->Acquire(connection_id, len);
+    memcpy(msg->message.data(), buffer.data() + offset, len);
+    return msg;
+  }
+
+  // Returns a message with an uninitialized payload of len bytes. Sets payload
+  // to where the payload should be written.
+  static std::unique_ptr<MessageType> Uninitialized(
+      MessagePool<HeaderType>* pool, uint64_t connection_id, size_t len,
+      char** payload) {
+    std::unique_ptr<MessageType> msg = pool->Acquire(connection_id, len);
+    *payload = msg->message.data();
+    return msg;
+  }
+
+  // Disposes of a message that is no longer needed.
+  static void Release(MessagePool<HeaderType>* pool,
+                      std::unique_ptr<MessageType> msg) {
+    pool->Release(std::move(msg));
+  }
+};
 
 template <typename HeaderType>
+struct PayloadAllocator<HeaderType, MessageSlice> {
+  using MessageType = HeaderAndMessage<HeaderType, MessageSlice>;
+
+  template <typename Lease>
+  static std::unique_ptr<MessageType> FromBuffer(
+      MessagePool<HeaderType>*, uint64_t connection_id,
+      const std::vector<char>&, Lease lease, size_t offset, size_t len) {
+    auto msg = make_unique<MessageType>(connection_id);
+    msg->message = MessageSlice(lease(), offset, len);
+    return msg;
+  }
+
+  static std::unique_ptr<MessageType> Uninitialized(
+      MessagePool<HeaderType>*, uint64_t connection_id, size_t len,
+      char** payload) {
+    auto buffer = std::make_shared<std::vector<char>>(len);
+    *payload = buffer->data();
+
+    auto msg = make_unique<MessageType>(connection_id);
+    msg->message = MessageSlice(std::move(buffer), 0, len);
+    return msg;
+  }
+
+  // The payload's buffer is freed when the last slice pointing into it goes.
+  static void Release(MessagePool<HeaderType>*, std::unique_ptr<MessageType>) {}
+};
+
+
+// Reads messages from a non-blocking socket. Data is read from the socket in
+// large chunks into a receive buffer, from which all complete frames are
+// parsed at once, so that a burst of small messages costs one read() rather
+// than two per message. Payloads that do not fit in the buffer are read
+// directly into their message. If PayloadType is MessageSlice payloads are not
+// copied out of the receive buffer at all; once a buffer is referenced by a
+// slice it is never written to again and a new one is used. Messages are
+// handed to a QueueType, which should have the same interface as PtrQueue.
+// Reading never blocks on the queue if QueueType has TryProduceBatch, like
+// MessageQueue and the other lock-free queues do; with others, like
+// LockingMessageQueue, a full queue blocks the reader.
+template <typename HeaderType, typename PayloadType = std::vector<char>,
+          typename QueueType = MessageQueue<HeaderType, PayloadType>>
 class InputChannel {
  public:
-  InputChannel(int socket, MessageQueue<HeaderType>* incoming)
-      : offset_(0), socket_(socket), incoming_(incoming) {}
-
+  using MessageType = HeaderAndMessage<HeaderType, PayloadType>;
+  using Allocator = PayloadAllocator<HeaderType, PayloadType>;
+
+  // Messages will be tagged with connection_id. What the channel does is
+  // recorded in counters, and the size of each frame in frame_sizes. The
+  // buffer size and ingest limits come from config. If global_budget is not
+  // null bytes held by this channel are also taken out of it.
+  InputChannel(
+      int socket, uint64_t connection_id, QueueType* incoming,
+      ConnectionCounters* counters, Log2Histogram* frame_sizes,
+      const TCPServerConfig& config = TCPServerConfig(),
+      ByteBudget* global_budget = nullptr,
+      MessagePool<HeaderType>* pool = MessagePool<HeaderType>::Default())
+      : buffer_size_(std::max(config.read_buffer_size, sizeof(HeaderType))),
+        max_message_size_(config.max_message_size),
+        max_held_bytes_(config.max_ingest_bytes_per_connection),
+        overflow_policy_(config.ingest_overflow_policy),
+        buffer_start_(0),
+        buffer_end_(0),
+        message_ptr_(nullptr),
+        message_offset_(0),
+        held_bytes_(0),
+        skip_bytes_(0),
+        paused_(false),
+        receive_externally_(false),
+        receive_ended_(false),
+        socket_(socket),
+        connection_id_(connection_id),
+        incoming_(incoming),
+        counters_(counters),
+        frame_sizes_(frame_sizes),
+        global_budget_(global_budget),
+        pool_(pool) {}
+
+  ~InputChannel() { ReleaseBytes(held_bytes_); }
+
+  // Reads until the socket would block and hands complete messages to the
+  // queue. Returns false if the connection should be closed. If reading had
+  // to stop because messages could not be accepted and the overflow policy
+  // is kPause, paused() will be true, and this should be called again later
+  // even if the socket is not reported as readable. After ReceiveExternally
+  // only processes bytes that Receive could not take while paused.
   bool ReadFromSocket() {
-    const size_t header_len = sizeof(HeaderType);
+    if (!buffer_) {
+      // Allocated lazily, idle connections that never send anything do not
+      // need a buffer.
+      buffer_ = NewBuffer();
+    }
+
+    paused_ = false;
+    if (receive_externally_) {
+      std::vector<char> pending;
+      std::swap(pending, pending_);
+      if (!Consume(pending.data(), pending.size())) {
+        return false;
+      }
+
+      if (receive_ended_ && !paused_) {
+        LOG(INFO) << "Connection closed by peer";
+        return false;
+      }
+
+      return true;
+    }
 
     while (true) {
-      bool header_seen = offset_ >= header_len;
-      if (!header_seen) {
-        char* header_ptr = reinterpret_cast<char*>(&header_);
-
-        ssize_t bytes_read =
-            read(socket_, header_ptr + offset_, header_len - offset_);
-        if (bytes_read == -1 || bytes_read == 0) {
-          if (errno == EAGAIN) {
-            break;
-          }
+      if (!ParseFrames() || !ProduceReady()) {
+        return false;
+      }
 
-          LOG(ERROR) << "Unable to read / connection closed: "
-                     << strerror(errno);
-          return false;
-        }
+      if (paused_) {
+        return true;
+      }
 
-        offset_ += bytes_read;
-        if (offset_ < header_len) {
+      char* read_ptr;
+      size_t read_len;
+      NextWriteRange(&read_ptr, &read_len);
+      ssize_t bytes_read = read(socket_, read_ptr, read_len);
+      if (bytes_read <= 0) {
+        if (ReadWouldBlock(bytes_read)) {
+          counters_->read_would_block.Add(1);
           break;
         }
-      } else {
-        size_t message_len = HeaderType::MessageSize(header_);
-        if (message_len != 0) {
-          message_.resize(std::max(message_.size(), message_len));
-
-          size_t into_message = offset_ - header_len;
-          ssize_t bytes_read = read(socket_, message_.data() + into_message,
-                                    message_len - into_message);
-          if (bytes_read == -1 || bytes_read == 0) {
-            if (errno == EAGAIN) {
-              break;
-            }
 
-            LOG(ERROR) << "Unable to read / connection closed: "
-                       << strerror(errno);
-            return false;
-          }
+        return false;
+      }
 
-          offset_ += bytes_read;
-          if (offset_ < message_len + header_len) {
-            break;
-          }
-        }
+      counters_->reads.Add(1);
+      counters_->bytes_in.Add(bytes_read);
+      Written(bytes_read);
+      if (static_cast<size_t>(bytes_read) < read_len) {
+        // The socket has been drained. If more data arrives the poller will
+        // report the socket again, even in edge-triggered mode.
+        break;
+      }
+    }
 
-        auto header_and_message =
-            make_unique<HeaderAndMessage<HeaderType>>(socket_);
-        header_and_message->header = header_;
-        header_and_message->message = std::move(message_);
-        incoming_->ProduceOrBlock(std::move(header_and_message));
+    return Parsed();
+  }
 
-        offset_ = 0;
-      }
+  // From now on the channel does not read from the socket itself; whoever
+  // does, like a poller that receives data, hands the bytes to Receive, in
+  // order, and calls EndReceive when no more will come. Reading from the
+  // socket as well would reorder data. Should be called before the first
+  // read.
+  void ReceiveExternally() { receive_externally_ = true; }
+
+  // Takes bytes received from the socket and hands complete messages to the
+  // queue. Bytes that cannot be processed because the channel is paused are
+  // kept until ReadFromSocket is called again. Returns false if the
+  // connection should be closed.
+  bool Receive(const char* data, size_t len) {
+    counters_->reads.Add(1);
+    counters_->bytes_in.Add(len);
+    if (paused_ || !pending_.empty()) {
+      pending_.insert(pending_.end(), data, data + len);
+      return true;
     }
 
-    return true;
+    if (!buffer_) {
+      buffer_ = NewBuffer();
+    }
+
+    return Consume(data, len);
   }
 
+  // Called when no more bytes will be received, because the peer closed the
+  // connection or there was an error. ReadFromSocket will return false once
+  // everything received so far has been processed.
+  void EndReceive() { receive_ended_ = true; }
+
+  // True if the last call to ReadFromSocket stopped before draining the
+  // socket, see IngestOverflowPolicy::kPause.
+  bool paused() const { return paused_; }
+
  private:
-  // Stores the header.
-  HeaderType header_;
+  // A receive buffer. Messages with MessageSlice payloads refer to it through
+  // leases, shared pointers whose deleter counts down leases. The channel
+  // only writes to a buffer again once the count is 0. Reading the count with
+  // acquire semantics, paired with the release in the deleter, makes sure
+  // that consumers are done reading through their slices by then; the
+  // use_count of a shared_ptr does not guarantee that.
+  struct ReceiveBuffer {
+    explicit ReceiveBuffer(size_t size) : bytes(size), leases(0) {}
+
+    bool Unreferenced() const {
+      return leases.load(std::memory_order_acquire) == 0;
+    }
 
-  // Stores the message.
-  std::vector<char> message_;
+    std::vector<char> bytes;
+    std::atomic<size_t> leases;
+  };
+
+  // Returns where the next bytes from the socket should go: the rest of a
+  // message that does not fit in the buffer, or the end of the buffer.
+  void NextWriteRange(char** ptr, size_t* len) {
+    if (current_) {
+      // A message that does not fit in the buffer, the rest of it can go
+      // straight to its final location.
+      *ptr = message_ptr_ + message_offset_;
+      *len = current_->message.size() - message_offset_;
+    } else {
+      MakeRoom();
+      *ptr = buffer_->bytes.data() + buffer_end_;
+      *len = buffer_size_ - buffer_end_;
+    }
+  }
 
-  // A single offset into header + message.
-  size_t offset_;
+  // Records that len bytes were written to the range from NextWriteRange.
+  void Written(size_t len) {
+    if (current_) {
+      message_offset_ += len;
+      if (message_offset_ == current_->message.size()) {
+        FrameReceived(std::move(current_));
+      }
+    } else {
+      buffer_end_ += len;
+    }
+  }
 
-  // The socket.
-  int socket_;
+  // Processes bytes that have been received, as if they had been read from
+  // the socket. Keeps what cannot be processed because the channel paused in
+  // pending_. Returns false if the connection should be closed.
+  bool Consume(const char* data, size_t len) {
+    while (true) {
+      if (!ParseFrames() || !ProduceReady()) {
+        return false;
+      }
 
-  // Outgoing messages.
-  MessageQueue<HeaderType>* incoming_;
+      if (paused_) {
+        pending_.assign(data, data + len);
+        return true;
+      }
 
-  DISALLOW_COPY_AND_ASSIGN(InputChannel);
-};
+      if (len == 0) {
+        break;
+      }
 
-bool BlockingRawWriteToSocket(int sock, const char* buf, uint32_t len);
+      char* write_ptr;
+      size_t write_len;
+      NextWriteRange(&write_ptr, &write_len);
+      write_len = std::min(write_len, len);
+      memcpy(write_ptr, data, write_len);
+      Written(write_len);
+      data += write_len;
+      len -= write_len;
+    }
 
-template <typename HeaderType>
-bool BlockingWriteMessageToSocket(
-    std::unique_ptr<HeaderAndMessage<HeaderType>> msg) {
-  char* header_ptr = reinterpret_cast<char*>(&msg->header);
-  if (!BlockingRawWriteToSocket(msg->connection_id, header_ptr,
-                                sizeof(HeaderType))) {
+    return Parsed();
+  }
+
+  // Called once there is nothing more to read for now. Returns false if the
+  // connection should be closed.
+  bool Parsed() {
+    if (!ParseFrames() || !ProduceReady()) {
+      return false;
+    }
+
+    if (!paused_ && (current_ || buffer_end_ != buffer_start_)) {
+      counters_->partial_reads.Add(1);
+    }
+
+    return true;
+  }
+
+  // Interprets the return value of read(). Returns true if the socket has been
+  // drained and the caller should wait for more data. Returns false if the
+  // connection was closed or an error occurred. A return value of 0 always
+  // means the peer closed the connection; errno is not meaningful then and
+  // must not be consulted, or an edge-triggered poller will never report the
+  // socket again.
+  static bool ReadWouldBlock(ssize_t bytes_read) {
+    if (bytes_read == 0) {
+      LOG(INFO) << "Connection closed by peer";
+      return false;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return true;
+    }
+
+    LOG(ERROR) << "Unable to read: " << strerror(errno);
     return false;
   }
 
-  const std::vector<char>& message_v = msg->message;
-  const char* message_ptr = message_v.data();
-  if (!BlockingRawWriteToSocket(msg->connection_id, message_ptr,
-                                message_v.size())) {
+  static size_t MessageBytes(const MessageType& msg) {
+    return sizeof(HeaderType) + msg.message.size();
+  }
+
+  // Records a complete frame and readies it for the queue.
+  void FrameReceived(std::unique_ptr<MessageType> msg) {
+    counters_->frames_in.Add(1);
+    frame_sizes_->Add(MessageBytes(*msg));
+    ready_.emplace_back(std::move(msg));
+  }
+
+  // Counts bytes against the per-connection and global limits. Returns false
+  // if either would be exceeded.
+  bool AcquireBytes(size_t bytes) {
+    if (held_bytes_ != 0 && held_bytes_ + bytes > max_held_bytes_) {
+      return false;
+    }
+
+    if (global_budget_ != nullptr && !global_budget_->TryAcquire(bytes)) {
+      return false;
+    }
+
+    held_bytes_ += bytes;
+    return true;
+  }
+
+  void ReleaseBytes(size_t bytes) {
+    held_bytes_ -= bytes;
+    if (global_budget_ != nullptr) {
+      global_budget_->Release(bytes);
+    }
+  }
+
+  // Hands as many messages parsed so far to the incoming queue as it will
+  // take, in one batch. Applies the overflow policy to the rest. Returns false
+  // if the connection should be closed.
+  bool ProduceReady() {
+    if (ready_.empty()) {
+      return true;
+    }
+
+    size_t total_bytes = 0;
+    for (const auto& msg : ready_) {
+      total_bytes += MessageBytes(*msg);
+    }
+
+    TryProduceBatch(incoming_, &ready_);
+    size_t remaining_bytes = 0;
+    for (const auto& msg : ready_) {
+      remaining_bytes += MessageBytes(*msg);
+    }
+
+    ReleaseBytes(total_bytes - remaining_bytes);
+    if (ready_.empty()) {
+      return true;
+    }
+
+    counters_->ingest_stalls.Add(1);
+    switch (overflow_policy_) {
+      case IngestOverflowPolicy::kPause:
+        paused_ = true;
+        return true;
+      case IngestOverflowPolicy::kDrop:
+        counters_->frames_dropped.Add(ready_.size());
+        for (auto& msg : ready_) {
+          Allocator::Release(pool_, std::move(msg));
+        }
+
+        ready_.clear();
+        ReleaseBytes(remaining_bytes);
+        return true;
+      case IngestOverflowPolicy::kClose:
+        LOG(ERROR) << "Incoming queue full, closing " << connection_id_;
+        return false;
+    }
+
     return false;
   }
 
-  return true;
-}
+  // Parses as many frames as possible out of the buffer and adds complete
+  // messages to ready_. If a frame is too large to ever fit in the buffer
+  // starts reading it into current_. Returns false if the connection should
+  // be closed.
+  bool ParseFrames() {
+    const size_t header_len = sizeof(HeaderType);
 
-template <typename HeaderType>
-class ServerConnection {
- public:
-  ServerConnection(sockaddr_in address, int socket,
-                   MessageQueue<HeaderType>* incoming)
-      : address_(address), input_channel_(socket, incoming) {}
+    while (!current_ && !paused_) {
+      if (skip_bytes_ > 0) {
+        // The rest of a dropped frame.
+        size_t skipped = std::min(skip_bytes_, buffer_end_ - buffer_start_);
+        buffer_start_ += skipped;
+        skip_bytes_ -= skipped;
+        if (skip_bytes_ > 0) {
+          break;
+        }
+      }
+
+      size_t available = buffer_end_ - buffer_start_;
+      if (available < header_len) {
+        break;
+      }
+
+      HeaderType header;
+      memcpy(&header, buffer_->bytes.data() + buffer_start_, header_len);
+      size_t message_len = HeaderType::MessageSize(header);
+      if (message_len > max_message_size_ ||
+          header_len + message_len > max_message_size_) {
+        LOG(ERROR) << "Message of " << message_len << " bytes exceeds limit, "
+                   << "closing " << connection_id_;
+        return false;
+      }
+
+      bool fits_in_buffer = header_len + message_len <= buffer_size_;
+      if (fits_in_buffer && available < header_len + message_len) {
+        break;
+      }
+
+      if (!AcquireBytes(header_len + message_len)) {
+        counters_->ingest_stalls.Add(1);
+        switch (overflow_policy_) {
+          case IngestOverflowPolicy::kPause:
+            paused_ = true;
+            return true;
+          case IngestOverflowPolicy::kDrop:
+            counters_->frames_dropped.Add(1);
+            buffer_start_ += header_len;
+            skip_bytes_ = message_len;
+            continue;
+          case IngestOverflowPolicy::kClose:
+            LOG(ERROR) << "Ingest limit exceeded, closing " << connection_id_;
+            return false;
+        }
+      }
+
+      if (!fits_in_buffer) {
+        current_ = Allocator::Uninitialized(pool_, connection_id_, message_len,
+                                            &message_ptr_);
+        current_->header = header;
+        buffer_start_ += header_len;
+
+        message_offset_ = std::min(available - header_len, message_len);
+        memcpy(message_ptr_, buffer_->bytes.data() + buffer_start_,
+               message_offset_);
+        buffer_start_ += message_offset_;
+        break;
+      }
+
+      std::unique_ptr<MessageType> msg = Allocator::FromBuffer(
+          pool_, connection_id_, buffer_->bytes, [this] { return Lease(); },
+          buffer_start_ + header_len, message_len);
+      msg->header = header;
+      buffer_start_ += header_len + message_len;
+      FrameReceived(std::move(msg));
+    }
+
+    return true;
+  }
+
+  // Makes sure there is a reasonable amount of space at the end of the buffer
+  // by moving any partial frame to the start of the buffer, or to a new
+  // buffer if the current one is referenced by messages.
+  void MakeRoom() {
+    if (buffer_end_ - buffer_start_ == 0 && BufferUnreferenced()) {
+      buffer_start_ = 0;
+      buffer_end_ = 0;
+      return;
+    }
+
+    if (buffer_size_ - buffer_end_ >= buffer_size_ / 2) {
+      return;
+    }
+
+    size_t available = buffer_end_ - buffer_start_;
+    char* data = buffer_->bytes.data();
+    if (BufferUnreferenced()) {
+      memmove(data, data + buffer_start_, available);
+    } else {
+      std::shared_ptr<ReceiveBuffer> new_buffer = NewBuffer();
+      memcpy(new_buffer->bytes.data(), data + buffer_start_, available);
+      retired_buffers_.emplace_back(std::move(buffer_));
+      buffer_ = std::move(new_buffer);
+    }
+
+    buffer_start_ = 0;
+    buffer_end_ = available;
+  }
+
+  // Returns a shared reference to the current buffer, for slices to hold on
+  // to.
+  std::shared_ptr<const std::vector<char>> Lease() {
+    if (!lease_) {
+      std::shared_ptr<ReceiveBuffer> buffer = buffer_;
+      buffer->leases.fetch_add(1, std::memory_order_relaxed);
+      lease_ = std::shared_ptr<const std::vector<char>>(
+          &buffer->bytes, [buffer](const std::vector<char>*) {
+            buffer->leases.fetch_sub(1, std::memory_order_release);
+          });
+    }
+
+    return lease_;
+  }
+
+  // Returns true if no slices refer to the current buffer anymore, in which
+  // case it can be written to. Slices handed out later get a new lease.
+  bool BufferUnreferenced() {
+    if (lease_.use_count() > 1) {
+      // Still referenced, checked first so that the lease can be kept.
+      return false;
+    }
+
+    lease_.reset();
+    return buffer_->Unreferenced();
+  }
+
+  // Returns a buffer that is not referenced by any message, reusing a retired
+  // one if possible.
+  std::shared_ptr<ReceiveBuffer> NewBuffer() {
+    // The current buffer's lease goes with it.
+    lease_.reset();
+    for (auto it = retired_buffers_.begin(); it != retired_buffers_.end();
+         ++it) {
+      if ((*it)->Unreferenced()) {
+        std::shared_ptr<ReceiveBuffer> buffer = std::move(*it);
+        retired_buffers_.erase(it);
+        return buffer;
+      }
+    }
+
+    if (retired_buffers_.size() > kMaxRetiredBuffers) {
+      // Still referenced elsewhere, will be freed by whoever holds on to it.
+      retired_buffers_.erase(retired_buffers_.begin());
+    }
+
+    return std::make_shared<ReceiveBuffer>(buffer_size_);
+  }
+
+  // Number of buffers still referenced by slices that are remembered for
+  // reuse.
+  static constexpr size_t kMaxRetiredBuffers = 4;
+
+  // Size of the receive buffer.
+  const size_t buffer_size_;
+
+  // Limits, see TCPServerConfig.
+  const size_t max_message_size_;
+  const size_t max_held_bytes_;
+  const IngestOverflowPolicy overflow_policy_;
+
+  // Data read from the socket. Bytes in [buffer_start_, buffer_end_) have not
+  // been parsed yet.
+  std::shared_ptr<ReceiveBuffer> buffer_;
+  size_t buffer_start_;
+  size_t buffer_end_;
+
+  // The current buffer's lease, if slices have been handed out since it was
+  // last found unreferenced.
+  std::shared_ptr<const std::vector<char>> lease_;
+
+  // Buffers that were replaced while messages pointed into them.
+  std::vector<std::shared_ptr<ReceiveBuffer>> retired_buffers_;
+
+  // A message too large for the buffer that is still being read, if any.
+  std::unique_ptr<MessageType> current_;
+
+  // Where current_'s payload goes, and how much of it has been read.
+  char* message_ptr_;
+  size_t message_offset_;
+
+  // Complete messages not yet handed to the incoming queue. Messages parsed
+  // out of a single read are produced together.
+  std::vector<std::unique_ptr<MessageType>> ready_;
+
+  // Bytes of messages in ready_ and current_, counted against the limits.
+  size_t held_bytes_;
+
+  // Bytes of a dropped message still to be read and discarded.
+  size_t skip_bytes_;
+
+  // Set when reading stopped because messages could not be accepted.
+  bool paused_;
+
+  // Set by ReceiveExternally and EndReceive.
+  bool receive_externally_;
+  bool receive_ended_;
+
+  // Bytes handed to Receive while paused, in order.
+  std::vector<char> pending_;
+
+  // The socket.
+  int socket_;
+
+  // What messages are tagged with.
+  uint64_t connection_id_;
+
+  // Outgoing messages.
+  QueueType* incoming_;
+
+  // Where metrics are recorded.
+  ConnectionCounters* counters_;
+  Log2Histogram* frame_sizes_;
+
+  // Limit on bytes held by all channels, may be null.
+  ByteBudget* global_budget_;
+
+  // Where new messages come from.
+  MessagePool<HeaderType>* pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(InputChannel);
+};
+
+bool BlockingRawWriteToSocket(int sock, const char* buf, uint32_t len);
+
+// Writes out all buffers with as few writev calls as possible. Will modify the
+// iovecs to keep track of partial writes.
+bool BlockingRawWritevToSocket(int sock, iovec* iov, size_t iov_count);
+
+// Sends up to count bytes of a file, starting at offset, with sendfile() if
+// the platform has it. Returns the number of bytes sent, or -1 with errno set
+// the same way send() would set it. Returns 0 if the file ends at offset. A
+// peer that has gone away does not raise SIGPIPE.
+ssize_t SendFile(int sock, int fd, off_t offset, size_t count);
+
+// Sends all bytes of a file region to a blocking socket.
+bool BlockingSendFileRegion(int sock, const FileRegion& region);
+
+template <typename HeaderType>
+bool BlockingWriteMessageToSocket(
+    std::unique_ptr<HeaderAndMessage<HeaderType>> msg) {
+  std::vector<char>& message_v = msg->message;
+
+  // Header and message go out in a single syscall / TCP segment.
+  iovec iov[2];
+  iov[0].iov_base = &msg->header;
+  iov[0].iov_len = sizeof(HeaderType);
+  iov[1].iov_base = message_v.data();
+  iov[1].iov_len = message_v.size();
+  int sock = msg->connection_id;
+  bool written = BlockingRawWritevToSocket(sock, iov, 2) &&
+                 BlockingSendFileRegion(sock, msg->file);
+  MessagePool<HeaderType>::Default()->Release(std::move(msg));
+  return written;
+}
+
+// Turns on SO_ZEROCOPY, which sends with MSG_ZEROCOPY need. Returns false if
+// the platform does not support it.
+bool EnableZeroCopy(int sock);
+
+// Keeps track of which MSG_ZEROCOPY sends on a socket the kernel is done
+// with. The kernel numbers the sends that succeed from 0 and reports them
+// done in ranges, almost always in order. Ids are 32 bits and wrap around.
+class ZeroCopyTracker {
+ public:
+  ZeroCopyTracker() : next_id_(0), done_below_(0) {}
+
+  // Records a successful MSG_ZEROCOPY send and returns its id.
+  uint32_t Sent() { return next_id_++; }
+
+  // Records that the kernel is done with sends first to last, inclusive.
+  void Completed(uint32_t first, uint32_t last);
+
+  // True if the kernel is done with the given send and all sends before it.
+  bool Done(uint32_t id) const {
+    return static_cast<int32_t>(id - done_below_) < 0;
+  }
+
+  // True if there are sends that the kernel is not done with.
+  bool in_flight() const { return done_below_ != next_id_; }
+
+ private:
+  // Id of the next send.
+  uint32_t next_id_;
+
+  // All sends before this one are done.
+  uint32_t done_below_;
+
+  // Sends from done_below_ on that were reported done out of order.
+  std::set<uint32_t> done_out_of_order_;
+};
+
+// Reads zero-copy completion notifications off a socket's error queue and
+// passes them to the tracker. Returns false on error.
+bool ReadZeroCopyCompletions(int sock, ZeroCopyTracker* tracker);
+
+// Queues messages for a non-blocking socket and writes them out as the socket
+// becomes writable. Never blocks. Messages are returned to a MessagePool once
+// written, or once the kernel is done with them if they were sent with
+// MSG_ZEROCOPY.
+template <typename HeaderType, typename PayloadType = std::vector<char>>
+class OutputChannel {
+ public:
+  using MessageType = HeaderAndMessage<HeaderType, PayloadType>;
+
+  // What the channel does is recorded in counters, and how long each message
+  // was queued for, in microseconds, in dwell_us. Messages with payloads of at
+  // least zerocopy_min_bytes are sent with MSG_ZEROCOPY, if the socket
+  // supports it. 0 turns zero-copy sends off.
+  OutputChannel(
+      int socket, size_t max_queued_bytes, ConnectionCounters* counters,
+      Log2Histogram* dwell_us, size_t zerocopy_min_bytes = 0,
+      MessagePool<HeaderType>* pool = MessagePool<HeaderType>::Default())
+      : offset_(0),
+        queued_bytes_(0),
+        max_queued_bytes_(max_queued_bytes),
+        socket_(socket),
+        done_(false),
+        zerocopy_min_bytes_(0),
+        last_zerocopy_id_(0),
+        counters_(counters),
+        dwell_us_(dwell_us),
+        pool_(pool) {
+    if (zerocopy_min_bytes > 0 && EnableZeroCopy(socket)) {
+      zerocopy_min_bytes_ = zerocopy_min_bytes;
+    }
+  }
+
+  // Adds a message to the end of the queue. Returns false if the queue would
+  // grow beyond its limit, in which case the message is not queued. Only the
+  // header and payload count towards the limit, not the message's file region.
+  bool Enqueue(std::unique_ptr<MessageType> msg) {
+    size_t message_len = BufferedSize(*msg);
+    if (queued_bytes_ + message_len > max_queued_bytes_) {
+      return false;
+    }
+
+    queued_bytes_ += message_len;
+    queue_.emplace_back(std::move(msg));
+    enqueue_times_.emplace_back(std::chrono::steady_clock::now());
+    return true;
+  }
+
+  // Writes as much of the queue as the socket will take. Headers and messages
+  // of as many queued messages as possible are gathered into a single sendmsg
+  // call, file regions are sent on their own with sendfile. Returns false if
+  // the connection is broken.
+  bool WriteToSocket() {
+    if (!ReapCompletions()) {
+      return false;
+    }
+
+    bool allow_zerocopy = true;
+    while (!queue_.empty() && !done_) {
+      size_t total;
+      ssize_t bytes_written;
+      if (InFileRegion()) {
+        const FileRegion& region = queue_.front()->file;
+        size_t into_region = offset_ - BufferedSize(*queue_.front());
+        total = region.length - into_region;
+        bytes_written = SendFile(socket_, region.file->fd(),
+                                 region.offset + into_region, total);
+        if (bytes_written == 0) {
+          LOG(ERROR) << "File shorter than the region to send";
+          return false;
+        }
+      } else {
+        bool zerocopy = false;
+        total = GatherIovecs(allow_zerocopy, &zerocopy);
+
+        msghdr msg_header;
+        memset(&msg_header, 0, sizeof(msg_header));
+        msg_header.msg_iov = iovecs_.data();
+        msg_header.msg_iovlen = iovecs_.size();
+
+        int flags = zerocopy ? MSG_NOSIGNAL | MSG_ZEROCOPY : MSG_NOSIGNAL;
+        bytes_written = sendmsg(socket_, &msg_header, flags);
+        if (bytes_written < 0 && zerocopy && errno == ENOBUFS) {
+          // Too many notifications outstanding, the kernel will not pin any
+          // more pages for now.
+          allow_zerocopy = false;
+          continue;
+        }
+
+        if (bytes_written >= 0 && zerocopy) {
+          last_zerocopy_id_ = zerocopy_.Sent();
+        }
+      }
+
+      counters_->writes.Add(1);
+      if (bytes_written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          counters_->write_would_block.Add(1);
+          break;
+        }
+
+        LOG(ERROR) << "Unable to write: " << strerror(errno);
+        return false;
+      }
+
+      counters_->bytes_out.Add(bytes_written);
+      ConsumeBytes(bytes_written);
+      if (static_cast<size_t>(bytes_written) < total) {
+        // The socket's buffer is full.
+        counters_->write_would_block.Add(1);
+        break;
+      }
+    }
+
+    return true;
+  }
+
+  // Returns messages that were sent with MSG_ZEROCOPY to the pool once the
+  // kernel is done with them. Should be called when the socket reports an
+  // error, that is how the kernel signals that notifications are waiting.
+  // Returns false if the connection is broken.
+  bool ReapCompletions() {
+    if (!zerocopy_.in_flight()) {
+      return true;
+    }
+
+    if (!ReadZeroCopyCompletions(socket_, &zerocopy_)) {
+      return false;
+    }
+
+    while (!held_.empty() && zerocopy_.Done(held_.front().first)) {
+      Release(std::move(held_.front().second));
+      held_.pop_front();
+    }
+
+    return true;
+  }
+
+  // True if there are messages that have not been fully written out.
+  bool pending() const { return !queue_.empty(); }
+
+  // True if there are written messages that the kernel may still be sending
+  // from.
+  bool sends_in_flight() const { return !held_.empty(); }
+
+  // True if a message marked as last in its connection has been sent and the
+  // kernel is done with it. Nothing is written after such a message.
+  bool done() const { return done_ && held_.empty(); }
+
+ private:
+  // Bytes of a message that are kept in memory, which are sent before its
+  // file region.
+  static size_t BufferedSize(const MessageType& msg) {
+    return sizeof(HeaderType) + msg.message.size();
+  }
+
+  // True if the header and payload of the message at the front of the queue
+  // have been sent and what is left is its file region.
+  bool InFileRegion() const {
+    const MessageType& msg = *queue_.front();
+    return msg.file.length > 0 && offset_ >= BufferedSize(msg);
+  }
+
+  // Populates iovecs_ with the unsent parts of queued messages, up to
+  // IOV_MAX buffers and up to the first file region. Sets zerocopy if the
+  // buffers should be sent with MSG_ZEROCOPY, which is never the case if
+  // allow_zerocopy is false. Returns the total number of bytes.
+  size_t GatherIovecs(bool allow_zerocopy, bool* zerocopy) {
+    const size_t header_len = sizeof(HeaderType);
+    const size_t max_iovecs = IOV_MAX;
+
+    iovecs_.clear();
+    size_t total = 0;
+    size_t offset = offset_;
+    for (const auto& msg : queue_) {
+      if (iovecs_.size() + 2 > max_iovecs) {
+        break;
+      }
+
+      // sendmsg does not modify the buffers, the payload may be read-only.
+      char* message_ptr = const_cast<char*>(msg->message.data());
+      size_t message_len = msg->message.size();
+      if (offset < header_len) {
+        char* header_ptr = reinterpret_cast<char*>(&msg->header);
+        AddIovec(header_ptr + offset, header_len - offset, &total);
+        AddIovec(message_ptr, message_len, &total);
+      } else {
+        size_t into_message = offset - header_len;
+        AddIovec(message_ptr + into_message, message_len - into_message,
+                 &total);
+      }
+
+      if (allow_zerocopy && zerocopy_min_bytes_ > 0 &&
+          message_len >= zerocopy_min_bytes_) {
+        *zerocopy = true;
+      }
+
+      offset = 0;
+      if (msg->last_in_connection || msg->file.length > 0) {
+        // Nothing after this message will be sent, or not before its file
+        // region.
+        break;
+      }
+    }
+
+    return total;
+  }
+
+  void AddIovec(char* ptr, size_t len, size_t* total) {
+    if (len == 0) {
+      return;
+    }
+
+    iovec iov;
+    iov.iov_base = ptr;
+    iov.iov_len = len;
+    iovecs_.emplace_back(iov);
+    *total += len;
+  }
+
+  // Pops messages off the queue that have been fully written.
+  void ConsumeBytes(size_t bytes_written) {
+    using namespace std::chrono;
+
+    steady_clock::time_point now = steady_clock::now();
+    size_t remaining = offset_ + bytes_written;
+    while (!queue_.empty()) {
+      MessageType* msg = queue_.front().get();
+      size_t message_len = BufferedSize(*msg) + msg->file.length;
+      if (remaining < message_len) {
+        break;
+      }
+
+      remaining -= message_len;
+      done_ = msg->last_in_connection;
+      if (zerocopy_.in_flight()) {
+        // The message may have been part of a zero-copy send that the kernel
+        // is not done with.
+        held_.emplace_back(last_zerocopy_id_, std::move(queue_.front()));
+      } else {
+        Release(std::move(queue_.front()));
+      }
+      queue_.pop_front();
+
+      counters_->frames_out.Add(1);
+      dwell_us_->Add(
+          duration_cast<microseconds>(now - enqueue_times_.front()).count());
+      enqueue_times_.pop_front();
+      if (done_) {
+        break;
+      }
+    }
+
+    offset_ = remaining;
+  }
+
+  void Release(std::unique_ptr<MessageType> msg) {
+    queued_bytes_ -= BufferedSize(*msg);
+    PayloadAllocator<HeaderType, PayloadType>::Release(pool_, std::move(msg));
+  }
+
+  // Messages waiting to be sent.
+  std::deque<std::unique_ptr<MessageType>> queue_;
+
+  // When each message in queue_ was queued.
+  std::deque<std::chrono::steady_clock::time_point> enqueue_times_;
+
+  // Messages that have been written but may still be read by the kernel,
+  // with the id of the last zero-copy send made before they were written. If
+  // the channel is destroyed first they are freed rather than pooled, so
+  // that they are not reused straight away.
+  std::deque<std::pair<uint32_t, std::unique_ptr<MessageType>>> held_;
+
+  // How much of the message at the front of the queue has been sent. A single
+  // offset into header + message + file region.
+  size_t offset_;
+
+  // Total bytes (headers and messages) in the queue and in held_.
+  size_t queued_bytes_;
+
+  // Limit on queued_bytes_.
+  size_t max_queued_bytes_;
+
+  // The socket.
+  int socket_;
+
+  // Set after the last message in the connection is sent.
+  bool done_;
+
+  // Payloads of at least this size are sent with MSG_ZEROCOPY. 0 if zero-copy
+  // sends are off.
+  size_t zerocopy_min_bytes_;
+
+  // Zero-copy sends, and the id of the last one.
+  ZeroCopyTracker zerocopy_;
+  uint32_t last_zerocopy_id_;
+
+  // Where metrics are recorded.
+  ConnectionCounters* counters_;
+  Log2Histogram* dwell_us_;
+
+  // Scratch space for sendmsg, kept around to avoid allocating on every write.
+  std::vector<iovec> iovecs_;
+
+  // Where sent messages go.
+  MessagePool<HeaderType>* pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(OutputChannel);
+};
+
+template <typename HeaderType, typename PayloadType = std::vector<char>,
+          typename QueueType = MessageQueue<HeaderType, PayloadType>>
+class ServerConnection {
+ public:
+  using MessageType = HeaderAndMessage<HeaderType, PayloadType>;
+
+  // Incoming frame sizes and outgoing dwell times are recorded in
+  // frame_sizes and dwell_us, which may be shared with other connections
+  // served by the same thread.
+  ServerConnection(sockaddr_in address, int socket, uint64_t connection_id,
+                   QueueType* incoming, const TCPServerConfig& config,
+                   ByteBudget* ingest_budget, Log2Histogram* frame_sizes,
+                   Log2Histogram* dwell_us)
+      : address_(address),
+        connection_id_(connection_id),
+        input_channel_(socket, connection_id, incoming, &counters_,
+                       frame_sizes, config, ingest_budget),
+        output_channel_(socket, config.max_outgoing_bytes_per_connection,
+                        &counters_, dwell_us, config.zerocopy_min_bytes),
+        write_interest_(false) {}
+
+  bool Read() { return input_channel_.ReadFromSocket(); }
+
+  // True if the last Read stopped early and should be retried.
+  bool read_paused() const { return input_channel_.paused(); }
+
+  // For pollers that receive data themselves, see InputChannel.
+  void ReceiveExternally() { input_channel_.ReceiveExternally(); }
+  bool Receive(const char* data, size_t len) {
+    return input_channel_.Receive(data, len);
+  }
+  void EndReceive() { input_channel_.EndReceive(); }
+
+  uint64_t connection_id() const { return connection_id_; }
+
+  // Can be called from any thread, as long as the connection is not
+  // destroyed concurrently.
+  ConnectionStats Stats() const { return counters_.Snapshot(); }
+
+  bool Enqueue(std::unique_ptr<MessageType> msg) {
+    return output_channel_.Enqueue(std::move(msg));
+  }
+
+  bool Write() { return output_channel_.WriteToSocket(); }
+
+  // Frees messages the kernel is done sending with MSG_ZEROCOPY. Should be
+  // called whenever the socket is readable.
+  bool ReapCompletions() { return output_channel_.ReapCompletions(); }
+
+  // True if there is outgoing data that could not be written yet.
+  bool write_pending() const { return output_channel_.pending(); }
+
+  // True if there is outgoing data that the kernel may still be sending from
+  // the messages it came in.
+  bool sends_in_flight() const { return output_channel_.sends_in_flight(); }
+
+  // True if the connection should be closed because its last message has been
+  // written.
+  bool done() const { return output_channel_.done(); }
+
+  // Whether the reactor is waiting for the socket to become writable.
+  bool write_interest() const { return write_interest_; }
+  void set_write_interest(bool write_interest) {
+    write_interest_ = write_interest;
+  }
+
+ private:
+  sockaddr_in address_;
+  uint64_t connection_id_;
+  ConnectionCounters counters_;
+  InputChannel<HeaderType, PayloadType, QueueType> input_channel_;
+  OutputChannel<HeaderType, PayloadType> output_channel_;
+  bool write_interest_;
+};
+
+// Connection ids assigned by TCPServer combine the connection's socket with a
+// generation number that is incremented every time the socket is reused. A
+// message addressed to a connection that has been closed will not be delivered
+// to a newer connection that happens to get the same socket.
+inline uint64_t MakeConnectionId(int socket, uint32_t generation) {
+  return (static_cast<uint64_t>(generation) << 32) |
+         static_cast<uint32_t>(socket);
+}
+
+inline int ConnectionIdSocket(uint64_t connection_id) {
+  return static_cast<int>(connection_id & 0xffffffff);
+}
+
+inline uint32_t ConnectionIdGeneration(uint64_t connection_id) {
+  return static_cast<uint32_t>(connection_id >> 32);
+}
+
+// A table of per-connection values indexed by socket. Since sockets are small
+// integers handed out lowest first the table stays dense, and a lookup is a
+// bounds check and an array access. Each slot remembers the generation of the
+// connection it holds, so lookups by connection id fail for stale ids. Not
+// thread-safe.
+template <typename T>
+class ConnectionSlab {
+ public:
+  ConnectionSlab() : size_(0) {}
+
+  // Stores value for a new connection on socket, replacing any old one, and
+  // returns the new connection's id.
+  uint64_t Add(int socket, T value) {
+    Slot* slot = SlotFor(socket);
+    uint64_t connection_id = MakeConnectionId(socket, slot->generation + 1);
+    AddWithId(connection_id, std::move(value));
+    return connection_id;
+  }
+
+  // Stores value for a connection whose id was assigned elsewhere.
+  void AddWithId(uint64_t connection_id, T value) {
+    Slot* slot = SlotFor(ConnectionIdSocket(connection_id));
+    if (!slot->occupied) {
+      ++size_;
+    }
+
+    slot->generation = ConnectionIdGeneration(connection_id);
+    slot->occupied = true;
+    slot->value = std::move(value);
+  }
+
+  // Returns the value stored for a connection, or null if the connection is
+  // not in the table.
+  T* Find(uint64_t connection_id) {
+    T* value = FindBySocket(ConnectionIdSocket(connection_id));
+    if (value == nullptr) {
+      return nullptr;
+    }
+
+    const Slot& slot = slots_[ConnectionIdSocket(connection_id)];
+    if (slot.generation != ConnectionIdGeneration(connection_id)) {
+      return nullptr;
+    }
+
+    return value;
+  }
+
+  // Returns the value stored for the current connection on a socket, or null.
+  T* FindBySocket(int socket) {
+    if (socket < 0 || static_cast<size_t>(socket) >= slots_.size()) {
+      return nullptr;
+    }
+
+    Slot& slot = slots_[socket];
+    return slot.occupied ? &slot.value : nullptr;
+  }
+
+  // Removes the value stored for socket, if any. The slot's generation is
+  // kept, so the next connection on the socket gets a new id.
+  void Remove(int socket) {
+    if (FindBySocket(socket) == nullptr) {
+      return;
+    }
+
+    Slot& slot = slots_[socket];
+    slot.occupied = false;
+    slot.value = T();
+    --size_;
+  }
+
+  // Number of connections in the table.
+  size_t size() const { return size_; }
+
+  // Sockets of all connections in the table.
+  std::vector<int> Sockets() const {
+    std::vector<int> sockets;
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      if (slots_[i].occupied) {
+        sockets.emplace_back(i);
+      }
+    }
+
+    return sockets;
+  }
+
+ private:
+  struct Slot {
+    Slot() : generation(0), occupied(false), value() {}
+
+    uint32_t generation;
+    bool occupied;
+    T value;
+  };
+
+  Slot* SlotFor(int socket) {
+    CHECK(socket >= 0) << "Bad socket " << socket;
+    if (static_cast<size_t>(socket) >= slots_.size()) {
+      size_t min_size = static_cast<size_t>(socket) + 1;
+      slots_.resize(std::max(slots_.size() * 2, min_size));
+    }
+
+    return &slots_[socket];
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_;
+};
+
+// A server that reads and writes messages, each consisting of a fixed-size
+// HeaderType followed by a payload. If PayloadType is MessageSlice received
+// payloads point into the server's receive buffers instead of being copied.
+// Both incoming and outgoing messages go through queues of type
+// MessageQueueType, which can be any of MessageQueue, SPSCMessageQueue and
+// LockingMessageQueue. Note that reactors produce to the incoming queue(s), so
+// the SPSC queue is only suitable for incoming messages if there is one reactor
+// per queue, and for outgoing messages if there is one thread sending. With
+// LockingMessageQueue a reactor that finds the incoming queue full stops
+// serving all of its connections until there is room. The outgoing queue is
+// closed when the server stops.
+template <typename HeaderType, typename PayloadType = std::vector<char>,
+          typename MessageQueueType = MessageQueue<HeaderType, PayloadType>>
+class TCPServer {
+ public:
+  using MessageType = HeaderAndMessage<HeaderType, PayloadType>;
+  using QueueType = MessageQueueType;
+  using ConnectionType = ServerConnection<HeaderType, PayloadType, QueueType>;
+
+  TCPServer(uint32_t port, QueueType* incoming, QueueType* outgoing,
+            const TCPServerConfig& config = TCPServerConfig())
+      : TCPServer(port, std::vector<QueueType*>({incoming}), outgoing,
+                  config) {}
+
+  // Like above, but each reactor feeds messages to its own incoming queue.
+  // Reactor i will use queue i modulo the number of queues.
+  TCPServer(uint32_t port, const std::vector<QueueType*>& incoming,
+            QueueType* outgoing,
+            const TCPServerConfig& config = TCPServerConfig())
+      : config_(config),
+        port_(port),
+        to_kill_(false),
+        draining_(false),
+        routing_done_(false),
+        reactors_drained_(0),
+        ingest_budget_(config.max_ingest_bytes),
+        incoming_(incoming),
+        outgoing_(outgoing) {
+    CHECK(!incoming_.empty()) << "No incoming queues";
+    CHECK(config_.num_reactors > 0) << "Need at least one reactor";
+    CHECK(config_.max_message_size <= config_.max_ingest_bytes)
+        << "Ingest limit smaller than the largest message";
+  }
+
+  virtual ~TCPServer() { Stop(); }
+
+  // Starts the main loop.
+  void Start() {
+    bool reuse_port = config_.num_reactors > 1;
+    for (size_t i = 0; i < config_.num_reactors; ++i) {
+      QueueType* incoming = incoming_[i % incoming_.size()];
+      const std::vector<int>& cpus = config_.reactor_cpus;
+      int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+      auto reactor = make_unique<Reactor>(this, i, incoming, cpu);
+      reactor->OpenSocket(reuse_port);
+      reactors_.emplace_back(std::move(reactor));
+    }
+
+    for (const auto& reactor : reactors_) {
+      reactor->Start();
+    }
+    send_thread_ = std::thread([this] { WriteToSocket(); });
+  }
+
+  // Kills the server. Returns as soon as the threads have noticed, messages
+  // that have not been sent yet are dropped. Closes the outgoing queue.
+  void Stop() {
+    if (to_kill_) {
+      return;
+    }
+
+    LOG(INFO) << "Closing socket and terminating server.";
+    to_kill_ = true;
+    outgoing_->Close();
+    for (const auto& reactor : reactors_) {
+      reactor->Wakeup();
+    }
+
+    Join();
+    for (const auto& reactor : reactors_) {
+      reactor->CloseSocket();
+    }
+  }
+
+  // Stops the server gracefully: stops accepting connections, closes the
+  // outgoing queue, sends out all messages in it and waits for them to be
+  // written to their connections before closing the connections and stopping.
+  // Messages should be produced before calling this, later ones are rejected
+  // by the queue. Connections are still read from while draining. If
+  // everything has not been sent by deadline the server is stopped anyway.
+  // Returns true if everything was sent.
+  bool Drain(std::chrono::steady_clock::time_point deadline) {
+    if (to_kill_) {
+      return false;
+    }
+
+    LOG(INFO) << "Draining server.";
+    draining_ = true;
+    outgoing_->Close();
+    for (const auto& reactor : reactors_) {
+      reactor->Wakeup();
+    }
+
+    bool drained;
+    {
+      std::unique_lock<std::mutex> lock(drain_mu_);
+      drained = drain_cv_.wait_until(lock, deadline, [this] {
+        return reactors_drained_ == reactors_.size();
+      });
+    }
+
+    Stop();
+    return drained;
+  }
+
+  // Hands messages straight to the reactors that own their connections,
+  // bypassing the outgoing queue and the thread that routes messages from it.
+  // Messages for connections that no longer exist are dropped. Messages for
+  // the same connection are sent in the order they are given in, but there is
+  // no ordering with respect to messages in the outgoing queue. Clears msgs.
+  // Can be called from any thread while the server is running.
+  void SendDirect(std::vector<std::unique_ptr<MessageType>>* msgs) {
+    // Route leaves it empty, so servers can share it.
+    static thread_local RoutedMessages routed;
+    Route(msgs, &routed);
+  }
+
+  // Returns a snapshot of the server's metrics. Can be called from any thread
+  // while the server is running, and is cheap enough to be called
+  // periodically.
+  TCPServerStats GetStats() {
+    TCPServerStats stats;
+    stats.messages_undeliverable = messages_undeliverable_.value();
+    for (const auto& reactor : reactors_) {
+      reactor->AddStats(&stats);
+    }
+
+    return stats;
+  }
+
+  // Returns a snapshot of the metrics of each open connection, by connection
+  // id. Can be called from any thread while the server is running.
+  std::map<uint64_t, ConnectionStats> GetConnectionStats() {
+    std::map<uint64_t, ConnectionStats> out;
+    for (const auto& reactor : reactors_) {
+      reactor->AddConnectionStats(&out);
+    }
+
+    return out;
+  }
+
+  void Join() {
+    for (const auto& reactor : reactors_) {
+      reactor->Join();
+    }
+
+    if (send_thread_.joinable()) {
+      send_thread_.join();
+    }
+  }
+
+ private:
+  // Owns a listening socket, a poller and a disjoint subset of the server's
+  // connections. Each reactor runs on its own thread. When there is more than
+  // one reactor all listening sockets are bound to the same port with
+  // SO_REUSEPORT and the kernel spreads new connections among them.
+  class Reactor {
+   public:
+    // The reactor's thread is pinned to cpu, unless it is negative. index is
+    // the reactor's position in the server's reactors_.
+    Reactor(TCPServer* server, size_t index, QueueType* incoming, int cpu)
+        : server_(server),
+          incoming_(incoming),
+          index_(index),
+          cpu_(cpu),
+          tcp_socket_(-1),
+          accept_paused_(false),
+          connections_accepted_(0),
+          connections_closed_(0) {}
+
+    // Opens the socket for listening.
+    void OpenSocket(bool reuse_port) {
+      sockaddr_in address;
+      memset(reinterpret_cast<char*>(&address), 0, sizeof(address));
+
+      if ((tcp_socket_ = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        LOG(FATAL) << "Unable to get socket";
+      }
+
+      address.sin_family = AF_INET;
+      address.sin_port = htons(server_->port_);
+      address.sin_addr.s_addr = INADDR_ANY;
+
+      int yes = 1;
+      if (setsockopt(tcp_socket_, SOL_SOCKET, SO_REUSEADDR, &yes,
+                     sizeof(int)) == -1) {
+        LOG(FATAL) << "Unable to set REUSEADDR";
+      }
+
+      if (reuse_port && setsockopt(tcp_socket_, SOL_SOCKET, SO_REUSEPORT, &yes,
+                                   sizeof(int)) == -1) {
+        LOG(FATAL) << "Unable to set REUSEPORT";
+      }
+
+      if (bind(tcp_socket_, reinterpret_cast<sockaddr*>(&address),
+               sizeof(sockaddr)) == -1) {
+        LOG(FATAL) << "Unable to bind: " + std::string(strerror(errno));
+      }
+
+      if (listen(tcp_socket_, SOMAXCONN) == -1) {
+        LOG(FATAL) << "Unable to listen";
+      }
+
+      // Set to non-blocking
+      fcntl(tcp_socket_, F_SETFL, O_NONBLOCK);
+    }
+
+    void CloseSocket() {
+      if (tcp_socket_ != -1) {
+        close(tcp_socket_);
+      }
+    }
+
+    // Makes the reactor's thread look at the server's state. Can be called
+    // from any thread.
+    void Wakeup() { poller_->Wakeup(); }
+
+    void Start() {
+      poller_ = NewPoller(server_->config_.backend);
+      if (!poller_->Listen(tcp_socket_)) {
+        LOG(FATAL) << "Unable to poll listening socket";
+      }
+
+      thread_ = std::thread([this] { Loop(); });
+    }
+
+    void Join() {
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+    }
+
+    // Adds the metrics of this reactor and its connections, open and closed,
+    // to stats. Can be called from any thread.
+    void AddStats(TCPServerStats* stats) {
+      std::lock_guard<std::mutex> lock(connections_mu_);
+      stats->connections.Add(closed_stats_);
+      for (int socket : connections_.Sockets()) {
+        stats->connections.Add(FindConnectionBySocket(socket)->Stats());
+      }
+
+      stats->connections_accepted += connections_accepted_;
+      stats->connections_closed += connections_closed_;
+      stats->messages_undeliverable += messages_undeliverable_.value();
+      stats->outgoing_overflows += outgoing_overflows_.value();
+      frame_sizes_.AddTo(&stats->frame_sizes);
+      outgoing_dwell_us_.AddTo(&stats->outgoing_dwell_us);
+    }
+
+    // Adds the metrics of each open connection to out. Can be called from any
+    // thread.
+    void AddConnectionStats(std::map<uint64_t, ConnectionStats>* out) {
+      std::lock_guard<std::mutex> lock(connections_mu_);
+      for (int socket : connections_.Sockets()) {
+        ConnectionType* connection = FindConnectionBySocket(socket);
+        (*out)[connection->connection_id()] = connection->Stats();
+      }
+    }
+
+    size_t index() const { return index_; }
+
+    // Hands a batch of messages to the reactor, which will queue them on their
+    // connections and write them out when the sockets are writable. Clears
+    // msgs. Can be called from any thread.
+    void Send(std::vector<std::unique_ptr<MessageType>>* msgs) {
+      bool was_empty;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        was_empty = to_send_.empty();
+        for (std::unique_ptr<MessageType>& msg : *msgs) {
+          to_send_.emplace_back(std::move(msg));
+        }
+      }
+
+      msgs->clear();
+
+      // If there were messages already the reactor has been woken up.
+      if (was_empty) {
+        poller_->Wakeup();
+      }
+    }
+
+   private:
+    // Called when a new TCP connection is established with the server.
+    // Accepts the connection and populates new_socket with  the new socket.
+    // Will also set try_again to true if EWOULDBLOCK is returned by accept.
+    void NewTcpConnection(int* new_socket, bool* try_again) {
+      sockaddr_in remote_address;
+      socklen_t address_len = sizeof(remote_address);
+
+      *try_again = false;
+      int socket;
+      while ((socket = accept(
+                  tcp_socket_,
+                  reinterpret_cast<struct sockaddr*>(&remote_address),
+                  &address_len)) == -1) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+          // Interrupted, or the client went away before the connection was
+          // accepted. There may be more connections behind it.
+          address_len = sizeof(remote_address);
+          continue;
+        }
+
+        *try_again = true;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return;
+        }
+
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+            errno == ENOMEM) {
+          // Out of descriptors or memory. Connections are left in the backlog
+          // until some are freed up, see RetryAccept.
+          LOG(ERROR) << "Unable to accept: " << strerror(errno)
+                     << ", retrying in " << kAcceptRetryIntervalMs << "ms";
+          accept_paused_ = true;
+          accept_retry_time_ =
+              std::chrono::steady_clock::now() +
+              std::chrono::milliseconds(kAcceptRetryIntervalMs);
+          return;
+        }
+
+        LOG(FATAL) << "Unable to accept: " << strerror(errno);
+      }
+
+      *new_socket = socket;
+      AddConnection(socket, remote_address);
+    }
+
+    // Sets up a connection accepted on the listening socket, by accept or by
+    // the poller, and starts polling it.
+    void AddConnection(int socket, const sockaddr_in& remote_address) {
+      fcntl(socket, F_SETFL, O_NONBLOCK);
+      if (server_->config_.busy_poll) {
+        SetLowLatencyOptions(socket, server_->config_.busy_poll_usec);
+      }
+
+      uint64_t connection_id = server_->AddOwner(socket, this);
+      auto connection = make_unique<ConnectionType>(
+          remote_address, socket, connection_id, incoming_, server_->config_,
+          &server_->ingest_budget_, &frame_sizes_, &outgoing_dwell_us_);
+      if (poller_->ReceivesData()) {
+        connection->ReceiveExternally();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(connections_mu_);
+        connections_.AddWithId(connection_id, std::move(connection));
+        ++connections_accepted_;
+      }
+
+      if (!poller_->Add(socket)) {
+        CloseConnection(socket);
+      }
+    }
+
+    // Accepts all pending connections. The listening socket may be polled in
+    // edge-triggered mode, so this keeps going until accept would block.
+    void AcceptConnections() {
+      while (true) {
+        int new_socket;
+        bool try_again;
+
+        NewTcpConnection(&new_socket, &try_again);
+        if (try_again) {
+          if (!accept_paused_ && poller_->AcceptsConnections()) {
+            // The backlog is empty, the poller can take over again.
+            poller_->Listen(tcp_socket_);
+          }
+          return;
+        }
+      }
+    }
+
+    // Accepts connections left in the backlog when accepting ran out of
+    // resources, once it is time to try again. An edge-triggered poller will
+    // not report them again.
+    void RetryAccept() {
+      if (!accept_paused_ || tcp_socket_ == -1 ||
+          std::chrono::steady_clock::now() < accept_retry_time_) {
+        return;
+      }
+
+      accept_paused_ = false;
+      AcceptConnections();
+    }
+
+    // Forgets about a connection and closes its socket. The socket is only
+    // closed once nothing refers to it, as it may be reused right away.
+    void CloseConnection(int socket) {
+      poller_->Remove(socket);
+      {
+        std::lock_guard<std::mutex> lock(connections_mu_);
+        ConnectionType* connection = FindConnectionBySocket(socket);
+        if (connection != nullptr) {
+          closed_stats_.Add(connection->Stats());
+          ++connections_closed_;
+        }
+
+        connections_.Remove(socket);
+      }
+
+      server_->RemoveOwner(socket);
+      close(socket);
+    }
+
+    // Returns the connection with the given id, or null if it is closed.
+    ConnectionType* FindConnection(uint64_t connection_id) {
+      std::unique_ptr<ConnectionType>* connection =
+          connections_.Find(connection_id);
+      return connection == nullptr ? nullptr : connection->get();
+    }
+
+    // Returns the connection on a socket, or null.
+    ConnectionType* FindConnectionBySocket(int socket) {
+      std::unique_ptr<ConnectionType>* connection =
+          connections_.FindBySocket(socket);
+      return connection == nullptr ? nullptr : connection->get();
+    }
+
+    // Writes out as much of a connection's outgoing queue as the socket will
+    // take and waits for writability if anything is left. Closes the
+    // connection on error or once its last message has been written.
+    void Flush(int socket, ConnectionType* connection) {
+      if (!connection->Write()) {
+        LOG(INFO) << "Error in connection";
+        CloseConnection(socket);
+        return;
+      }
+
+      if (connection->done()) {
+        CloseConnection(socket);
+        return;
+      }
+
+      bool write_pending = connection->write_pending();
+      if (write_pending != connection->write_interest()) {
+        poller_->SetWriteInterest(socket, write_pending);
+        connection->set_write_interest(write_pending);
+      }
+    }
+
+    // Queues messages handed to the reactor by Send on their connections.
+    void ProcessOutgoing() {
+      std::vector<std::unique_ptr<MessageType>> to_send;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::swap(to_send, to_send_);
+      }
+
+      std::vector<uint64_t> connections_to_flush;
+      for (auto& msg : to_send) {
+        uint64_t connection_id = msg->connection_id;
+        ConnectionType* connection = FindConnection(connection_id);
+        if (connection == nullptr) {
+          LOG(INFO) << "Dropping message for missing connection "
+                    << connection_id;
+          messages_undeliverable_.Add(1);
+          continue;
+        }
+
+        if (!connection->Enqueue(std::move(msg))) {
+          LOG(ERROR) << "Outgoing queue limit exceeded, closing "
+                     << connection_id;
+          outgoing_overflows_.Add(1);
+          CloseConnection(ConnectionIdSocket(connection_id));
+          continue;
+        }
+
+        connections_to_flush.emplace_back(connection_id);
+      }
+
+      for (uint64_t connection_id : connections_to_flush) {
+        // May have been closed while processing a later message, or flushed
+        // already if it appears more than once.
+        ConnectionType* connection = FindConnection(connection_id);
+        if (connection != nullptr && !connection->write_interest()) {
+          Flush(ConnectionIdSocket(connection_id), connection);
+        }
+      }
+    }
+
+    // Reads from a connection, closing it on error.
+    void Read(int socket, ConnectionType* connection) {
+      bool was_paused = connection->read_paused();
+      if (!connection->ReapCompletions() || !connection->Read()) {
+        LOG(INFO) << "Error in connection";
+        CloseConnection(socket);
+        return;
+      }
+
+      if (connection->done()) {
+        // The kernel is done with the connection's last message.
+        CloseConnection(socket);
+        return;
+      }
+
+      ReadPausedChanged(socket, connection, was_paused);
+      if (server_->config_.busy_poll) {
+        SetQuickAck(socket);
+      }
+    }
+
+    // Hands data the poller received to a connection, closing it on error.
+    void Receive(int socket, ConnectionType* connection,
+                 const PollerEvent& event) {
+      bool was_paused = connection->read_paused();
+      if (event.data_len != 0 &&
+          !connection->Receive(event.data, event.data_len)) {
+        LOG(INFO) << "Error in connection";
+        CloseConnection(socket);
+        return;
+      }
+
+      ReadPausedChanged(socket, connection, was_paused);
+      if (event.receive_ended) {
+        // The connection is closed once everything received has been
+        // processed, by ResumePaused if it is paused.
+        connection->EndReceive();
+        if (!connection->read_paused()) {
+          Read(socket, connection);
+        }
+      }
+    }
+
+    // Keeps track of connections whose reading was paused, and stops the
+    // poller from receiving more data for them until they are resumed.
+    void ReadPausedChanged(int socket, ConnectionType* connection,
+                           bool was_paused) {
+      bool paused = connection->read_paused();
+      if (paused == was_paused) {
+        return;
+      }
+
+      poller_->SetReadInterest(socket, !paused);
+      if (paused) {
+        paused_connections_.emplace_back(connection->connection_id());
+      }
+    }
+
+    // Retries reading from connections that were paused. There will be no
+    // event for them, as they have not been drained.
+    void ResumePaused() {
+      std::vector<uint64_t> paused;
+      std::swap(paused, paused_connections_);
+      for (uint64_t connection_id : paused) {
+        ConnectionType* connection = FindConnection(connection_id);
+        if (connection == nullptr || !connection->read_paused()) {
+          // Closed, or resumed by an event.
+          continue;
+        }
+
+        if (!connection->Read()) {
+          LOG(INFO) << "Error in connection";
+          CloseConnection(ConnectionIdSocket(connection_id));
+          continue;
+        }
+
+        if (connection->read_paused()) {
+          paused_connections_.emplace_back(connection_id);
+        } else {
+          poller_->SetReadInterest(ConnectionIdSocket(connection_id), true);
+        }
+      }
+    }
+
+    // Runs the main reactor loop. Will block.
+    void Loop() {
+      if (cpu_ >= 0 && !PinCurrentThreadToCpu(cpu_)) {
+        LOG(ERROR) << "Unable to pin reactor to CPU " << cpu_ << ": "
+                   << strerror(errno);
+      }
+
+      std::vector<PollerEvent> events;
+      while (!server_->to_kill_) {
+        if (server_->draining_ && Drained()) {
+          break;
+        }
+
+        // Paused connections are retried often, they are waiting for room in
+        // the incoming queue or the ingest budget, which comes without an
+        // event.
+        std::chrono::milliseconds timeout(
+            paused_connections_.empty() ? 1000 : kPausedRetryIntervalMs);
+        if (accept_paused_) {
+          timeout = std::min(timeout, std::chrono::milliseconds(
+                                          kAcceptRetryIntervalMs));
+        }
+        if (server_->config_.busy_poll) {
+          timeout = std::chrono::milliseconds::zero();
+        }
+
+        if (!poller_->Wait(timeout, &events)) {
+          LOG(FATAL) << "Unable to wait for events: " << strerror(errno);
+        }
+
+        ProcessOutgoing();
+        ResumePaused();
+        RetryAccept();
+
+        // New connections are only set up once all other events have been
+        // handled. A socket closed by one of them could otherwise be reused
+        // right away, and data the poller received for the old connection
+        // handed to the new one.
+        bool accept_ready = false;
+        for (const PollerEvent& event : events) {
+          int socket = event.fd;
+          if (event.accepted) {
+            accepted_.emplace_back(socket);
+            continue;
+          }
+
+          if (socket == tcp_socket_) {
+            accept_ready = true;
+            continue;
+          }
+
+          ConnectionType* connection = FindConnectionBySocket(socket);
+          if (connection == nullptr) {
+            LOG(INFO) << "Missing connection for socket " << socket;
+            continue;
+          }
+
+          if (event.data_len != 0 || event.receive_ended) {
+            Receive(socket, connection, event);
+            connection = FindConnectionBySocket(socket);
+            if (connection == nullptr) {
+              continue;
+            }
+          }
+
+          if (event.writable) {
+            Flush(socket, connection);
+            connection = FindConnectionBySocket(socket);
+            if (connection == nullptr) {
+              continue;
+            }
+          }
+
+          if (event.readable) {
+            Read(socket, connection);
+          }
+        }
+
+        // The poller does not know the remote address.
+        sockaddr_in remote_address;
+        memset(&remote_address, 0, sizeof(remote_address));
+        for (int socket : accepted_) {
+          AddConnection(socket, remote_address);
+        }
+
+        accepted_.clear();
+        if (accept_ready && !accept_paused_) {
+          AcceptConnections();
+        }
+      }
+
+      for (int socket : connections_.Sockets()) {
+        CloseConnection(socket);
+      }
+
+      // Some pollers keep a reference to monitored sockets, the listening
+      // socket would stay open after CloseSocket otherwise.
+      if (tcp_socket_ != -1) {
+        poller_->Remove(tcp_socket_);
+      }
+
+      std::lock_guard<std::mutex> lock(server_->drain_mu_);
+      ++server_->reactors_drained_;
+      server_->drain_cv_.notify_all();
+    }
+
+    // Called by the loop while the server is draining. Stops listening and
+    // returns true once nothing more will be sent through this reactor and
+    // all its connections' outgoing messages have been written.
+    bool Drained() {
+      if (tcp_socket_ != -1) {
+        // Removed from the poller on this thread, see the end of Loop.
+        poller_->Remove(tcp_socket_);
+        close(tcp_socket_);
+        tcp_socket_ = -1;
+      }
+
+      if (!server_->routing_done_) {
+        return false;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (!to_send_.empty()) {
+          return false;
+        }
+      }
+
+      for (int socket : connections_.Sockets()) {
+        ConnectionType* connection = FindConnectionBySocket(socket);
+        if (connection->write_pending() || connection->sends_in_flight()) {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    // The server this reactor belongs to.
+    TCPServer* server_;
+
+    // Where messages from this reactor's connections go.
+    QueueType* incoming_;
+
+    // Connections owned by this reactor. Only changed with connections_mu_
+    // held, so that other threads can collect metrics.
+    ConnectionSlab<std::unique_ptr<ConnectionType>> connections_;
+
+    // Connections whose reading was paused, possibly with duplicates and ids
+    // of connections that have been closed or resumed since.
+    std::vector<uint64_t> paused_connections_;
+
+    // Waits for events on the listening socket and all active connections.
+    std::unique_ptr<Poller> poller_;
+
+    // Position in the server's reactors_.
+    const size_t index_;
+
+    // CPU to pin the thread to, negative if none.
+    const int cpu_;
+
+    // The socket this reactor listens on.
+    int tcp_socket_;
+
+    // Set when accepting failed for lack of resources, no connections are
+    // accepted until accept_retry_time_.
+    bool accept_paused_;
+    std::chrono::steady_clock::time_point accept_retry_time_;
+
+    // Connections the poller accepted, scratch space for the loop.
+    std::vector<int> accepted_;
+
+    // The reactor's thread.
+    std::thread thread_;
+
+    // Messages handed over by Send, not yet queued on their connections.
+    std::vector<std::unique_ptr<MessageType>> to_send_;
+
+    // Protects to_send_.
+    std::mutex mu_;
+
+    // Metrics, updated by the reactor's thread. The histograms are shared by
+    // all connections.
+    Log2Histogram frame_sizes_;
+    Log2Histogram outgoing_dwell_us_;
+    Counter messages_undeliverable_;
+    Counter outgoing_overflows_;
+
+    // Metrics of connections that have been closed, and connection churn.
+    ConnectionStats closed_stats_;
+    uint64_t connections_accepted_;
+    uint64_t connections_closed_;
+
+    // Protects changes to connections_, and closed_stats_,
+    // connections_accepted_ and connections_closed_.
+    std::mutex connections_mu_;
+
+    DISALLOW_COPY_AND_ASSIGN(Reactor);
+  };
+
+  // Records that reactor owns a new connection on socket and returns the
+  // connection's id.
+  uint64_t AddOwner(int socket, Reactor* reactor) {
+    std::lock_guard<std::mutex> lock(mu_);
+    return connection_owners_.Add(socket, reactor);
+  }
+
+  // Forgets about the connection on socket.
+  void RemoveOwner(int socket) {
+    std::lock_guard<std::mutex> lock(mu_);
+    connection_owners_.Remove(socket);
+  }
+
+  // Messages for each reactor, indexed like reactors_.
+  using RoutedMessages = std::vector<std::vector<std::unique_ptr<MessageType>>>;
+
+  // Groups messages by the reactor that owns their connection and hands
+  // them over. Messages for connections that no longer exist are dropped.
+  // Clears msgs. routed is scratch space, kept by callers to avoid allocating.
+  void Route(std::vector<std::unique_ptr<MessageType>>* msgs,
+             RoutedMessages* routed) {
+    if (routed->size() < reactors_.size()) {
+      routed->resize(reactors_.size());
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      for (std::unique_ptr<MessageType>& message : *msgs) {
+        uint64_t connection_id = message->connection_id;
+        Reactor** reactor_ptr = connection_owners_.Find(connection_id);
+        if (reactor_ptr == nullptr) {
+          LOG(INFO) << "Dropping message for missing connection "
+                    << connection_id;
+          messages_undeliverable_.Add(1);
+          continue;
+        }
+
+        (*routed)[(*reactor_ptr)->index()].emplace_back(std::move(message));
+      }
+    }
+
+    msgs->clear();
+    for (size_t i = 0; i < reactors_.size(); ++i) {
+      std::vector<std::unique_ptr<MessageType>>& messages = (*routed)[i];
+      if (!messages.empty()) {
+        reactors_[i]->Send(&messages);
+      }
+    }
+  }
+
+  // Hands messages from the outgoing queue to the reactors that own their
+  // connections. Never writes to sockets itself, so a slow client cannot hold
+  // up messages to other clients.
+  void WriteToSocket() {
+    std::vector<std::unique_ptr<MessageType>> batch;
+    RoutedMessages routed;
+    while (!to_kill_) {
+      bool timed_out;
+      size_t count = ConsumeUpTo(outgoing_, kMaxRouteBatchSize,
+                                 std::chrono::seconds(1), &batch, &timed_out);
+      if (timed_out) {
+        continue;
+      }
+
+      if (count == 0) {
+        break;
+      }
+
+      Route(&batch, &routed);
+    }
+
+    // Everything in the outgoing queue has been handed to the reactors.
+    routing_done_ = true;
+    for (const auto& reactor : reactors_) {
+      reactor->Wakeup();
+    }
+  }
+
+  // Maximum number of messages taken off the outgoing queue at once.
+  static constexpr size_t kMaxRouteBatchSize = 256;
+
+  // How often reactors retry reading from paused connections.
+  static constexpr std::chrono::milliseconds::rep kPausedRetryIntervalMs = 1;
+
+  // How long reactors wait before accepting again after running out of file
+  // descriptors or memory.
+  static constexpr std::chrono::milliseconds::rep kAcceptRetryIntervalMs = 100;
+
+  // Parameters.
+  const TCPServerConfig config_;
+
+  // The reactors. Populated by Start.
+  std::vector<std::unique_ptr<Reactor>> reactors_;
+
+  // Which reactor each active connection belongs to. Also assigns connection
+  // ids, so that generations are unique across reactors.
+  ConnectionSlab<Reactor*> connection_owners_;
+
+  // The port the server should listen to.
+  const uint32_t port_;
 
-  bool Read() { return input_channel_.ReadFromSocket(); }
+  // Set to true when the server needs to exit.
+  std::atomic<bool> to_kill_;
 
- private:
-  sockaddr_in address_;
-  InputChannel<HeaderType> input_channel_;
-};
+  // Set by Drain, and by the router once it has routed all messages from
+  // the closed outgoing queue.
+  std::atomic<bool> draining_;
+  std::atomic<bool> routing_done_;
 
-template <typename HeaderType>
-class TCPServer {
- public:
-  using QueueType = MessageQueue<HeaderType>;
+  // Number of reactors whose loops have exited. Protected by drain_mu_,
+  // drain_cv_ is notified when it changes.
+  size_t reactors_drained_;
+  std::mutex drain_mu_;
+  std::condition_variable drain_cv_;
 
-  TCPServer(uint32_t port, QueueType* incoming, QueueType* outgoing)
-      : tcp_socket_(-1),
-        port_(port),
-        to_kill_(false),
-        incoming_(incoming),
-        outgoing_(outgoing) {}
+  // Bytes held by all connections' input channels.
+  ByteBudget ingest_budget_;
 
-  virtual ~TCPServer() { Stop(); }
+  // Messages Route found no connection for. Only updated with mu_ held.
+  Counter messages_undeliverable_;
 
-  // Starts the main loop.
-  void Start() {
-    OpenSocket();
-    thread_ = std::thread([this] { Loop(); });
-    send_thread_ = std::thread([this] { WriteToSocket(); });
-  }
+  // A thread whose job it is to constantly try to send messages.
+  std::thread send_thread_;
 
-  // Kills the server.
-  void Stop() {
-    if (to_kill_) {
-      return;
-    }
+  // Queues for messages leaving out/coming in.
+  std::vector<QueueType*> incoming_;
+  QueueType* outgoing_;
 
-    LOG(INFO) << "Closing socket and terminating server.";
-    to_kill_ = true;
+  // Protects connection_owners_.
+  std::mutex mu_;
 
-    Join();
-    close(tcp_socket_);
+  DISALLOW_COPY_AND_ASSIGN(TCPServer);
+};
+
+template <typename HeaderType, typename PayloadType, typename MessageQueueType>
+constexpr std::chrono::milliseconds::rep
+    TCPServer<HeaderType, PayloadType,
+              MessageQueueType>::kAcceptRetryIntervalMs;
+
+// Runs a handler for each message a TCPServer receives, on a pool of worker
+// threads, so that the application does not have to consume the incoming
+// queues and do its own threading. Messages from the same connection are
+// handled one at a time, in the order they were received; messages from
+// different connections are handled in parallel. Idle workers take whichever
+// connection has messages waiting, so a busy connection does not hold up
+// others that hash to the same worker. Replies are handed straight to the
+// reactors that own their connections with TCPServer::SendDirect.
+template <typename HeaderType, typename PayloadType = std::vector<char>,
+          typename QueueType = MessageQueue<HeaderType, PayloadType>>
+class HandlerPool {
+ public:
+  using MessageType = HeaderAndMessage<HeaderType, PayloadType>;
+  using ServerType = TCPServer<HeaderType, PayloadType, QueueType>;
+
+  // Handles a message. Replies, addressed to any connection, should be
+  // appended to replies and are sent once the handler returns.
+  using Handler =
+      std::function<void(std::unique_ptr<MessageType> msg,
+                         std::vector<std::unique_ptr<MessageType>>* replies)>;
+
+  // Messages are taken from incoming, which should be the queue(s) server
+  // produces to.
+  HandlerPool(ServerType* server, QueueType* incoming, Handler handler,
+              size_t num_threads)
+      : HandlerPool(server, std::vector<QueueType*>({incoming}),
+                    std::move(handler), num_threads) {}
+
+  HandlerPool(ServerType* server, const std::vector<QueueType*>& incoming,
+              Handler handler, size_t num_threads)
+      : server_(server),
+        incoming_(incoming),
+        handler_(std::move(handler)),
+        num_threads_(num_threads),
+        dispatch_done_(false),
+        stopped_(false) {
+    CHECK(num_threads_ > 0) << "Need at least one thread";
   }
 
-  void Join() {
-    if (thread_.joinable()) {
-      thread_.join();
+  ~HandlerPool() { Stop(); }
+
+  void Start() {
+    for (QueueType* incoming : incoming_) {
+      dispatchers_.emplace_back([this, incoming] { Dispatch(incoming); });
     }
 
-    if (send_thread_.joinable()) {
-      send_thread_.join();
+    for (size_t i = 0; i < num_threads_; ++i) {
+      workers_.emplace_back([this] { Work(); });
     }
   }
 
- private:
-  // Opens the socket for listening.
-  void OpenSocket() {
-    sockaddr_in address;
-    memset(reinterpret_cast<char*>(&address), 0, sizeof(address));
-
-    if ((tcp_socket_ = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-      LOG(FATAL) << "Unable to get socket";
+  // Closes the incoming queues, handles the messages that are left in them
+  // and stops the threads. To shut down gracefully call this before
+  // TCPServer::Drain, so that the replies are sent. Messages the server
+  // receives after this are not handled.
+  void Stop() {
+    if (stopped_) {
+      return;
     }
 
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port_);
-    address.sin_addr.s_addr = INADDR_ANY;
-
-    int yes = 1;
-    if (setsockopt(tcp_socket_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) ==
-        -1) {
-      LOG(FATAL) << "Unable to set REUSEADDR";
+    stopped_ = true;
+    for (QueueType* incoming : incoming_) {
+      incoming->Close();
     }
 
-    if (bind(tcp_socket_, reinterpret_cast<sockaddr*>(&address),
-             sizeof(sockaddr)) == -1) {
-      LOG(FATAL) << "Unable to bind: " + std::string(strerror(errno));
+    for (std::thread& dispatcher : dispatchers_) {
+      dispatcher.join();
     }
 
-    if (listen(tcp_socket_, 10) == -1) {
-      LOG(FATAL) << "Unable to listen";
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      dispatch_done_ = true;
     }
 
-    // Set to non-blocking
-    fcntl(tcp_socket_, F_SETFL, O_NONBLOCK);
-  }
-
-  // Called when a new TCP connection is established with the server. Accepts
-  // the connection and populates new_socket with  the new socket. Will also set
-  // try_again to true if EWOULDBLOCK is returned by accept.
-  void NewTcpConnection(int* new_socket, bool* try_again) {
-    sockaddr_in remote_address;
-    socklen_t address_len = sizeof(remote_address);
-
-    *try_again = false;
-    int socket;
-    if ((socket = accept(tcp_socket_,
-                         reinterpret_cast<struct sockaddr*>(&remote_address),
-                         &address_len)) == -1) {
-      if (errno != EWOULDBLOCK) {
-        LOG(FATAL) << "Unable to accept";
-      }
-
-      *try_again = true;
-      return;
+    cv_.notify_all();
+    for (std::thread& worker : workers_) {
+      worker.join();
     }
-
-    fcntl(socket, F_SETFL, O_NONBLOCK);
-    *new_socket = socket;
-
-    active_connections_.emplace(
-        std::piecewise_construct, std::forward_as_tuple(socket),
-        std::forward_as_tuple(remote_address, socket, incoming_));
   }
 
-  // Runs the main server loop. Will block.
-  void Loop() {
-    int last_fd = tcp_socket_;
-    fd_set master;
-    fd_set read_fds;
-
-    FD_ZERO(&master);
-    FD_ZERO(&read_fds);
+ private:
+  // Messages from a connection that are waiting to be handled.
+  struct PendingConnection {
+    PendingConnection() : running(false) {}
 
-    FD_SET(tcp_socket_, &master);
+    std::deque<std::unique_ptr<MessageType>> messages;
 
-    while (!to_kill_) {
-      read_fds = master;
+    // True while a worker is handling the connection's messages.
+    bool running;
+  };
 
-      timeval tv = {0, 0};
-      tv.tv_sec = 1;
+  // Moves messages from an incoming queue to their connections, until the
+  // queue is closed.
+  void Dispatch(QueueType* incoming) {
+    std::vector<std::unique_ptr<MessageType>> batch;
+    while (true) {
+      bool timed_out;
+      size_t count = ConsumeUpTo(incoming, kMaxDispatchBatchSize,
+                                 std::chrono::seconds(1), &batch, &timed_out);
+      if (timed_out) {
+        continue;
+      }
 
-      int select_return = select(last_fd + 1, &read_fds, nullptr, NULL, &tv);
-      if (select_return < 0) {
-        LOG(FATAL) << "Unable to select: " << strerror(errno);
+      if (count == 0) {
+        return;
       }
 
+      size_t newly_ready = 0;
       {
         std::lock_guard<std::mutex> lock(mu_);
-        for (int socket_to_close : sockets_to_close_) {
-          active_connections_.erase(socket_to_close);
-          close(socket_to_close);
-          FD_CLR(socket_to_close, &master);
-          FD_CLR(socket_to_close, &read_fds);
-        }
-
-        sockets_to_close_.clear();
-      }
+        for (std::unique_ptr<MessageType>& msg : batch) {
+          uint64_t connection_id = msg->connection_id;
+          PendingConnection& connection = connections_[connection_id];
+          if (connection.messages.empty() && !connection.running) {
+            ready_.emplace_back(connection_id);
+            ++newly_ready;
+          }
 
-      if (select_return == 0) {
-        continue;  // Timed out
+          connection.messages.emplace_back(std::move(msg));
+        }
       }
 
-      for (int i = 0; i <= last_fd; i++) {
-        if (FD_ISSET(i, &read_fds)) {
-          if (i == tcp_socket_) {
-            int new_socket;
-            bool try_again;
-
-            NewTcpConnection(&new_socket, &try_again);
-            if (try_again) {
-              break;
-            }
-
-            FD_SET(new_socket, &master);
-            if (new_socket > last_fd) {
-              last_fd = new_socket;
-            }
-          } else {
-            ServerConnection<HeaderType>* connection =
-                FindOrNull(active_connections_, i);
-            if (connection == nullptr) {
-              LOG(INFO) << "Missing connection for socket " << i;
-              continue;
-            }
-
-            if (!connection->Read()) {
-              LOG(INFO) << "Error in connection";
-              active_connections_.erase(i);
-              close(i);
-              FD_CLR(i, &master);
-            }
-          }
-        }
+      batch.clear();
+      if (newly_ready == 1) {
+        cv_.notify_one();
+      } else if (newly_ready > 1) {
+        cv_.notify_all();
       }
     }
   }
 
-  void WriteToSocket() {
-    while (!to_kill_) {
-      bool timed_out;
-      std::unique_ptr<HeaderAndMessage<HeaderType>> message =
-          outgoing_->ConsumeOrBlockWithTimeout(std::chrono::seconds(1),
-                                               &timed_out);
-      if (timed_out) {
-        continue;
+  // Handles messages of connections that are ready, until Stop is called and
+  // no connection is.
+  void Work() {
+    std::vector<std::unique_ptr<MessageType>> to_handle;
+    std::vector<std::unique_ptr<MessageType>> replies;
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+      cv_.wait(lock, [this] { return !ready_.empty() || dispatch_done_; });
+      if (ready_.empty()) {
+        return;
       }
 
-      if (!message) {
-        break;
+      uint64_t connection_id = ready_.front();
+      ready_.pop_front();
+
+      // Elements of an unordered_map stay put when others are added, and
+      // only the worker running a connection removes it.
+      PendingConnection& connection = connections_[connection_id];
+      connection.running = true;
+      while (!connection.messages.empty() &&
+             to_handle.size() < kMaxHandleBatchSize) {
+        to_handle.emplace_back(std::move(connection.messages.front()));
+        connection.messages.pop_front();
       }
 
-      int socket = message->connection_id;
-      bool last = message->last_in_connection;
-      if (!BlockingWriteMessageToSocket(std::move(message))) {
-        break;
+      lock.unlock();
+      for (std::unique_ptr<MessageType>& msg : to_handle) {
+        handler_(std::move(msg), &replies);
       }
 
-      if (last) {
-        std::lock_guard<std::mutex> lock(mu_);
-        sockets_to_close_.emplace_back(socket);
+      to_handle.clear();
+      if (!replies.empty()) {
+        server_->SendDirect(&replies);
+      }
+
+      lock.lock();
+      connection.running = false;
+      if (connection.messages.empty()) {
+        connections_.erase(connection_id);
+      } else {
+        // Goes to the back of the line, so that other connections get a turn.
+        ready_.emplace_back(connection_id);
+        cv_.notify_one();
       }
     }
   }
 
-  // Currently active connections.
-  std::map<int, ServerConnection<HeaderType>> active_connections_;
+  // Maximum number of messages taken off an incoming queue at once.
+  static constexpr size_t kMaxDispatchBatchSize = 256;
 
-  // The socket the server listens on.
-  int tcp_socket_;
+  // Maximum number of messages of a connection handled in one go by a
+  // worker before it moves on.
+  static constexpr size_t kMaxHandleBatchSize = 64;
 
-  // The port the server should listen to.
-  const uint32_t port_;
+  ServerType* server_;
+  std::vector<QueueType*> incoming_;
+  Handler handler_;
+  const size_t num_threads_;
 
-  // Set to true when the server needs to exit.
-  std::atomic<bool> to_kill_;
+  // Connections with messages waiting or being handled.
+  std::unordered_map<uint64_t, PendingConnection> connections_;
 
-  // The server's main thread.
-  std::thread thread_;
+  // Connections with messages waiting that are not being handled, in the
+  // order they became ready.
+  std::deque<uint64_t> ready_;
 
-  // A thread whose job it is to constantly try to send messages.
-  std::thread send_thread_;
+  // Set once all messages have been dispatched, after Stop.
+  bool dispatch_done_;
 
-  // Queues for messages leaving out/coming in.
-  QueueType* incoming_;
-  QueueType* outgoing_;
+  // Protects connections_, ready_ and dispatch_done_. cv_ is notified when
+  // ready_ grows or dispatch_done_ is set.
+  std::mutex mu_;
+  std::condition_variable cv_;
 
-  // Sockets to remove from the set of listening sockets.
-  std::vector<int> sockets_to_close_;
+  std::vector<std::thread> dispatchers_;
+  std::vector<std::thread> workers_;
 
-  // Protected sockets_to_close_.
-  std::mutex mu_;
+  // Set by the first call to Stop.
+  bool stopped_;
 
-  DISALLOW_COPY_AND_ASSIGN(TCPServer);
+  DISALLOW_COPY_AND_ASSIGN(HandlerPool);
 };
 
 // Simple wrapper around a blocking socket that makes it easier to
@@ -487,6 +3092,508 @@ class ClientConnection {
   const int tcp_socket_;
 };
 
+// Opens a TCP connection to a server. Returns the socket, or -1 if the address
+// cannot be resolved or the connection cannot be established within timeout.
+// A zero timeout waits for as long as the kernel keeps trying. Resolving the
+// address is not subject to the timeout.
+int ConnectToServer(
+    const std::string& destination_address, uint32_t port,
+    std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+
+// A client connection that can have many requests in flight. Requests are
+// written out as soon as they are sent, without waiting for replies to earlier
+// ones. A background thread reads replies, matches them to requests by
+// correlation id and runs the requests' callbacks. In addition to MessageSize,
+// HeaderType should have:
+//
+//   static uint64_t CorrelationId(const HeaderType& header);
+//   static void SetCorrelationId(uint64_t correlation_id, HeaderType* header);
+//
+// Servers should copy the correlation id of a request into its reply. Replies
+// can come in any order.
+template <typename HeaderType>
+class AsyncClientConnection {
+ public:
+  using MessageType = HeaderAndMessage<HeaderType>;
+
+  // Called with the reply to a request, or with null if the connection breaks
+  // before the reply arrives. Runs on the background thread and should not
+  // block.
+  using Callback = std::function<void(std::unique_ptr<MessageType> reply)>;
+
+  // Returns null if the connection cannot be established, within timeout if
+  // it is not zero.
+  static std::unique_ptr<AsyncClientConnection> Connect(
+      const std::string& destination_address, uint32_t port,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds::zero()) {
+    int socket = ConnectToServer(destination_address, port, timeout);
+    if (socket == -1) {
+      return {};
+    }
+
+    return std::unique_ptr<AsyncClientConnection>(
+        new AsyncClientConnection(socket));
+  }
+
+  ~AsyncClientConnection() { Close(); }
+
+  // Sets the request's correlation id and sends it. Returns false if the
+  // connection is broken, in which case callback will not be called.
+  // Otherwise callback will be called exactly once. Can be called from any
+  // thread.
+  bool Send(std::unique_ptr<MessageType> msg, Callback callback) {
+    uint64_t correlation_id;
+    {
+      std::lock_guard<std::mutex> lock(state_->mu);
+      if (state_->broken) {
+        return false;
+      }
+
+      correlation_id = state_->next_correlation_id++;
+      state_->pending.emplace(correlation_id, std::move(callback));
+    }
+
+    HeaderType::SetCorrelationId(correlation_id, &msg->header);
+    msg->connection_id = state_->tcp_socket;
+
+    bool written;
+    {
+      std::lock_guard<std::mutex> lock(write_mu_);
+      written = BlockingWriteMessageToSocket(std::move(msg));
+    }
+
+    if (!written) {
+      // The reader will fail all outstanding requests, including this one.
+      shutdown(state_->tcp_socket, SHUT_RDWR);
+    }
+
+    return true;
+  }
+
+  // Number of requests that have been sent but have not been replied to.
+  size_t outstanding() const {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    return state_->pending.size();
+  }
+
+  // True if the connection is broken. No more requests can be sent.
+  bool broken() const {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    return state_->broken;
+  }
+
+  // Closes the connection. Callbacks of outstanding requests are called with
+  // null. Should not be called concurrently with Send. When called from a
+  // callback, for example by destroying the connection, does not wait for
+  // the background thread, which cannot wait for itself; it finishes once
+  // the callback returns.
+  void Close() {
+    if (!read_thread_.joinable()) {
+      return;
+    }
+
+    shutdown(state_->tcp_socket, SHUT_RDWR);
+    if (std::this_thread::get_id() == read_thread_.get_id()) {
+      read_thread_.detach();
+      return;
+    }
+
+    read_thread_.join();
+  }
+
+ private:
+  // What the background thread works with. It holds on to it, so that it can
+  // keep going if the connection is destroyed by one of its callbacks.
+  struct State {
+    explicit State(int tcp_socket)
+        : tcp_socket(tcp_socket), broken(false), next_correlation_id(0) {}
+
+    // The socket is closed once both are done with it.
+    ~State() { close(tcp_socket); }
+
+    // The socket.
+    const int tcp_socket;
+
+    // Set once the connection breaks.
+    bool broken;
+
+    // Correlation id of the next request.
+    uint64_t next_correlation_id;
+
+    // Callbacks of requests that have not been replied to yet.
+    std::unordered_map<uint64_t, Callback> pending;
+
+    // Protects broken, next_correlation_id and pending.
+    mutable std::mutex mu;
+  };
+
+  // Stands in for a queue in InputChannel. Replies are dispatched to their
+  // callbacks as they are parsed.
+  class ReplyDispatcher {
+   public:
+    explicit ReplyDispatcher(State* state) : state_(state) {}
+
+    bool ProduceOrBlock(std::unique_ptr<MessageType> reply) {
+      Dispatch(state_, std::move(reply));
+      return true;
+    }
+
+   private:
+    State* state_;
+  };
+
+  explicit AsyncClientConnection(int tcp_socket)
+      : state_(std::make_shared<State>(tcp_socket)) {
+    // Small requests are common and should not wait for earlier ones to be
+    // acknowledged.
+    int yes = 1;
+    setsockopt(tcp_socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    std::shared_ptr<State> state = state_;
+    read_thread_ = std::thread([state] { ReadReplies(state.get()); });
+  }
+
+  // Reads replies until the connection breaks. The socket is blocking, the
+  // channel returns whenever it has dispatched everything read so far.
+  static void ReadReplies(State* state) {
+    ConnectionCounters counters;
+    Log2Histogram frame_sizes;
+    ReplyDispatcher dispatcher(state);
+    InputChannel<HeaderType, std::vector<char>, ReplyDispatcher> channel(
+        state->tcp_socket, state->tcp_socket, &dispatcher, &counters,
+        &frame_sizes);
+    while (channel.ReadFromSocket()) {
+    }
+
+    std::unordered_map<uint64_t, Callback> pending;
+    {
+      std::lock_guard<std::mutex> lock(state->mu);
+      state->broken = true;
+      std::swap(pending, state->pending);
+    }
+
+    for (auto& correlation_id_and_callback : pending) {
+      correlation_id_and_callback.second(nullptr);
+    }
+  }
+
+  static void Dispatch(State* state, std::unique_ptr<MessageType> reply) {
+    uint64_t correlation_id = HeaderType::CorrelationId(reply->header);
+    Callback callback;
+    {
+      std::lock_guard<std::mutex> lock(state->mu);
+      auto it = state->pending.find(correlation_id);
+      if (it == state->pending.end()) {
+        LOG(ERROR) << "Reply to unknown request " << correlation_id;
+        return;
+      }
+
+      callback = std::move(it->second);
+      state->pending.erase(it);
+    }
+
+    callback(std::move(reply));
+  }
+
+  // Shared with the background thread.
+  std::shared_ptr<State> state_;
+
+  // Serializes writes to the socket.
+  std::mutex write_mu_;
+
+  // Reads replies.
+  std::thread read_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncClientConnection);
+};
+
+// How a ClientConnectionPool picks a connection for a request.
+enum class LoadBalancingPolicy {
+  // Cycles through connections.
+  kRoundRobin,
+
+  // Picks the connection with the fewest requests awaiting replies, which
+  // steers requests away from slow servers.
+  kLeastOutstanding,
+};
+
+// A server a ClientConnectionPool connects to.
+struct ServerAddress {
+  std::string host;
+  uint32_t port;
+};
+
+// Parameters for a ClientConnectionPool.
+struct ClientConnectionPoolConfig {
+  ClientConnectionPoolConfig()
+      : connections_per_server(4),
+        policy(LoadBalancingPolicy::kLeastOutstanding),
+        min_reconnect_delay(10),
+        max_reconnect_delay(10000),
+        connect_timeout(1000) {}
+
+  // Number of connections kept open to each server.
+  size_t connections_per_server;
+
+  // How requests are spread among connections.
+  LoadBalancingPolicy policy;
+
+  // After a connection attempt fails the next one is made after
+  // min_reconnect_delay, and the delay doubles with each subsequent failure up
+  // to max_reconnect_delay.
+  std::chrono::milliseconds min_reconnect_delay;
+  std::chrono::milliseconds max_reconnect_delay;
+
+  // How long a connection attempt can take before it counts as failed.
+  // Attempts are made one at a time, by the constructor and then by a
+  // background thread, so an unresponsive server would hold up connections
+  // to the others.
+  std::chrono::milliseconds connect_timeout;
+};
+
+// Keeps a number of AsyncClientConnections open to each of a set of servers and
+// spreads requests among them. Connections that break, or that cannot be
+// established, are retried in the background with exponential backoff.
+// Requests go to any server, so all servers should be able to serve any
+// request. Thread-safe.
+template <typename HeaderType>
+class ClientConnectionPool {
+ public:
+  using ConnectionType = AsyncClientConnection<HeaderType>;
+  using MessageType = typename ConnectionType::MessageType;
+  using Callback = typename ConnectionType::Callback;
+
+  // Tries to connect to all servers before returning.
+  ClientConnectionPool(
+      const std::vector<ServerAddress>& servers,
+      const ClientConnectionPoolConfig& config = ClientConnectionPoolConfig())
+      : config_(config), next_slot_(0), wakeup_(false), to_kill_(false) {
+    CHECK(!servers.empty()) << "No servers";
+    CHECK(config_.connections_per_server > 0) << "Need at least 1 connection";
+    for (const ServerAddress& server : servers) {
+      for (size_t i = 0; i < config_.connections_per_server; ++i) {
+        slots_.emplace_back(server);
+      }
+    }
+
+    ReconnectDue();
+    maintenance_thread_ = std::thread([this] { MaintainConnections(); });
+  }
+
+  ~ClientConnectionPool() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      to_kill_ = true;
+    }
+
+    wakeup_cv_.notify_all();
+    maintenance_thread_.join();
+  }
+
+  // Sends a request over one of the connections, see
+  // AsyncClientConnection::Send. Returns false if no connection is available,
+  // in which case callback will not be called.
+  bool Send(std::unique_ptr<MessageType> msg, Callback callback) {
+    std::shared_ptr<ConnectionType> connection = PickConnection();
+    if (!connection) {
+      return false;
+    }
+
+    if (!connection->Send(std::move(msg), std::move(callback))) {
+      // Broke after it was picked.
+      Wakeup();
+      return false;
+    }
+
+    return true;
+  }
+
+  // Number of connections that are currently usable.
+  size_t healthy_connections() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    size_t count = 0;
+    for (const Slot& slot : slots_) {
+      if (Healthy(slot)) {
+        ++count;
+      }
+    }
+
+    return count;
+  }
+
+ private:
+  // How often connections are checked for breakage if nothing else wakes up
+  // the maintenance thread.
+  static constexpr std::chrono::milliseconds::rep kCheckIntervalMs = 1000;
+
+  struct Slot {
+    explicit Slot(const ServerAddress& server)
+        : server(server),
+          reconnect_delay(0),
+          next_attempt(std::chrono::steady_clock::now()) {}
+
+    ServerAddress server;
+
+    // Null while down. Shared with senders, which use it outside of mu_.
+    std::shared_ptr<ConnectionType> connection;
+
+    // Zero if the last connection attempt succeeded.
+    std::chrono::milliseconds reconnect_delay;
+
+    // When to try to connect next, if down.
+    std::chrono::steady_clock::time_point next_attempt;
+  };
+
+  static bool Healthy(const Slot& slot) {
+    return slot.connection && !slot.connection->broken();
+  }
+
+  std::shared_ptr<ConnectionType> PickConnection() {
+    std::lock_guard<std::mutex> lock(mu_);
+    size_t slot_count = slots_.size();
+    size_t start = next_slot_;
+    next_slot_ = (next_slot_ + 1) % slot_count;
+
+    Slot* best = nullptr;
+    size_t best_outstanding = std::numeric_limits<size_t>::max();
+    bool all_healthy = true;
+    for (size_t i = 0; i < slot_count; ++i) {
+      Slot& slot = slots_[(start + i) % slot_count];
+      if (!Healthy(slot)) {
+        all_healthy = false;
+        continue;
+      }
+
+      if (config_.policy == LoadBalancingPolicy::kRoundRobin) {
+        best = &slot;
+        break;
+      }
+
+      // Ties go to the first slot after the last pick.
+      size_t outstanding = slot.connection->outstanding();
+      if (outstanding < best_outstanding) {
+        best = &slot;
+        best_outstanding = outstanding;
+      }
+    }
+
+    if (!all_healthy) {
+      wakeup_ = true;
+      wakeup_cv_.notify_all();
+    }
+
+    return best == nullptr ? nullptr : best->connection;
+  }
+
+  void Wakeup() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      wakeup_ = true;
+    }
+
+    wakeup_cv_.notify_all();
+  }
+
+  // Tries to connect all slots that are down and due for an attempt.
+  void ReconnectDue() {
+    std::vector<size_t> to_connect;
+    std::vector<std::shared_ptr<ConnectionType>> broken;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto now = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < slots_.size(); ++i) {
+        Slot& slot = slots_[i];
+        if (slot.connection && slot.connection->broken()) {
+          // Destroyed outside of mu_, destroying a connection waits for its
+          // callbacks, which may call Send.
+          broken.emplace_back(std::move(slot.connection));
+          slot.connection.reset();
+        }
+
+        if (!slot.connection && slot.next_attempt <= now) {
+          to_connect.emplace_back(i);
+        }
+      }
+    }
+
+    broken.clear();
+    for (size_t i : to_connect) {
+      // Slots are never added or removed, server does not change.
+      const ServerAddress& server = slots_[i].server;
+      std::shared_ptr<ConnectionType> connection =
+          ConnectionType::Connect(server.host, server.port,
+                                  config_.connect_timeout);
+
+      std::lock_guard<std::mutex> lock(mu_);
+      Slot& slot = slots_[i];
+      if (connection) {
+        slot.connection = std::move(connection);
+        slot.reconnect_delay = std::chrono::milliseconds(0);
+        continue;
+      }
+
+      if (slot.reconnect_delay.count() == 0) {
+        slot.reconnect_delay = config_.min_reconnect_delay;
+      } else {
+        slot.reconnect_delay =
+            std::min(slot.reconnect_delay * 2, config_.max_reconnect_delay);
+      }
+
+      slot.next_attempt =
+          std::chrono::steady_clock::now() + slot.reconnect_delay;
+    }
+  }
+
+  // Runs on maintenance_thread_.
+  void MaintainConnections() {
+    while (true) {
+      std::unique_lock<std::mutex> lock(mu_);
+      auto deadline = std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(kCheckIntervalMs);
+      for (const Slot& slot : slots_) {
+        if (!slot.connection) {
+          deadline = std::min(deadline, slot.next_attempt);
+        }
+      }
+
+      wakeup_cv_.wait_until(lock, deadline,
+                            [this] { return wakeup_ || to_kill_; });
+      if (to_kill_) {
+        return;
+      }
+
+      wakeup_ = false;
+      lock.unlock();
+      ReconnectDue();
+    }
+  }
+
+  // Parameters.
+  const ClientConnectionPoolConfig config_;
+
+  // connections_per_server slots per server.
+  std::vector<Slot> slots_;
+
+  // Where PickConnection starts looking.
+  size_t next_slot_;
+
+  // Set to wake up the maintenance thread early.
+  bool wakeup_;
+  bool to_kill_;
+  std::condition_variable wakeup_cv_;
+
+  // Protects all of the above except config_ and the slots' servers.
+  mutable std::mutex mu_;
+
+  // Reconnects connections.
+  std::thread maintenance_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(ClientConnectionPool);
+};
+
+template <typename HeaderType>
+constexpr std::chrono::milliseconds::rep
+    ClientConnectionPool<HeaderType>::kCheckIntervalMs;
+
 }  // namesapce web
 }  // namespace nc
 
@@ -0,0 +1,254 @@
+// Measures TCPServer throughput and latency over loopback. Each client
+// connection sends a request, waits for the server to echo it back and sends
+// the next one, for a range of message sizes, connection counts and server
+// configurations. Results are printed to stdout as a JSON array with one
+// object per configuration. Configurations whose backend is not available are
+// skipped.
+//
+// Usage: server_benchmark [milliseconds per configuration] [port]
+
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+
+#include "json.hpp"
+#include "server.h"
+
+namespace nc {
+namespace web {
+namespace {
+
+static constexpr uint32_t kDefaultPort = 8080;
+
+static constexpr size_t kMessageSizes[] = {64, 1024, 16384, 262144};
+static constexpr size_t kConnectionCounts[] = {1, 16};
+
+struct BenchmarkHeader {
+  static size_t MessageSize(const BenchmarkHeader& header) {
+    return header.len;
+  }
+
+  uint32_t len;
+};
+
+using BenchmarkMessage = HeaderAndMessage<BenchmarkHeader>;
+using BenchmarkQueue = MessageQueue<BenchmarkHeader>;
+
+// A server configuration to benchmark.
+struct ServerSetup {
+  const char* name;
+  TCPServerConfig config;
+};
+
+std::vector<ServerSetup> ServerSetups() {
+  std::vector<ServerSetup> setups;
+
+  TCPServerConfig config;
+  config.backend = TCPServerBackend::kEpoll;
+  setups.push_back({"epoll", config});
+
+  config.num_reactors = 4;
+  setups.push_back({"epoll_4_reactors", config});
+
+  config.num_reactors = 1;
+  config.busy_poll = true;
+  setups.push_back({"epoll_busy_poll", config});
+
+  config.busy_poll = false;
+  config.backend = TCPServerBackend::kIoUring;
+  setups.push_back({"io_uring", config});
+  return setups;
+}
+
+// Returns true if servers with setup's configuration get the backend they ask
+// for, and not a fallback. io_uring only counts if it receives data itself,
+// as only polling through it saves next to nothing over epoll.
+bool BackendAvailable(const ServerSetup& setup) {
+  std::unique_ptr<Poller> poller = NewPoller(setup.config.backend);
+  if (poller->backend() != setup.config.backend) {
+    return false;
+  }
+
+  return setup.config.backend != TCPServerBackend::kIoUring ||
+         poller->ReceivesData();
+}
+
+// What a single client connection measured.
+struct ClientResult {
+  // Latency of each round trip, in nanoseconds.
+  std::vector<uint64_t> latencies_ns;
+};
+
+// Sends requests of message_size bytes one at a time to the server on port
+// until stop is set. Round trips are only recorded while measuring is set.
+void RunClient(uint32_t port, size_t message_size,
+               const std::atomic<bool>* measuring,
+               const std::atomic<bool>* stop, ClientResult* result) {
+  using namespace std::chrono;
+
+  auto client = ClientConnection<BenchmarkHeader>::Connect("127.0.0.1", port);
+  CHECK(client) << "Unable to connect";
+
+  while (!*stop) {
+    auto request = make_unique<BenchmarkMessage>(-1);
+    request->header.len = message_size;
+    request->message.resize(message_size);
+
+    auto start = high_resolution_clock::now();
+    CHECK(client->WriteToSocket(std::move(request)));
+    std::unique_ptr<BenchmarkMessage> reply = client->ReadFromSocket();
+    auto end = high_resolution_clock::now();
+
+    CHECK(reply) << "Server went away";
+    CHECK(reply->message.size() == message_size);
+    if (*measuring) {
+      result->latencies_ns.emplace_back(
+          duration_cast<nanoseconds>(end - start).count());
+    }
+  }
+
+  client->Close();
+}
+
+// Sends every incoming message back to its connection, until incoming is
+// closed.
+void Echo(BenchmarkQueue* incoming, BenchmarkQueue* outgoing) {
+  std::vector<std::unique_ptr<BenchmarkMessage>> batch;
+  while (true) {
+    bool timed_out;
+    if (ConsumeUpTo(incoming, 256, std::chrono::milliseconds(100), &batch,
+                    &timed_out) == 0) {
+      if (timed_out) {
+        continue;
+      }
+
+      return;
+    }
+
+    ProduceBatch(outgoing, &batch);
+  }
+}
+
+// Returns the value below which a fraction q of the sorted values fall, in
+// microseconds.
+double PercentileUs(const std::vector<uint64_t>& sorted_ns, double q) {
+  if (sorted_ns.empty()) {
+    return 0;
+  }
+
+  size_t index = std::min(sorted_ns.size() - 1,
+                          static_cast<size_t>(q * sorted_ns.size()));
+  return sorted_ns[index] / 1000.0;
+}
+
+nlohmann::json RunOne(const ServerSetup& setup, uint32_t port,
+                      size_t message_size, size_t connection_count,
+                      std::chrono::milliseconds duration) {
+  using namespace std::chrono;
+
+  BenchmarkQueue incoming;
+  BenchmarkQueue outgoing;
+  TCPServer<BenchmarkHeader> server(port, &incoming, &outgoing, setup.config);
+  server.Start();
+  std::thread echo_thread([&incoming, &outgoing] {
+    Echo(&incoming, &outgoing);
+  });
+
+  // Gives the reactors time to start listening.
+  std::this_thread::sleep_for(milliseconds(100));
+
+  std::atomic<bool> measuring(false);
+  std::atomic<bool> stop(false);
+  std::vector<ClientResult> results(connection_count);
+  std::vector<std::thread> clients;
+  for (size_t i = 0; i < connection_count; ++i) {
+    ClientResult* result = &results[i];
+    clients.emplace_back([port, message_size, &measuring, &stop, result] {
+      RunClient(port, message_size, &measuring, &stop, result);
+    });
+  }
+
+  // Lets connections get established and buffers get allocated before
+  // measuring.
+  std::this_thread::sleep_for(duration / 10);
+  measuring = true;
+  auto start = high_resolution_clock::now();
+  std::this_thread::sleep_for(duration);
+  measuring = false;
+  auto end = high_resolution_clock::now();
+
+  stop = true;
+  for (auto& client : clients) {
+    client.join();
+  }
+
+  server.Stop();
+  incoming.Close();
+  echo_thread.join();
+
+  std::vector<uint64_t> latencies_ns;
+  for (const ClientResult& result : results) {
+    latencies_ns.insert(latencies_ns.end(), result.latencies_ns.begin(),
+                        result.latencies_ns.end());
+  }
+  std::sort(latencies_ns.begin(), latencies_ns.end());
+
+  double seconds = duration_cast<microseconds>(end - start).count() / 1e6;
+  double msgs_per_sec = latencies_ns.size() / seconds;
+
+  nlohmann::json out;
+  out["server"] = setup.name;
+  out["message_size"] = message_size;
+  out["connections"] = connection_count;
+  out["round_trips"] = latencies_ns.size();
+  out["msgs_per_sec"] = msgs_per_sec;
+  out["mb_per_sec"] = msgs_per_sec * message_size / 1e6;
+  out["p50_us"] = PercentileUs(latencies_ns, 0.5);
+  out["p99_us"] = PercentileUs(latencies_ns, 0.99);
+  out["p999_us"] = PercentileUs(latencies_ns, 0.999);
+  return out;
+}
+
+}  // namespace
+}  // namespace web
+}  // namespace nc
+
+int main(int argc, char** argv) {
+  using namespace nc::web;
+
+  std::chrono::milliseconds duration(2000);
+  uint32_t port = kDefaultPort;
+  if (argc > 3) {
+    LOG(FATAL) << "Usage: " << argv[0]
+               << " [milliseconds per configuration] [port]";
+  }
+
+  if (argc >= 2) {
+    duration = std::chrono::milliseconds(atoi(argv[1]));
+    CHECK(duration.count() > 0) << "Bad duration " << argv[1];
+  }
+
+  if (argc == 3) {
+    int port_arg = atoi(argv[2]);
+    CHECK(port_arg > 0 && port_arg < 65536) << "Bad port " << argv[2];
+    port = port_arg;
+  }
+
+  nlohmann::json results = nlohmann::json::array();
+  for (const ServerSetup& setup : ServerSetups()) {
+    if (!BackendAvailable(setup)) {
+      LOG(ERROR) << "Skipping " << setup.name << ", backend not available";
+      continue;
+    }
+
+    for (size_t message_size : kMessageSizes) {
+      for (size_t connection_count : kConnectionCounts) {
+        results.push_back(
+            RunOne(setup, port, message_size, connection_count, duration));
+      }
+    }
+  }
+
+  std::cout << results.dump(2) << std::endl;
+  return 0;
+}
@@ -1,3 +1,8 @@
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <condition_variable>
+
 #include "gtest/gtest.h"
 #include "server.h"
 
@@ -143,6 +148,1354 @@ TEST_F(Fixture, MultiSequentialConnections) {
   ASSERT_EQ(1000, contents[0]->message.size());
   ASSERT_EQ(1000, contents[1]->message.size());
 }
+
+TEST_F(Fixture, SlowClientDoesNotBlockOthers) {
+  server_.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto slow_client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  auto fast_client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+
+  // Each client sends a message so that we learn its connection id.
+  ASSERT_TRUE(slow_client->WriteToSocket(GetJunkMessage()));
+  uint64_t slow_id = incoming_.ConsumeOrBlock()->connection_id;
+  ASSERT_TRUE(fast_client->WriteToSocket(GetJunkMessage()));
+  uint64_t fast_id = incoming_.ConsumeOrBlock()->connection_id;
+
+  // The slow client never reads, this is much more than the socket buffers
+  // can hold.
+  for (size_t i = 0; i < 10000; ++i) {
+    auto message_ptr = GetJunkMessage();
+    message_ptr->connection_id = slow_id;
+    outgoing_.ProduceOrBlock(std::move(message_ptr));
+  }
+
+  auto message_ptr = GetJunkMessage();
+  message_ptr->connection_id = fast_id;
+  outgoing_.ProduceOrBlock(std::move(message_ptr));
+
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+      fast_client->ReadFromSocket();
+  ASSERT_TRUE(reply);
+  ASSERT_EQ(1000, reply->message.size());
+
+  server_.Stop();
+  slow_client->Close();
+  fast_client->Close();
+}
+
+TEST_F(Fixture, ManySmallRepliesInOrder) {
+  size_t msg_count = 5000;
+
+  server_.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  ASSERT_TRUE(client->WriteToSocket(GetJunkMessage()));
+  uint64_t id = incoming_.ConsumeOrBlock()->connection_id;
+
+  // Replies of varying size, including empty ones, that should be batched
+  // together on the way out.
+  for (size_t i = 0; i < msg_count; ++i) {
+    auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(id);
+    message_ptr->header.len = i % 100;
+    message_ptr->message.resize(i % 100);
+    outgoing_.ProduceOrBlock(std::move(message_ptr));
+  }
+
+  for (size_t i = 0; i < msg_count; ++i) {
+    std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+        client->ReadFromSocket();
+    ASSERT_TRUE(reply);
+    ASSERT_EQ(i % 100, reply->message.size());
+  }
+
+  server_.Stop();
+  client->Close();
+}
+
+TEST_F(Fixture, AcceptRunsOutOfDescriptors) {
+  size_t client_count = 4;
+
+  server_.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  std::vector<int> clients;
+  for (size_t i = 0; i < client_count; ++i) {
+    clients.emplace_back(socket(AF_INET, SOCK_STREAM, 0));
+    ASSERT_NE(-1, clients.back());
+  }
+
+  // Use up all descriptors the process is allowed, so that the server cannot
+  // accept the clients.
+  rlimit old_limit;
+  ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &old_limit));
+  rlimit limit = old_limit;
+  limit.rlim_cur = 256;
+  ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &limit));
+  std::vector<int> fillers;
+  int filler;
+  while ((filler = dup(clients[0])) != -1) {
+    fillers.emplace_back(filler);
+  }
+  ASSERT_EQ(EMFILE, errno);
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(8080);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int client : clients) {
+    ASSERT_EQ(0, connect(client, reinterpret_cast<sockaddr*>(&address),
+                         sizeof(address)));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  for (int filler : fillers) {
+    close(filler);
+  }
+  ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &old_limit));
+
+  // The server is still up, and accepts the clients once it can.
+  DummyHeader header;
+  header.len = 10;
+  std::vector<char> payload(10, 'a');
+  for (int client : clients) {
+    ASSERT_EQ(sizeof(header), write(client, &header, sizeof(header)));
+    ASSERT_EQ(payload.size(), write(client, payload.data(), payload.size()));
+  }
+
+  for (size_t i = 0; i < client_count; ++i) {
+    ASSERT_EQ(10, incoming_.ConsumeOrBlock()->message.size());
+  }
+
+  server_.Stop();
+  for (int client : clients) {
+    close(client);
+  }
+}
+
+TEST(InputChannel, MixedSizesSmallBuffer) {
+  size_t msg_count = 1000;
+
+  TCPServerConfig config;
+  config.read_buffer_size = 128;
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing, config);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+
+  // Some messages fit in the buffer many times over, some do not fit at all.
+  std::thread producer = std::thread([&client, msg_count] {
+    for (size_t i = 0; i < msg_count; ++i) {
+      auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+      message_ptr->header.len = (i * 37) % 1000;
+      message_ptr->message.resize(message_ptr->header.len, i % 128);
+      ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+    }
+  });
+
+  for (size_t i = 0; i < msg_count; ++i) {
+    std::unique_ptr<HeaderAndMessage<DummyHeader>> msg =
+        incoming.ConsumeOrBlock();
+    ASSERT_EQ((i * 37) % 1000, msg->message.size());
+    ASSERT_EQ(std::vector<char>(msg->message.size(), i % 128), msg->message);
+  }
+
+  producer.join();
+  server.Stop();
+  client->Close();
+}
+
+TEST(InputChannel, ZeroCopySlices) {
+  size_t msg_count = 1000;
+
+  TCPServerConfig config;
+  config.read_buffer_size = 1024;
+  MessageQueue<DummyHeader, MessageSlice> incoming;
+  MessageQueue<DummyHeader, MessageSlice> outgoing;
+  TCPServer<DummyHeader, MessageSlice> server(8080, &incoming, &outgoing,
+                                              config);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+
+  std::thread producer = std::thread([&client, msg_count] {
+    for (size_t i = 0; i < msg_count; ++i) {
+      auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+      message_ptr->header.len = (i * 37) % 2000;
+      message_ptr->message.resize(message_ptr->header.len, i % 128);
+      ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+    }
+  });
+
+  // Hold on to all messages, so that the server cannot reuse any buffers.
+  std::vector<std::unique_ptr<HeaderAndMessage<DummyHeader, MessageSlice>>>
+      messages;
+  for (size_t i = 0; i < msg_count; ++i) {
+    messages.emplace_back(incoming.ConsumeOrBlock());
+  }
+
+  for (size_t i = 0; i < msg_count; ++i) {
+    const MessageSlice& slice = messages[i]->message;
+    ASSERT_EQ((i * 37) % 2000, slice.size());
+    ASSERT_EQ(std::vector<char>(slice.size(), i % 128), slice.ToVector());
+  }
+  producer.join();
+
+  // Slices can be sent back as they are.
+  outgoing.ProduceOrBlock(std::move(messages[1]));
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+      client->ReadFromSocket();
+  ASSERT_TRUE(reply);
+  ASSERT_EQ(std::vector<char>(37, 1), reply->message);
+
+  server.Stop();
+  client->Close();
+}
+
+TEST(InputChannel, ZeroCopySlicesReleased) {
+  size_t msg_count = 10000;
+
+  TCPServerConfig config;
+  config.read_buffer_size = 1024;
+  MessageQueue<DummyHeader, MessageSlice> incoming;
+  MessageQueue<DummyHeader, MessageSlice> outgoing;
+  TCPServer<DummyHeader, MessageSlice> server(8080, &incoming, &outgoing,
+                                              config);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+
+  std::thread producer = std::thread([&client, msg_count] {
+    for (size_t i = 0; i < msg_count; ++i) {
+      auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+      message_ptr->header.len = (i * 37) % 200;
+      message_ptr->message.resize(message_ptr->header.len, i % 128);
+      ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+    }
+  });
+
+  // Messages are dropped as soon as they have been looked at, the server
+  // reuses their buffers.
+  for (size_t i = 0; i < msg_count; ++i) {
+    std::unique_ptr<HeaderAndMessage<DummyHeader, MessageSlice>> msg =
+        incoming.ConsumeOrBlock();
+    ASSERT_EQ((i * 37) % 200, msg->message.size());
+    ASSERT_EQ(std::vector<char>(msg->message.size(), i % 128),
+              msg->message.ToVector());
+  }
+
+  producer.join();
+  server.Stop();
+  client->Close();
+}
+
+template <typename Queue>
+void RunWithQueues(size_t num_reactors) {
+  size_t connection_count = 8;
+  size_t msg_count = 1000;
+
+  TCPServerConfig config;
+  config.num_reactors = num_reactors;
+  Queue incoming;
+  Queue outgoing;
+  TCPServer<DummyHeader, std::vector<char>, Queue> server(8080, &incoming,
+                                                          &outgoing, config);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  std::vector<std::thread> producers;
+  for (size_t i = 0; i < connection_count; ++i) {
+    producers.emplace_back([msg_count] {
+      auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+      for (size_t i = 0; i < msg_count; ++i) {
+        auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+        message_ptr->header.len = 100;
+        message_ptr->message.resize(100);
+        ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+      }
+
+      // Wait for a reply, to make sure the connection stays up until all
+      // messages are read.
+      ASSERT_TRUE(client->ReadFromSocket());
+      client->Close();
+    });
+  }
+
+  std::map<uint64_t, size_t> count_per_connection;
+  for (size_t i = 0; i < connection_count * msg_count; ++i) {
+    std::unique_ptr<HeaderAndMessage<DummyHeader>> msg =
+        incoming.ConsumeOrBlock();
+    ASSERT_EQ(100, msg->message.size());
+    if (++count_per_connection[msg->connection_id] == msg_count) {
+      outgoing.ProduceOrBlock(std::move(msg));
+    }
+  }
+
+  for (auto& producer : producers) {
+    producer.join();
+  }
+
+  server.Stop();
+  ASSERT_EQ(connection_count, count_per_connection.size());
+}
+
+TEST(LockFreeQueues, SPSC) { RunWithQueues<SPSCMessageQueue<DummyHeader>>(1); }
+
+TEST(LockFreeQueues, MPMC) { RunWithQueues<MPMCMessageQueue<DummyHeader>>(4); }
+
+// Capacity of MessageQueue and the other lock-free queues.
+static constexpr size_t kRingQueueCapacity = 1024;
+
+TEST(Backpressure, OversizedMessageClosesConnection) {
+  TCPServerConfig config;
+  config.max_message_size = 1000;
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing, config);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+
+  auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+  message_ptr->header.len = 2000;
+  message_ptr->message.resize(2000);
+  client->WriteToSocket(std::move(message_ptr));
+
+  // The server hangs up instead of replying.
+  ASSERT_FALSE(client->ReadFromSocket());
+  ASSERT_EQ(0, incoming.size());
+
+  server.Stop();
+  client->Close();
+}
+
+// Fills the default incoming queue from one connection and checks that
+// another one is still served.
+void FloodFullQueue(const TCPServerConfig& config) {
+  size_t msg_count = 5000;
+
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing, config);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto flood_client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  auto other_client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+
+  auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+  message_ptr->header.len = 10;
+  message_ptr->message.resize(10);
+  ASSERT_TRUE(other_client->WriteToSocket(std::move(message_ptr)));
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> request =
+      incoming.ConsumeOrBlock();
+
+  // Nobody consumes the incoming queue while this client sends more than it
+  // can hold.
+  std::thread producer = std::thread([&flood_client, msg_count] {
+    for (size_t i = 0; i < msg_count; ++i) {
+      auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+      message_ptr->header.len = i % 100;
+      message_ptr->message.resize(i % 100);
+      ASSERT_TRUE(flood_client->WriteToSocket(std::move(message_ptr)));
+    }
+  });
+
+  while (incoming.size() < kRingQueueCapacity) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  // The reactor that owns the flooding connection still serves others.
+  outgoing.ProduceOrBlock(std::move(request));
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+      other_client->ReadFromSocket();
+  ASSERT_TRUE(reply);
+  ASSERT_EQ(10, reply->message.size());
+
+  // Nothing was lost or reordered while the connection was paused.
+  for (size_t i = 0; i < msg_count; ++i) {
+    std::unique_ptr<HeaderAndMessage<DummyHeader>> msg =
+        incoming.ConsumeOrBlock();
+    ASSERT_TRUE(msg);
+    ASSERT_EQ(i % 100, msg->message.size());
+  }
+
+  producer.join();
+  server.Stop();
+  flood_client->Close();
+  other_client->Close();
+}
+
+TEST(Backpressure, FullQueueDoesNotStallReactor) {
+  FloodFullQueue(TCPServerConfig());
+}
+
+// Paused connections stop the poller from receiving their data.
+TEST(Backpressure, FullQueueDoesNotStallIoUringReactor) {
+  TCPServerConfig config;
+  config.backend = TCPServerBackend::kIoUring;
+  FloodFullQueue(config);
+}
+
+TEST(Backpressure, DropWhenQueueFull) {
+  size_t msg_count = 2000;
+
+  using Queue = SPSCMessageQueue<DummyHeader>;
+  TCPServerConfig config;
+  config.ingest_overflow_policy = IngestOverflowPolicy::kDrop;
+  Queue incoming;
+  Queue outgoing;
+  TCPServer<DummyHeader, std::vector<char>, Queue> server(8080, &incoming,
+                                                          &outgoing, config);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  for (size_t i = 0; i < msg_count; ++i) {
+    auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+    message_ptr->header.len = 100;
+    message_ptr->message.resize(100);
+    ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+  }
+
+  // Whatever did not fit in the queue is gone.
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  ASSERT_EQ(kRingQueueCapacity, incoming.Drain().size());
+
+  // The connection is still usable.
+  auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+  message_ptr->header.len = 10;
+  message_ptr->message.resize(10);
+  ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> msg =
+      incoming.ConsumeOrBlock();
+  ASSERT_EQ(10, msg->message.size());
+
+  server.Stop();
+  client->Close();
+}
+
+struct RpcHeader {
+  static size_t MessageSize(const RpcHeader& header) { return header.len; }
+
+  static uint64_t CorrelationId(const RpcHeader& header) { return header.id; }
+
+  static void SetCorrelationId(uint64_t id, RpcHeader* header) {
+    header->id = id;
+  }
+
+  uint64_t id;
+  uint32_t len;
+};
+
+// Echoes requests back, replying to each batch of requests in reverse order.
+void EchoInReverse(MessageQueue<RpcHeader>* incoming,
+                   MessageQueue<RpcHeader>* outgoing) {
+  std::vector<std::unique_ptr<HeaderAndMessage<RpcHeader>>> batch;
+  while (true) {
+    bool timed_out;
+    if (ConsumeUpTo(incoming, 16, std::chrono::milliseconds(100), &batch,
+                    &timed_out) == 0) {
+      if (timed_out) {
+        continue;
+      }
+
+      return;
+    }
+
+    std::reverse(batch.begin(), batch.end());
+    ProduceBatch(outgoing, &batch);
+  }
+}
+
+TEST(AsyncClientConnection, PipelinedOutOfOrder) {
+  size_t msg_count = 10000;
+
+  MessageQueue<RpcHeader> incoming;
+  MessageQueue<RpcHeader> outgoing;
+  TCPServer<RpcHeader> server(8080, &incoming, &outgoing);
+  server.Start();
+  std::thread echo([&incoming, &outgoing] {
+    EchoInReverse(&incoming, &outgoing);
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = AsyncClientConnection<RpcHeader>::Connect("127.0.0.1", 8080);
+  ASSERT_TRUE(client);
+
+  std::mutex mu;
+  std::condition_variable all_done;
+  size_t replies = 0;
+  size_t mismatched = 0;
+  for (size_t i = 0; i < msg_count; ++i) {
+    auto message_ptr = make_unique<HeaderAndMessage<RpcHeader>>(-1);
+    message_ptr->header.len = i % 100;
+    message_ptr->message.resize(message_ptr->header.len, i % 128);
+
+    std::vector<char> expected = message_ptr->message;
+    ASSERT_TRUE(client->Send(
+        std::move(message_ptr),
+        [&, expected](std::unique_ptr<HeaderAndMessage<RpcHeader>> reply) {
+          std::lock_guard<std::mutex> lock(mu);
+          if (!reply || reply->message != expected) {
+            ++mismatched;
+          }
+
+          if (++replies == msg_count) {
+            all_done.notify_all();
+          }
+        }));
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mu);
+    all_done.wait(lock, [&] { return replies == msg_count; });
+  }
+
+  ASSERT_EQ(0, mismatched);
+  ASSERT_EQ(0, client->outstanding());
+  client->Close();
+  server.Stop();
+  incoming.Close();
+  echo.join();
+}
+
+TEST(AsyncClientConnection, FailsOutstandingOnClose) {
+  MessageQueue<RpcHeader> incoming;
+  MessageQueue<RpcHeader> outgoing;
+  TCPServer<RpcHeader> server(8080, &incoming, &outgoing);
+  server.Start();
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = AsyncClientConnection<RpcHeader>::Connect("127.0.0.1", 8080);
+  ASSERT_TRUE(client);
+
+  // Nobody replies.
+  std::atomic<size_t> failed(0);
+  for (size_t i = 0; i < 10; ++i) {
+    auto message_ptr = make_unique<HeaderAndMessage<RpcHeader>>(-1);
+    message_ptr->header.len = 0;
+    ASSERT_TRUE(client->Send(
+        std::move(message_ptr),
+        [&failed](std::unique_ptr<HeaderAndMessage<RpcHeader>> reply) {
+          if (!reply) {
+            ++failed;
+          }
+        }));
+  }
+
+  client->Close();
+  ASSERT_EQ(10, failed);
+  ASSERT_TRUE(client->broken());
+  ASSERT_FALSE(client->Send(make_unique<HeaderAndMessage<RpcHeader>>(-1),
+                            [](std::unique_ptr<HeaderAndMessage<RpcHeader>>) {
+                            }));
+  server.Stop();
+}
+
+TEST(AsyncClientConnection, DestroyedFromCallback) {
+  MessageQueue<RpcHeader> incoming;
+  MessageQueue<RpcHeader> outgoing;
+  TCPServer<RpcHeader> server(8080, &incoming, &outgoing);
+  server.Start();
+  std::thread echo([&incoming, &outgoing] {
+    EchoInReverse(&incoming, &outgoing);
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  std::unique_ptr<AsyncClientConnection<RpcHeader>> client =
+      AsyncClientConnection<RpcHeader>::Connect("127.0.0.1", 8080);
+  ASSERT_TRUE(client);
+
+  // The last reference goes away on the background thread, once Send is
+  // done with the connection.
+  std::mutex mu;
+  std::condition_variable cv;
+  bool sent = false;
+  bool destroyed = false;
+  auto message_ptr = make_unique<HeaderAndMessage<RpcHeader>>(-1);
+  message_ptr->header.len = 0;
+  ASSERT_TRUE(client->Send(
+      std::move(message_ptr),
+      [&](std::unique_ptr<HeaderAndMessage<RpcHeader>> reply) {
+        ASSERT_TRUE(reply);
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&sent] { return sent; });
+        client.reset();
+        destroyed = true;
+        cv.notify_all();
+      }));
+
+  {
+    std::unique_lock<std::mutex> lock(mu);
+    sent = true;
+    cv.notify_all();
+    cv.wait(lock, [&destroyed] { return destroyed; });
+  }
+
+  server.Stop();
+  incoming.Close();
+  echo.join();
+}
+
+TEST(AsyncClientConnection, ConnectFails) {
+  ASSERT_FALSE(AsyncClientConnection<RpcHeader>::Connect("127.0.0.1", 8080));
+}
+
+TEST(AsyncClientConnection, ConnectTimesOut) {
+  using namespace std::chrono;
+
+  // A server that never accepts. Once its backlog is full connection
+  // attempts go unanswered.
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t address_len = sizeof(address);
+  ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr*>(&address),
+                    sizeof(address)));
+  ASSERT_EQ(0, listen(listener, 0));
+  ASSERT_EQ(0, getsockname(listener, reinterpret_cast<sockaddr*>(&address),
+                           &address_len));
+  uint32_t port = ntohs(address.sin_port);
+
+  std::vector<std::unique_ptr<AsyncClientConnection<RpcHeader>>> clients;
+  auto start = steady_clock::now();
+  while (true) {
+    auto client = AsyncClientConnection<RpcHeader>::Connect(
+        "127.0.0.1", port, milliseconds(100));
+    if (!client) {
+      break;
+    }
+
+    clients.emplace_back(std::move(client));
+    ASSERT_GT(10, clients.size());
+  }
+
+  ASSERT_GT(seconds(2), steady_clock::now() - start);
+  clients.clear();
+  close(listener);
+}
+
+// Sends msg_count requests through a pool, waits for all replies and returns
+// the number of requests that did not get the right reply.
+size_t SendThroughPool(ClientConnectionPool<RpcHeader>* pool,
+                       size_t msg_count) {
+  std::mutex mu;
+  std::condition_variable all_done;
+  size_t replies = 0;
+  size_t mismatched = 0;
+  for (size_t i = 0; i < msg_count; ++i) {
+    auto message_ptr = make_unique<HeaderAndMessage<RpcHeader>>(-1);
+    message_ptr->header.len = i % 100;
+    message_ptr->message.resize(message_ptr->header.len, i % 128);
+
+    std::vector<char> expected = message_ptr->message;
+    bool sent = pool->Send(
+        std::move(message_ptr),
+        [&, expected](std::unique_ptr<HeaderAndMessage<RpcHeader>> reply) {
+          std::lock_guard<std::mutex> lock(mu);
+          if (!reply || reply->message != expected) {
+            ++mismatched;
+          }
+
+          if (++replies == msg_count) {
+            all_done.notify_all();
+          }
+        });
+    if (!sent) {
+      std::lock_guard<std::mutex> lock(mu);
+      ++mismatched;
+      ++replies;
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mu);
+  all_done.wait(lock, [&] { return replies == msg_count; });
+  return mismatched;
+}
+
+class PoolFixture
+    : public ::testing::TestWithParam<LoadBalancingPolicy> {};
+
+TEST_P(PoolFixture, SpreadsRequests) {
+  MessageQueue<RpcHeader> incoming;
+  MessageQueue<RpcHeader> outgoing;
+  TCPServer<RpcHeader> server(8080, &incoming, &outgoing);
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  // Echoes requests and counts them per connection.
+  std::map<uint64_t, size_t> count_per_connection;
+  std::thread echo([&incoming, &outgoing, &count_per_connection] {
+    while (auto msg = incoming.ConsumeOrBlock()) {
+      ++count_per_connection[msg->connection_id];
+      outgoing.ProduceOrBlock(std::move(msg));
+    }
+  });
+
+  ClientConnectionPoolConfig config;
+  config.connections_per_server = 4;
+  config.policy = GetParam();
+  ClientConnectionPool<RpcHeader> pool({{"127.0.0.1", 8080}}, config);
+  ASSERT_EQ(4, pool.healthy_connections());
+  ASSERT_EQ(0, SendThroughPool(&pool, 10000));
+
+  server.Stop();
+  incoming.Close();
+  echo.join();
+  ASSERT_LT(1, count_per_connection.size());
+}
+
+INSTANTIATE_TEST_CASE_P(Policies, PoolFixture,
+                        ::testing::Values(
+                            LoadBalancingPolicy::kRoundRobin,
+                            LoadBalancingPolicy::kLeastOutstanding));
+
+TEST(ClientConnectionPool, Reconnects) {
+  ClientConnectionPoolConfig config;
+  config.connections_per_server = 2;
+  config.min_reconnect_delay = std::chrono::milliseconds(10);
+  config.max_reconnect_delay = std::chrono::milliseconds(100);
+  ClientConnectionPool<RpcHeader> pool({{"127.0.0.1", 8080}}, config);
+
+  // Nothing to connect to yet.
+  ASSERT_EQ(0, pool.healthy_connections());
+  ASSERT_FALSE(pool.Send(make_unique<HeaderAndMessage<RpcHeader>>(-1),
+                         [](std::unique_ptr<HeaderAndMessage<RpcHeader>>) {}));
+
+  MessageQueue<RpcHeader> incoming;
+  MessageQueue<RpcHeader> outgoing;
+  {
+    TCPServer<RpcHeader> server(8080, &incoming, &outgoing);
+    server.Start();
+    std::thread echo([&incoming, &outgoing] {
+      EchoInReverse(&incoming, &outgoing);
+    });
+
+    while (pool.healthy_connections() != 2) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    ASSERT_EQ(0, SendThroughPool(&pool, 1000));
+    server.Stop();
+    incoming.Close();
+    echo.join();
+  }
+
+  // The server is gone, its connections should be noticed as broken.
+  while (pool.healthy_connections() != 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+TEST(ConnectionSlab, StaleIds) {
+  ConnectionSlab<int> slab;
+  ASSERT_EQ(nullptr, slab.FindBySocket(5));
+
+  uint64_t id = slab.Add(5, 10);
+  ASSERT_EQ(5, ConnectionIdSocket(id));
+  ASSERT_EQ(1, slab.size());
+  ASSERT_EQ(10, *slab.Find(id));
+  ASSERT_EQ(10, *slab.FindBySocket(5));
+
+  // The socket is reused by a new connection, the old id should not find it.
+  slab.Remove(5);
+  ASSERT_EQ(0, slab.size());
+  ASSERT_EQ(nullptr, slab.Find(id));
+  uint64_t new_id = slab.Add(5, 20);
+  ASSERT_NE(id, new_id);
+  ASSERT_EQ(5, ConnectionIdSocket(new_id));
+  ASSERT_EQ(nullptr, slab.Find(id));
+  ASSERT_EQ(20, *slab.Find(new_id));
+
+  // Ids assigned by another slab.
+  ConnectionSlab<int> other_slab;
+  other_slab.AddWithId(new_id, 30);
+  ASSERT_EQ(30, *other_slab.Find(new_id));
+  ASSERT_EQ(std::vector<int>({5}), other_slab.Sockets());
+  ASSERT_EQ(nullptr, other_slab.Find(id));
+  ASSERT_EQ(nullptr, other_slab.FindBySocket(1000));
+}
+
+TEST(HandlerPool, OrderedPerConnection) {
+  size_t connection_count = 8;
+  size_t msg_count = 200;
+
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing);
+
+  // Tracks how many messages are being handled, in total and per connection.
+  std::mutex mu;
+  std::map<uint64_t, size_t> running_per_connection;
+  size_t running = 0;
+  size_t max_running = 0;
+  bool overlapped = false;
+
+  HandlerPool<DummyHeader> handlers(
+      &server, &incoming,
+      [&](std::unique_ptr<HeaderAndMessage<DummyHeader>> msg,
+          std::vector<std::unique_ptr<HeaderAndMessage<DummyHeader>>>*
+              replies) {
+        {
+          std::lock_guard<std::mutex> lock(mu);
+          overlapped |= ++running_per_connection[msg->connection_id] > 1;
+          max_running = std::max(max_running, ++running);
+        }
+
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        {
+          std::lock_guard<std::mutex> lock(mu);
+          --running_per_connection[msg->connection_id];
+          --running;
+        }
+
+        replies->emplace_back(std::move(msg));
+      },
+      4);
+
+  server.Start();
+  handlers.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  std::vector<std::thread> clients;
+  for (size_t i = 0; i < connection_count; ++i) {
+    clients.emplace_back([msg_count] {
+      auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+      for (size_t i = 0; i < msg_count; ++i) {
+        auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+        message_ptr->header.len = i % 100;
+        message_ptr->message.resize(i % 100);
+        ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+      }
+
+      for (size_t i = 0; i < msg_count; ++i) {
+        std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+            client->ReadFromSocket();
+        ASSERT_TRUE(reply);
+        ASSERT_EQ(i % 100, reply->message.size());
+      }
+
+      client->Close();
+    });
+  }
+
+  for (auto& client : clients) {
+    client.join();
+  }
+
+  handlers.Stop();
+  server.Stop();
+  ASSERT_FALSE(overlapped);
+  ASSERT_LT(1, max_running);
+}
+
+TEST(Shutdown, DrainSendsQueuedReplies) {
+  size_t msg_count = 5000;
+
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+  message_ptr->header.len = 10;
+  message_ptr->message.resize(10);
+  ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+  uint64_t id = incoming.ConsumeOrBlock()->connection_id;
+
+  // More than the socket buffers hold, most of it is still in the outgoing
+  // queue or on the connection when draining starts.
+  for (size_t i = 0; i < msg_count; ++i) {
+    auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(id);
+    message_ptr->header.len = 1000;
+    message_ptr->message.resize(1000);
+    outgoing.ProduceOrBlock(std::move(message_ptr));
+  }
+
+  std::thread reader([&client, msg_count] {
+    for (size_t i = 0; i < msg_count; ++i) {
+      ASSERT_TRUE(client->ReadFromSocket());
+    }
+
+    // Closed by the server once everything has been sent.
+    ASSERT_FALSE(client->ReadFromSocket());
+  });
+
+  ASSERT_TRUE(server.Drain(std::chrono::steady_clock::now() +
+                           std::chrono::seconds(10)));
+  reader.join();
+  client->Close();
+}
+
+TEST(Shutdown, DrainGivesUpAtDeadline) {
+  using namespace std::chrono;
+
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing);
+
+  server.Start();
+  std::this_thread::sleep_for(milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+  message_ptr->header.len = 10;
+  message_ptr->message.resize(10);
+  ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+  uint64_t id = incoming.ConsumeOrBlock()->connection_id;
+
+  // The client never reads.
+  for (size_t i = 0; i < 1000; ++i) {
+    auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(id);
+    message_ptr->header.len = 10000;
+    message_ptr->message.resize(10000);
+    outgoing.ProduceOrBlock(std::move(message_ptr));
+  }
+
+  auto start = steady_clock::now();
+  ASSERT_FALSE(server.Drain(start + milliseconds(200)));
+  ASSERT_GT(milliseconds(500), steady_clock::now() - start);
+  client->Close();
+}
+
+TEST(Metrics, CountsTraffic) {
+  size_t msg_count = 100;
+  size_t frame_size = sizeof(DummyHeader) + 100;
+
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing);
+
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  for (size_t i = 0; i < msg_count; ++i) {
+    auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+    message_ptr->header.len = 100;
+    message_ptr->message.resize(100);
+    ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+  }
+
+  for (size_t i = 0; i < msg_count; ++i) {
+    outgoing.ProduceOrBlock(incoming.ConsumeOrBlock());
+  }
+
+  for (size_t i = 0; i < msg_count; ++i) {
+    ASSERT_TRUE(client->ReadFromSocket());
+  }
+
+  // The last write is recorded after the reply reaches the client.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::map<uint64_t, ConnectionStats> connection_stats =
+      server.GetConnectionStats();
+  ASSERT_EQ(1, connection_stats.size());
+  const ConnectionStats& stats = connection_stats.begin()->second;
+  ASSERT_EQ(msg_count, stats.frames_in);
+  ASSERT_EQ(msg_count, stats.frames_out);
+  ASSERT_EQ(msg_count * frame_size, stats.bytes_in);
+  ASSERT_EQ(msg_count * frame_size, stats.bytes_out);
+  ASSERT_LE(1, stats.reads);
+  ASSERT_LE(1, stats.writes);
+  ASSERT_EQ(0, stats.ingest_stalls);
+
+  // Totals survive the connection.
+  client->Close();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  TCPServerStats server_stats = server.GetStats();
+  ASSERT_TRUE(server.GetConnectionStats().empty());
+  ASSERT_EQ(1, server_stats.connections_accepted);
+  ASSERT_EQ(1, server_stats.connections_closed);
+  ASSERT_EQ(msg_count, server_stats.connections.frames_in);
+  ASSERT_EQ(msg_count * frame_size, server_stats.connections.bytes_out);
+  ASSERT_EQ(msg_count, server_stats.frame_sizes.count());
+  ASSERT_EQ(msg_count, server_stats.outgoing_dwell_us.count());
+  ASSERT_LE(frame_size, server_stats.frame_sizes.Quantile(0.5));
+  ASSERT_GT(2 * frame_size, server_stats.frame_sizes.Quantile(0.5));
+
+  server.Stop();
+}
+
+TEST(Metrics, HistogramQuantiles) {
+  Log2Histogram histogram;
+  HistogramSnapshot empty;
+  histogram.AddTo(&empty);
+  ASSERT_EQ(0, empty.Quantile(0.5));
+
+  histogram.Add(0);
+  for (size_t i = 0; i < 98; ++i) {
+    histogram.Add(5);
+  }
+  histogram.Add(1000);
+
+  HistogramSnapshot snapshot;
+  histogram.AddTo(&snapshot);
+  ASSERT_EQ(100, snapshot.count());
+  ASSERT_EQ(0, snapshot.Quantile(0));
+  ASSERT_EQ(7, snapshot.Quantile(0.5));
+  ASSERT_EQ(7, snapshot.Quantile(0.99));
+  ASSERT_EQ(1023, snapshot.Quantile(1));
+}
+
+// Returns a temporary file with the given contents. The file is unlinked
+// straight away and goes away once closed.
+std::shared_ptr<const SharedFile> TempFile(const std::vector<char>& contents) {
+  char path[] = "/tmp/server_test_XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1);
+  unlink(path);
+  CHECK(BlockingRawWriteToSocket(fd, contents.data(), contents.size()));
+  return std::make_shared<SharedFile>(fd);
+}
+
+std::vector<char> Pattern(size_t size, char seed) {
+  std::vector<char> out(size);
+  for (size_t i = 0; i < size; ++i) {
+    out[i] = static_cast<char>(seed + i % 251);
+  }
+
+  return out;
+}
+
+TEST(LargePayloads, FileRegion) {
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing);
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  std::vector<char> contents = Pattern(1 << 22, 'a');
+  std::shared_ptr<const SharedFile> file = TempFile(contents);
+  size_t region_offset = 100;
+  size_t region_length = contents.size() - 200;
+  std::vector<char> expected = {'x', 'y', 'z'};
+  expected.insert(expected.end(), contents.begin() + region_offset,
+                  contents.begin() + region_offset + region_length);
+
+  // From the client, with a blocking socket.
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  ASSERT_TRUE(client);
+  auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+  message_ptr->message = {'x', 'y', 'z'};
+  message_ptr->file = FileRegion(file, region_offset, region_length);
+  message_ptr->header.len = expected.size();
+  ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> received =
+      incoming.ConsumeOrBlock();
+  ASSERT_EQ(expected, received->message);
+
+  // From the server, a few times over in a row followed by a message without
+  // a file region.
+  size_t region_count = 4;
+  for (size_t i = 0; i < region_count + 1; ++i) {
+    auto reply = make_unique<HeaderAndMessage<DummyHeader>>(
+        received->connection_id);
+    reply->message = {'x', 'y', 'z'};
+    if (i < region_count) {
+      reply->file = FileRegion(file, region_offset, region_length);
+    }
+
+    reply->header.len = reply->message.size() + reply->file.length;
+    outgoing.ProduceOrBlock(std::move(reply));
+  }
+
+  for (size_t i = 0; i < region_count; ++i) {
+    std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+        client->ReadFromSocket();
+    ASSERT_TRUE(reply);
+    ASSERT_EQ(expected, reply->message);
+  }
+
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+      client->ReadFromSocket();
+  ASSERT_TRUE(reply);
+  ASSERT_EQ(std::vector<char>({'x', 'y', 'z'}), reply->message);
+
+  client->Close();
+  server.Stop();
+}
+
+TEST(LargePayloads, ZeroCopy) {
+  size_t msg_count = 64;
+  size_t msg_size = 1 << 18;
+
+  MessageQueue<DummyHeader> incoming;
+  MessageQueue<DummyHeader> outgoing;
+  TCPServerConfig config;
+  config.zerocopy_min_bytes = 1 << 14;
+  TCPServer<DummyHeader> server(8080, &incoming, &outgoing, config);
+  server.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+  ASSERT_TRUE(client);
+  auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+  message_ptr->header.len = 10;
+  message_ptr->message.resize(10);
+  ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+  uint64_t id = incoming.ConsumeOrBlock()->connection_id;
+
+  // Large messages go out with MSG_ZEROCOPY, interleaved with small ones
+  // that are copied. The last one closes the connection.
+  for (size_t i = 0; i < msg_count; ++i) {
+    size_t size = i % 2 == 0 ? msg_size : 10;
+    auto reply = make_unique<HeaderAndMessage<DummyHeader>>(id);
+    reply->header.len = size;
+    reply->message = Pattern(size, 'a' + i);
+    reply->last_in_connection = i == msg_count - 1;
+    outgoing.ProduceOrBlock(std::move(reply));
+  }
+
+  for (size_t i = 0; i < msg_count; ++i) {
+    size_t size = i % 2 == 0 ? msg_size : 10;
+    std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+        client->ReadFromSocket();
+    ASSERT_TRUE(reply);
+    ASSERT_EQ(Pattern(size, 'a' + i), reply->message);
+  }
+
+  // Closed once the kernel is done with the last message.
+  ASSERT_FALSE(client->ReadFromSocket());
+  client->Close();
+  server.Stop();
+}
+
+TEST(LargePayloads, ZeroCopyTracker) {
+  ZeroCopyTracker tracker;
+  ASSERT_FALSE(tracker.in_flight());
+  for (uint32_t i = 0; i < 5; ++i) {
+    ASSERT_EQ(i, tracker.Sent());
+  }
+
+  ASSERT_TRUE(tracker.in_flight());
+  tracker.Completed(0, 1);
+  ASSERT_TRUE(tracker.Done(1));
+  ASSERT_FALSE(tracker.Done(2));
+
+  tracker.Completed(3, 4);
+  ASSERT_FALSE(tracker.Done(3));
+  ASSERT_TRUE(tracker.in_flight());
+  tracker.Completed(2, 2);
+  ASSERT_TRUE(tracker.Done(4));
+  ASSERT_FALSE(tracker.in_flight());
+}
+
+TEST(MessagePool, Recycle) {
+  MessagePool<DummyHeader> pool;
+
+  auto msg = pool.Acquire(1, 100);
+  ASSERT_EQ(100, msg->message.size());
+  HeaderAndMessage<DummyHeader>* raw_msg = msg.get();
+
+  pool.Release(std::move(msg));
+  ASSERT_EQ(1, pool.size());
+
+  // Same size class, the message should be reused without reallocating.
+  msg = pool.Acquire(2, 120);
+  ASSERT_EQ(raw_msg, msg.get());
+  ASSERT_EQ(2, msg->connection_id);
+  ASSERT_EQ(120, msg->message.size());
+  ASSERT_EQ(0, pool.size());
+
+  // Different size class.
+  auto large_msg = pool.Acquire(3, 10000);
+  ASSERT_NE(raw_msg, large_msg.get());
+  pool.Release(std::move(msg));
+  pool.Release(std::move(large_msg));
+  ASSERT_EQ(2, pool.size());
+}
+
+TEST(MessagePool, TooLarge) {
+  MessagePool<DummyHeader> pool;
+
+  auto msg = pool.Acquire(1, 1 << 25);
+  ASSERT_EQ(1 << 25, msg->message.size());
+  pool.Release(std::move(msg));
+  ASSERT_EQ(0, pool.size());
+}
+
+// Waits for events until one matches pred, which is then returned.
+template <typename Pred>
+PollerEvent WaitForEvent(Poller* poller, Pred pred) {
+  std::vector<PollerEvent> events;
+  for (size_t i = 0; i < 100; ++i) {
+    CHECK(poller->Wait(std::chrono::milliseconds(100), &events));
+    for (const PollerEvent& event : events) {
+      if (pred(event)) {
+        return event;
+      }
+    }
+  }
+
+  LOG(FATAL) << "No matching event";
+  return PollerEvent();
+}
+
+TEST(Poller, IoUringAcceptsAndReceives) {
+  std::unique_ptr<Poller> poller = NewPoller(TCPServerBackend::kIoUring);
+  if (!poller->ReceivesData()) {
+    // Older kernel, or a build without io_uring.
+    return;
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t address_len = sizeof(address);
+  ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr*>(&address),
+                    sizeof(address)));
+  ASSERT_EQ(0, listen(listener, 16));
+  ASSERT_EQ(0, getsockname(listener, reinterpret_cast<sockaddr*>(&address),
+                           &address_len));
+  ASSERT_TRUE(poller->AcceptsConnections());
+  ASSERT_TRUE(poller->Listen(listener));
+
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(0, connect(client, reinterpret_cast<sockaddr*>(&address),
+                       sizeof(address)));
+  int connection = WaitForEvent(poller.get(), [](const PollerEvent& event) {
+                     return event.accepted;
+                   }).fd;
+  ASSERT_TRUE(poller->Add(connection));
+
+  auto has_data = [connection](const PollerEvent& event) {
+    return event.fd == connection && event.data_len != 0;
+  };
+  ASSERT_EQ(5, write(client, "hello", 5));
+  PollerEvent event = WaitForEvent(poller.get(), has_data);
+  ASSERT_EQ("hello", std::string(event.data, event.data_len));
+
+  // Nothing is received while reading is disabled.
+  std::vector<PollerEvent> events;
+  poller->SetReadInterest(connection, false);
+  ASSERT_TRUE(poller->Wait(std::chrono::milliseconds(10), &events));
+  ASSERT_EQ(4, write(client, "more", 4));
+  ASSERT_TRUE(poller->Wait(std::chrono::milliseconds(100), &events));
+  ASSERT_TRUE(std::none_of(events.begin(), events.end(), has_data));
+
+  poller->SetReadInterest(connection, true);
+  event = WaitForEvent(poller.get(), has_data);
+  ASSERT_EQ("more", std::string(event.data, event.data_len));
+
+  close(client);
+  WaitForEvent(poller.get(), [connection](const PollerEvent& event) {
+    return event.fd == connection && event.receive_ended;
+  });
+
+  poller->Remove(connection);
+  close(connection);
+  poller->Remove(listener);
+  close(listener);
+}
+
+class ConfigFixture : public ::testing::TestWithParam<
+                          std::tuple<TCPServerBackend, size_t, bool>> {
+ public:
+  ConfigFixture() : server_(8080, &incoming_, &outgoing_, GetConfig()) {}
+
+  static TCPServerConfig GetConfig() {
+    TCPServerConfig config;
+    config.backend = std::get<0>(GetParam());
+    config.num_reactors = std::get<1>(GetParam());
+    config.busy_poll = std::get<2>(GetParam());
+    return config;
+  }
+
+  MessageQueue<DummyHeader> incoming_;
+  MessageQueue<DummyHeader> outgoing_;
+  TCPServer<DummyHeader> server_;
+};
+
+TEST_P(ConfigFixture, MultiSimultaneousConnections) {
+  size_t connection_count = 100;
+
+  server_.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  std::vector<std::unique_ptr<ClientConnection<DummyHeader>>> clients;
+  for (size_t i = 0; i < connection_count; ++i) {
+    clients.emplace_back(
+        ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080));
+  }
+
+  for (const auto& client : clients) {
+    auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+    message_ptr->header.len = 10;
+    message_ptr->message.resize(10);
+    ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+  }
+
+  for (size_t i = 0; i < connection_count; ++i) {
+    std::unique_ptr<HeaderAndMessage<DummyHeader>> msg =
+        incoming_.ConsumeOrBlock();
+    ASSERT_EQ(10, msg->message.size());
+  }
+
+  server_.Stop();
+  for (const auto& client : clients) {
+    client->Close();
+  }
+}
+
+TEST_P(ConfigFixture, Reply) {
+  server_.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+
+  auto message_ptr = make_unique<HeaderAndMessage<DummyHeader>>(-1);
+  message_ptr->header.len = 10;
+  message_ptr->message.resize(10);
+  ASSERT_TRUE(client->WriteToSocket(std::move(message_ptr)));
+
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> msg =
+      incoming_.ConsumeOrBlock();
+  msg->message.resize(20);
+  msg->header.len = 20;
+  outgoing_.ProduceOrBlock(std::move(msg));
+
+  std::unique_ptr<HeaderAndMessage<DummyHeader>> reply =
+      client->ReadFromSocket();
+  ASSERT_TRUE(reply);
+  ASSERT_EQ(20, reply->message.size());
+
+  server_.Stop();
+  client->Close();
+}
+
+TEST_P(ConfigFixture, StopIsFast) {
+  using namespace std::chrono;
+
+  server_.Start();
+  std::this_thread::sleep_for(milliseconds(500));
+  auto client = ClientConnection<DummyHeader>::Connect("127.0.0.1", 8080);
+
+  // Nothing is happening, all threads are waiting.
+  std::this_thread::sleep_for(milliseconds(100));
+  auto start = steady_clock::now();
+  server_.Stop();
+  ASSERT_GT(milliseconds(100), steady_clock::now() - start);
+  client->Close();
+}
+
+INSTANTIATE_TEST_CASE_P(
+    Configs, ConfigFixture,
+    ::testing::Combine(::testing::Values(TCPServerBackend::kSelect,
+                                         TCPServerBackend::kEpoll,
+                                         TCPServerBackend::kIoUring),
+                       ::testing::Values(1, 4), ::testing::Bool()));
+
 //
 // TEST_F(Fixture, MultiSimultaneousConnection) {
 //  auto factory = std::unique_ptr<ServerConnectionFactory>(
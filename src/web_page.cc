@@ -1,12 +1,15 @@
 #include "web_page.h"
 
+#include <stdio.h>
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <iterator>
 #include <memory>
 
 #include "ctemplate/template.h"
 #include "ctemplate/template_dictionary.h"
+#include "ctemplate/template_emitter.h"
 #include "ctemplate/template_enums.h"
 #include "ncode_common/src/logging.h"
 #include "ncode_common/src/strutil.h"
@@ -21,6 +24,16 @@ extern "C" const unsigned www_index_html_size;
 extern "C" const unsigned char www_table_blurb_html[];
 extern "C" const unsigned www_table_blurb_html_size;
 
+// Index of all resources, generated along with them.
+extern "C" const char* const www_resource_names[];
+extern "C" const unsigned char* const www_resource_data[];
+extern "C" const unsigned www_resource_sizes[];
+extern "C" const unsigned www_resource_count;
+extern "C" const unsigned char* const www_resource_gzip_data[];
+extern "C" const unsigned www_resource_gzip_sizes[];
+extern "C" const unsigned char* const www_resource_brotli_data[];
+extern "C" const unsigned www_resource_brotli_sizes[];
+
 // A bunch of tags.
 static constexpr char kHTMLOpenTag[] = "<html lang=\"en\">";
 static constexpr char kHeadOpenTag[] = "<head>";
@@ -60,6 +73,26 @@ static constexpr char kJQueryValidators[] =
 static constexpr char kD3JS[] =
     "https://cdnjs.cloudflare.com/ajax/libs/d3/3.5.17/d3.min.js";
 
+static std::atomic<bool> link_to_www_assets(false);
+
+// Returns what a page should link to for a script or stylesheet at a
+// location.
+static std::string LinkedLocation(const std::string& location) {
+  if (!link_to_www_assets) {
+    return location;
+  }
+
+  // If there is no slash npos + 1 wraps around to 0.
+  std::string name = location.substr(location.rfind('/') + 1);
+  const WwwAsset* asset = FindWwwAsset(name);
+  if (asset == nullptr) {
+    return location;
+  }
+
+  // The version makes it safe for clients to cache the file forever.
+  return StrCat(kWwwAssetsPath, asset->name, "?v=", asset->version);
+}
+
 void HtmlPage::AddOrUpdateHeadElement(const std::string& element_id,
                                       const std::string& element) {
   elements_in_head_[element_id] = element;
@@ -81,14 +114,27 @@ void HtmlPage::AddStyle(const std::string& location) {
 void HtmlPage::AddD3() { AddScript(kD3JS); }
 
 std::string HtmlPage::Construct() const {
-  std::string return_string = Substitute("$0$1", kHTMLOpenTag, kHeadOpenTag);
-  StrAppend(&return_string, kTitleOpenTag, title_, kTitleCloseTag);
-  StrAppend(&return_string, ConstructHead());
-  StrAppend(&return_string, kHeadCloseTag, kBodyOpenTag, body_);
-  StrAppend(&return_string, kBodyCloseTag, kHTMLCloseTag, "\n");
+  std::string return_string;
+  ctemplate::StringEmitter emitter(&return_string);
+  ConstructTo(&emitter);
   return return_string;
 }
 
+void HtmlPage::ConstructTo(ctemplate::ExpandEmitter* out) const {
+  out->Emit(kHTMLOpenTag);
+  out->Emit(kHeadOpenTag);
+  out->Emit(kTitleOpenTag);
+  out->Emit(title_);
+  out->Emit(kTitleCloseTag);
+  out->Emit(ConstructHead());
+  out->Emit(kHeadCloseTag);
+  out->Emit(kBodyOpenTag);
+  out->Emit(body_);
+  out->Emit(kBodyCloseTag);
+  out->Emit(kHTMLCloseTag);
+  out->Emit('\n');
+}
+
 std::string HtmlPage::ConstructHead() const {
   std::string return_string;
   for (const auto& id_and_element : elements_in_head_) {
@@ -100,14 +146,14 @@ std::string HtmlPage::ConstructHead() const {
     StrAppend(
         &return_string,
         Substitute("<link rel=\"stylesheet\" type=\"text/css\" href=\"$0\">",
-                   css_location));
+                   LinkedLocation(css_location)));
   }
 
   for (const std::string& script_location : scripts_) {
     StrAppend(&return_string,
               Substitute("<script type=\"text/javascript\" "
                          "charset=\"utf8\" src=\"$0\"></script>",
-                         script_location));
+                         LinkedLocation(script_location)));
   }
 
   if (std::find(scripts_.begin(), scripts_.end(), kJQueryUIJS) !=
@@ -135,10 +181,12 @@ constexpr char TemplatePage::kNavigationMarker[];
 constexpr char TemplatePage::kNavigationUrlMarker[];
 constexpr char TemplatePage::kNavigationNameMarker[];
 
-std::string TemplatePage::Construct() const {
+void TemplatePage::ConstructTo(ctemplate::ExpandEmitter* out) const {
+  // The dictionary does not outlive head and body_, they need not be copied.
+  std::string head = ConstructHead();
   ctemplate::TemplateDictionary dictionary("TemplatePage");
-  dictionary.SetValue(kHeadMarker, ConstructHead());
-  dictionary.SetValue(kBodyMarker, body_);
+  dictionary.SetValueWithoutCopy(kHeadMarker, head);
+  dictionary.SetValueWithoutCopy(kBodyMarker, body_);
 
   for (const auto& entry : navigation_entries_) {
     ctemplate::TemplateDictionary* navigation_dict =
@@ -147,10 +195,8 @@ std::string TemplatePage::Construct() const {
     navigation_dict->SetValue(kNavigationNameMarker, entry.name);
   }
 
-  std::string output;
   CHECK(ctemplate::ExpandTemplate(ctemplate_key_, ctemplate::STRIP_WHITESPACE,
-                                  &dictionary, &output));
-  return output;
+                                  &dictionary, out));
 }
 
 void HtmlTable::ToHtml(HtmlPage* page) const {
@@ -226,6 +272,50 @@ std::unique_ptr<TemplatePage> GetDefaultTemplate() {
   return page;
 }
 
+const std::vector<WwwAsset>& WwwAssets() {
+  static const std::vector<WwwAsset>* assets = [] {
+    auto* out = new std::vector<WwwAsset>();
+    for (size_t i = 0; i < www_resource_count; ++i) {
+      const char* data = reinterpret_cast<const char*>(www_resource_data[i]);
+      size_t size = www_resource_sizes[i];
+      out->push_back(
+          {www_resource_names[i], data, size, ContentVersion(data, size),
+           reinterpret_cast<const char*>(www_resource_gzip_data[i]),
+           www_resource_gzip_sizes[i],
+           reinterpret_cast<const char*>(www_resource_brotli_data[i]),
+           www_resource_brotli_sizes[i]});
+    }
+
+    return out;
+  }();
+  return *assets;
+}
+
+const WwwAsset* FindWwwAsset(const std::string& name) {
+  for (const WwwAsset& asset : WwwAssets()) {
+    if (asset.name == name) {
+      return &asset;
+    }
+  }
+
+  return nullptr;
+}
+
+std::string ContentVersion(const char* data, size_t size) {
+  // 64-bit FNV-1a.
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+
+  char out[17];
+  snprintf(out, sizeof(out), "%016llx", static_cast<unsigned long long>(hash));
+  return out;
+}
+
+void SetLinkToWwwAssets(bool link) { link_to_www_assets = link; }
+
 std::string GetLink(const std::string& location, const std::string& tag) {
   return Substitute("<a href=\"$0\">$1</a>", location, tag);
 }
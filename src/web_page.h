@@ -9,6 +9,10 @@
 
 #include "ncode_common/src/common.h"
 
+namespace ctemplate {
+class ExpandEmitter;
+}  // namespace ctemplate
+
 namespace nc {
 namespace web {
 
@@ -37,6 +41,11 @@ class HtmlPage {
   // Constructs a string with the HTML contents of the web page.
   virtual std::string Construct() const;
 
+  // Emits the HTML contents of the web page piece by piece, without putting
+  // them together in a string first. Produces the same output as Construct.
+  // Subclasses that change the output should override this.
+  virtual void ConstructTo(ctemplate::ExpandEmitter* out) const;
+
   // Returns a non-owning pointer to the head section of the web page.
   std::string* head() { return &head_; }
 
@@ -226,7 +235,7 @@ class TemplatePage : public HtmlPage {
   TemplatePage(const std::string& ctemplate_key)
       : ctemplate_key_(ctemplate_key) {}
 
-  std::string Construct() const override;
+  void ConstructTo(ctemplate::ExpandEmitter* out) const override;
 
   // Adds a new navigation entry.
   void AddNavigationEntry(const NavigationEntry& navigation_entry) {
@@ -252,6 +261,46 @@ std::string GetDiv(const std::string& contents);
 // Wraps contents in <p></p>
 std::string GetP(const std::string& contents);
 
+// A file compiled into the binary from data/www.
+struct WwwAsset {
+  // The file's name, without a directory.
+  std::string name;
+
+  const char* data;
+  size_t size;
+
+  // Changes whenever the contents do, see ContentVersion.
+  std::string version;
+
+  // Copies compressed at build time. Null if the tool to make them was not
+  // found, or if compressing does not make the file smaller.
+  const char* gzip_data;
+  size_t gzip_size;
+  const char* brotli_data;
+  size_t brotli_size;
+};
+
+// Path under which HttpServer::AddWwwAssets serves the files from data/www.
+static constexpr char kWwwAssetsPath[] = "/www/";
+
+// Returns all files compiled in from data/www.
+const std::vector<WwwAsset>& WwwAssets();
+
+// Returns the file with the given name compiled in from data/www, or null if
+// there is none.
+const WwwAsset* FindWwwAsset(const std::string& name);
+
+// Returns a short string that changes whenever the contents do, for ETags
+// and versioned URLs.
+std::string ContentVersion(const char* data, size_t size);
+
+// If set, scripts and stylesheets of pages are linked to the file with the
+// same name in data/www, if there is one, instead of to the CDN. Put
+// d3.min.js in data/www to serve D3 from the binary, for example. Such pages
+// only work when served by an HttpServer that has AddWwwAssets. Off by
+// default.
+void SetLinkToWwwAssets(bool link);
+
 // Starts an accordion section with the given title. Each start must be paired
 // with AccordionEnd.
 void AccordionStart(const std::string& title, HtmlPage* out);
@@ -64,6 +64,33 @@ TEST_F(PageFixture, HeadElement) {
   ASSERT_EQ(expected_twice, page_.Construct());
 }
 
+TEST(WwwAssets, Find) {
+  const WwwAsset* asset = FindWwwAsset("index.html");
+  ASSERT_NE(nullptr, asset);
+  ASSERT_LT(0ul, asset->size);
+  ASSERT_EQ(ContentVersion(asset->data, asset->size), asset->version);
+  ASSERT_EQ(nullptr, FindWwwAsset("missing.js"));
+}
+
+TEST_F(PageFixture, LinkToWwwAssets) {
+  page_.AddScript("https://cdn.example.com/lib/index.html");
+  page_.AddScript("https://cdn.example.com/missing.js");
+  std::string from_cdn = page_.Construct();
+  ASSERT_EQ(std::string::npos, from_cdn.find(kWwwAssetsPath));
+
+  SetLinkToWwwAssets(true);
+  std::string from_www = page_.Construct();
+  SetLinkToWwwAssets(false);
+
+  const WwwAsset* asset = FindWwwAsset("index.html");
+  ASSERT_NE(std::string::npos,
+            from_www.find(StrCat("src=\"", kWwwAssetsPath, "index.html?v=",
+                                 asset->version, "\"")));
+  ASSERT_NE(std::string::npos,
+            from_www.find("src=\"https://cdn.example.com/missing.js\""));
+  ASSERT_EQ(from_cdn, page_.Construct());
+}
+
 TEST_F(PageFixture, Table) {
   HtmlTable table("some_id", {"colA", "colB", "colC"});
   table.AddRow<int>({1, 2, 3});